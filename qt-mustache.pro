@@ -14,7 +14,7 @@ CONFIG -= app_bundle
 }
 
 # Input
-HEADERS += src/mustache.h tests/test_mustache.h
+HEADERS += src/mustache.h tests/test_mustache.h tests/spec_tests.h
 SOURCES += src/mustache.cpp tests/test_mustache.cpp
 
 # Copies the given files to the destination directory
@@ -14,13 +14,135 @@
 
 #include "mustache.h"
 
+#include <QtCore/QCryptographicHash>
 #include <QtCore/QDebug>
 #include <QtCore/QFile>
+#include <QtCore/QMutexLocker>
+#include <QtCore/qnumeric.h>
+#include <QtCore/QSemaphore>
+#include <QtCore/QSet>
+#include <QtCore/QSharedMemory>
+#include <QtCore/QSharedPointer>
 #include <QtCore/QStringList>
 #include <QtCore/QTextStream>
+#include <QtCore/QThreadStorage>
+
+#include <limits>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MUSTACHE_SSE2
+#endif
 
 using namespace Mustache;
 
+namespace Mustache
+{
+
+class TemplateData : public QSharedData
+{
+public:
+	TemplateData()
+		: errorPos(-1)
+		, escaper(0)
+		, nodesPending(0)
+	{}
+	TemplateData(const TemplateData& other);
+
+	QString source;
+	QVector<Node> nodes;
+	QString error;
+	int errorPos;
+
+	// The names and contents of the partials which were inlined by compile().
+	QVector<QPair<QString, QString> > inlinedPartials;
+	const Escaper* escaper;
+	// Identifies the template in fragment cache keys, see updateCacheId().
+	QString cacheId;
+
+	// For templates loaded with Template::fromBinary(), Template::mapBinary() or
+	// from a SharedTemplateStore, the data which the source and node keys refer
+	// to, and the mapped file or shared memory which holds it.
+	QByteArray binary;
+	QSharedPointer<QObject> mapping;
+	// For templates loaded from binary data, 1 until the nodes and inlined
+	// partials have been read from it by decodeNodes().
+	QAtomicInt nodesPending;
+};
+
+void decodeNodes(const TemplateData* data);
+
+TemplateData::TemplateData(const TemplateData& other)
+	: QSharedData(other)
+{
+	decodeNodes(&other);
+	source = other.source;
+	nodes = other.nodes;
+	error = other.error;
+	errorPos = other.errorPos;
+	inlinedPartials = other.inlinedPartials;
+	escaper = other.escaper;
+	cacheId = other.cacheId;
+	binary = other.binary;
+	mapping = other.mapping;
+}
+
+class TemplateSnapshotData : public QSharedData
+{
+public:
+	TemplateSnapshotData()
+		: version(0)
+	{}
+
+	int version;
+	QHash<QString, QString> sources;
+	QHash<QString, Template> templates;
+};
+
+/** A section, list item or partial which is being rendered by Renderer::render(). */
+struct RenderFrame
+{
+	enum Type
+	{
+		Root,
+		Section,
+		ListItem,
+		InvertedSection,
+		Partial
+	};
+
+	RenderFrame()
+		: type(Root)
+		, data(0)
+		, begin(0)
+		, index(0)
+		, end(0)
+		, item(0)
+		, outputStart(0)
+	{}
+
+	Type type;
+	const TemplateData* data;
+	/// The range of nodes to render and the next node to render
+	int begin;
+	int index;
+	int end;
+	/// For ListItem frames, the list and the index of the current item
+	int item;
+	ResolvedValue value;
+	/// For Partial frames, keeps the compiled partial alive while it is rendered
+	QSharedDataPointer<TemplateData> partial;
+	/// For cacheable sections and partials, the key for the FragmentCache and the
+	/// position in the output where the section or partial starts
+	QString cacheKey;
+	qint64 outputStart;
+};
+
+}
+
 QString Mustache::renderTemplate(const QString& templateString, const QVariantHash& args)
 {
 	Mustache::QtVariantContext context(args);
@@ -28,29 +150,220 @@ QString Mustache::renderTemplate(const QString& templateString, const QVariantHa
 	return renderer.render(templateString, &context);
 }
 
-QString escapeHtml(const QString& input)
-{
-	QString escaped(input);
-	for (int i=0; i < escaped.length();) {
-		const char* replacement = 0;
-		ushort ch = escaped.at(i).unicode();
-		if (ch == '&') {
-			replacement = "&amp;";
-		} else if (ch == '<') {
-			replacement = "&lt;";
-		} else if (ch == '>') {
-			replacement = "&gt;";
-		} else if (ch == '"') {
-			replacement = "&quot;";
-		}
-		if (replacement) {
-			escaped.replace(i, 1, QLatin1String(replacement));
-			i += (int)strlen(replacement);
-		} else {
-			++i;
+/** The escapers returned by Escaper::html(), xml(), json() and javaScript().
+ *
+ * Text is scanned for characters which need escaping, eight at a time when
+ * SSE2 is available, and appended to the output in runs between them, so
+ * each value is escaped in a single pass without building another string.
+ */
+class BuiltInEscaper : public Escaper
+{
+public:
+	enum Format
+	{
+		Html,
+		Xml,
+		Json,
+		JavaScript
+	};
+
+	explicit BuiltInEscaper(Format format)
+		: m_format(format)
+	{}
+
+	virtual void append(const QString& text, QString& output) const;
+
+private:
+	bool isSpecial(ushort ch) const;
+	int findSpecial(const QChar* data, int from, int length) const;
+	void appendReplacement(ushort ch, QString& output) const;
+
+	Format m_format;
+};
+
+bool BuiltInEscaper::isSpecial(ushort ch) const
+{
+	switch (m_format) {
+	case Html:
+		return ch == '&' || ch == '<' || ch == '>' || ch == '"';
+	case Xml:
+		return ch == '&' || ch == '<' || ch == '>' || ch == '"' || ch == '\'';
+	case Json:
+		return ch == '"' || ch == '\\' || ch < 0x20;
+	case JavaScript:
+		// Besides quotes, <, > and & are escaped so that the string cannot end
+		// a <script> element, and the line separators are escaped since older
+		// JavaScript engines do not allow them in string literals.
+		return ch == '"' || ch == '\'' || ch == '\\' || ch < 0x20 || ch == '<' || ch == '>' ||
+		       ch == '&' || ch == 0x2028 || ch == 0x2029;
+	}
+	return false;
+}
+
+/** Returns the index of the first character from @p from which needs escaping,
+ * or @p length if there is none.
+ */
+int BuiltInEscaper::findSpecial(const QChar* data, int from, int length) const
+{
+	int i = from;
+#ifdef MUSTACHE_SSE2
+	const __m128i ampersand = _mm_set1_epi16('&');
+	const __m128i lessThan = _mm_set1_epi16('<');
+	const __m128i greaterThan = _mm_set1_epi16('>');
+	const __m128i quote = _mm_set1_epi16('"');
+	const __m128i apostrophe = _mm_set1_epi16('\'');
+	const __m128i backslash = _mm_set1_epi16('\\');
+	const __m128i lastControl = _mm_set1_epi16(0x1f);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i separatorMask = _mm_set1_epi16(short(0xfffe));
+	const __m128i lineSeparator = _mm_set1_epi16(0x2028);
+	for (; i + 8 <= length; i += 8) {
+		const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+		__m128i matches = _mm_cmpeq_epi16(chars, quote);
+		if (m_format != Json) {
+			matches = _mm_or_si128(matches, _mm_cmpeq_epi16(chars, ampersand));
+			matches = _mm_or_si128(matches, _mm_cmpeq_epi16(chars, lessThan));
+			matches = _mm_or_si128(matches, _mm_cmpeq_epi16(chars, greaterThan));
+		}
+		if (m_format == Xml || m_format == JavaScript) {
+			matches = _mm_or_si128(matches, _mm_cmpeq_epi16(chars, apostrophe));
+		}
+		if (m_format == Json || m_format == JavaScript) {
+			matches = _mm_or_si128(matches, _mm_cmpeq_epi16(chars, backslash));
+			// Characters up to 0x1f are those which a saturating subtraction of 0x1f turns into 0.
+			matches = _mm_or_si128(matches, _mm_cmpeq_epi16(_mm_subs_epu16(chars, lastControl), zero));
+		}
+		if (m_format == JavaScript) {
+			matches = _mm_or_si128(matches, _mm_cmpeq_epi16(_mm_and_si128(chars, separatorMask), lineSeparator));
+		}
+		if (_mm_movemask_epi8(matches) != 0) {
+			break;
+		}
+	}
+#endif
+	for (; i < length; i++) {
+		if (isSpecial(data[i].unicode())) {
+			return i;
+		}
+	}
+	return length;
+}
+
+void BuiltInEscaper::appendReplacement(ushort ch, QString& output) const
+{
+	if (m_format == Html || m_format == Xml) {
+		switch (ch) {
+		case '&':
+			output += QLatin1String("&amp;");
+			break;
+		case '<':
+			output += QLatin1String("&lt;");
+			break;
+		case '>':
+			output += QLatin1String("&gt;");
+			break;
+		case '"':
+			output += QLatin1String("&quot;");
+			break;
+		default:
+			output += QLatin1String("&apos;");
+			break;
 		}
+		return;
+	}
+
+	switch (ch) {
+	case '"':
+		output += QLatin1String("\\\"");
+		return;
+	case '\'':
+		output += QLatin1String("\\'");
+		return;
+	case '\\':
+		output += QLatin1String("\\\\");
+		return;
+	case '\b':
+		output += QLatin1String("\\b");
+		return;
+	case '\f':
+		output += QLatin1String("\\f");
+		return;
+	case '\n':
+		output += QLatin1String("\\n");
+		return;
+	case '\r':
+		output += QLatin1String("\\r");
+		return;
+	case '\t':
+		output += QLatin1String("\\t");
+		return;
+	}
+	const char hexDigits[] = "0123456789abcdef";
+	output += QLatin1String("\\u");
+	for (int shift = 12; shift >= 0; shift -= 4) {
+		output += QLatin1Char(hexDigits[(ch >> shift) & 0xf]);
 	}
-	return escaped;
+}
+
+void BuiltInEscaper::append(const QString& text, QString& output) const
+{
+	const QChar* data = text.constData();
+	const int length = text.length();
+	int runStart = 0;
+	for (int i = findSpecial(data, 0, length); i < length; i = findSpecial(data, i + 1, length)) {
+		output.append(data + runStart, i - runStart);
+		appendReplacement(data[i].unicode(), output);
+		runStart = i + 1;
+	}
+	output.append(data + runStart, length - runStart);
+}
+
+const Escaper* Escaper::html()
+{
+	static const BuiltInEscaper escaper(BuiltInEscaper::Html);
+	return &escaper;
+}
+
+const Escaper* Escaper::xml()
+{
+	static const BuiltInEscaper escaper(BuiltInEscaper::Xml);
+	return &escaper;
+}
+
+const Escaper* Escaper::json()
+{
+	static const BuiltInEscaper escaper(BuiltInEscaper::Json);
+	return &escaper;
+}
+
+const Escaper* Escaper::javaScript()
+{
+	static const BuiltInEscaper escaper(BuiltInEscaper::JavaScript);
+	return &escaper;
+}
+
+void registerSafeString()
+{
+	// Lets QVariant::toString() convert safe strings, eg. when they are
+	// used as section values.
+	QMetaType::registerConverter<SafeString, QString>(&SafeString::toString);
+}
+Q_CONSTRUCTOR_FUNCTION(registerSafeString)
+
+QVariant LazyValue::value() const
+{
+	return m_function ? m_function() : QVariant();
+}
+
+bool LazySequence::next(int index, QVariant* item) const
+{
+	return m_function ? m_function(index, item) : false;
+}
+
+/** Returns the number of bytes which @p text has allocated, including the string itself. */
+qint64 stringMemoryUsage(const QString& text)
+{
+	return sizeof(QString) + text.capacity() * qint64(sizeof(QChar));
 }
 
 QString unescapeHtml(const QString& escaped)
@@ -85,6 +398,36 @@ bool Context::canEval(const QString&) const
 	return false;
 }
 
+ResolvedValue Context::resolve(const QString& key) const
+{
+	ResolvedValue result;
+	result.key = key;
+	result.count = listCount(key);
+	if (result.count > 0) {
+		result.kind = ResolvedValue::List;
+	} else if (canEval(key)) {
+		result.kind = ResolvedValue::Lambda;
+	} else if (!isFalse(key)) {
+		result.kind = ResolvedValue::Truthy;
+	}
+	return result;
+}
+
+void Context::pushResolved(const ResolvedValue& value, int index)
+{
+	push(value.key, index);
+}
+
+bool Context::pushNextItem(const ResolvedValue&, int)
+{
+	return false;
+}
+
+QVariant Context::variantValue(const QString& key) const
+{
+	return stringValue(key);
+}
+
 QString Context::eval(const QString& key, const QString& _template, Renderer* renderer)
 {
 	Q_UNUSED(key);
@@ -94,50 +437,192 @@ QString Context::eval(const QString& key, const QString& _template, Renderer* re
 	return QString();
 }
 
+QString Context::evalSection(const QString& key, const TemplateSection& section)
+{
+	return eval(key, section.text(), section.renderer());
+}
+
 QtVariantContext::QtVariantContext(const QVariant& root, PartialResolver* resolver)
 	: Context(resolver)
 {
-	m_contextStack << root;
+	Frame frame;
+	frame.owned = root;
+	m_contextStack << frame;
+}
+
+void QtVariantContext::reset(const QVariant& root)
+{
+	// Shrinking the stack keeps its capacity, so a context which is reset
+	// and reused does not allocate frames again.
+	m_contextStack.resize(1);
+	Frame& frame = m_contextStack[0];
+	frame.value = 0;
+	frame.owned = root;
+	frame.lookupCache.clear();
 }
 
-QVariant variantMapValue(const QVariant& value, const QString& key)
+qint64 QtVariantContext::memoryUsage() const
 {
-	if (value.userType() == QMetaType::QVariantMap) {
-		return value.toMap().value(key);
+	qint64 bytes = m_contextStack.capacity() * qint64(sizeof(Frame));
+	for (int i = 0; i < m_contextStack.count(); i++) {
+		const QHash<QString, const QVariant*>& cache = m_contextStack.at(i).lookupCache;
+		for (QHash<QString, const QVariant*>::const_iterator it = cache.constBegin(); it != cache.constEnd(); ++it) {
+			bytes += stringMemoryUsage(it.key()) + qint64(sizeof(const QVariant*));
+		}
+	}
+	for (QHash<QString, QStringList>::const_iterator it = m_keyPaths.constBegin(); it != m_keyPaths.constEnd(); ++it) {
+		bytes += stringMemoryUsage(it.key());
+		for (int i = 0; i < it.value().count(); i++) {
+			bytes += stringMemoryUsage(it.value().at(i));
+		}
+	}
+	return bytes;
+}
+
+/** Returns @p value, or if it is a LazyValue, computes it and stores the result
+ * in @p converted. Returns 0 if the value is null.
+ */
+const QVariant* evaluateLazyValue(const QVariant* value, QVariant* converted)
+{
+	if (value && value->userType() == qMetaTypeId<LazyValue>()) {
+		// 'value' may be 'converted' itself, so the LazyValue is copied first.
+		const LazyValue lazy = value->value<LazyValue>();
+		*converted = lazy.value();
+		value = converted;
+	}
+	return value && !value->isNull() ? value : 0;
+}
+
+/** Returns the value for @p key in @p map, or 0 if there is no such value.
+ *
+ * If @p map is a QVariantMap or QVariantHash, the result points into its data.
+ * Otherwise @p map is converted to a QVariantHash and the value is copied
+ * into @p converted.
+ */
+const QVariant* variantMapValue(const QVariant& map, const QString& key, QVariant* converted)
+{
+	const QVariant* value = 0;
+	if (map.userType() == QMetaType::QVariantMap) {
+		const QVariantMap& variantMap = *static_cast<const QVariantMap*>(map.constData());
+		QVariantMap::const_iterator it = variantMap.constFind(key);
+		if (it != variantMap.constEnd()) {
+			value = &it.value();
+		}
+	} else if (map.userType() == QMetaType::QVariantHash) {
+		const QVariantHash& variantHash = *static_cast<const QVariantHash*>(map.constData());
+		QVariantHash::const_iterator it = variantHash.constFind(key);
+		if (it != variantHash.constEnd()) {
+			value = &it.value();
+		}
 	} else {
-		return value.toHash().value(key);
+		*converted = map.toHash().value(key);
+		value = converted;
 	}
+	return evaluateLazyValue(value, converted);
 }
 
-QVariant variantMapValueForKeyPath(const QVariant& value, const QStringList keyPath)
+const QVariant* variantMapValueForKeyPath(const QVariant& value, const QStringList& keyPath, QVariant* converted)
 {
-	if (keyPath.count() > 1) {
-		QVariant firstValue = variantMapValue(value, keyPath.first());
-		return firstValue.isNull() ? QVariant() : variantMapValueForKeyPath(firstValue, keyPath.mid(1));
-	} else if (!keyPath.isEmpty()) {
-		return variantMapValue(value, keyPath.first());
+	const QVariant* current = &value;
+	bool isConverted = false;
+	for (int i = 0; i < keyPath.count() && current; i++) {
+		current = variantMapValue(*current, keyPath.at(i), converted);
+		isConverted = isConverted || current == converted;
+	}
+	if (current && isConverted && current != converted) {
+		// The value is inside a converted map, which only 'converted' keeps alive.
+		QVariant copy = *current;
+		*converted = copy;
+		current = converted;
 	}
-	return QVariant();
+	return current;
 }
 
-QVariant QtVariantContext::value(const QString& key) const
+const QVariant& QtVariantContext::Frame::get() const
+{
+	return value ? *value : owned;
+}
+
+void QtVariantContext::Frame::set(const QVariant* item, const QVariant& copy)
+{
+	if (item && item != &copy) {
+		value = item;
+	} else if (item) {
+		owned = copy;
+	}
+}
+
+const QVariant* QtVariantContext::findInFrame(const QVariant& frame, const QString& key, QVariant* converted) const
+{
+	if (!key.contains(QLatin1Char('.'))) {
+		return variantMapValue(frame, key, converted);
+	}
+	QHash<QString, QStringList>::const_iterator keyPath = m_keyPaths.constFind(key);
+	if (keyPath == m_keyPaths.constEnd()) {
+		keyPath = m_keyPaths.insert(key, key.split(QLatin1Char('.')));
+	}
+	// The path is copied since evaluating a LazyValue may look up other keys.
+	const QStringList path = keyPath.value();
+	return variantMapValueForKeyPath(frame, path, converted);
+}
+
+const QVariant* QtVariantContext::find(const QString& key, QVariant* converted) const
 {
-	if (key == "." && !m_contextStack.isEmpty()) {
-		return m_contextStack.last();
+	if (m_contextStack.isEmpty()) {
+		return 0;
+	}
+	if (key == ".") {
+		const Frame& top = m_contextStack.last();
+		if (top.value) {
+			return evaluateLazyValue(top.value, converted);
+		}
+		// The stack may move, so values owned by its frames are copied.
+		*converted = top.owned;
+		return evaluateLazyValue(converted, converted);
+	}
+
+	// The top of the stack changes for every item of a list section, so it is
+	// searched directly. Lookups which fall through to the outer frames are
+	// cached in the frame below it, which stays on the stack for the whole section.
+	const int top = m_contextStack.count() - 1;
+	const QVariant* value = findInFrame(m_contextStack.at(top).get(), key, converted);
+	if (value || top == 0) {
+		return value;
 	}
-	QStringList keyPath = key.split(".");
-	for (int i = m_contextStack.count()-1; i >= 0; i--) {
-		QVariant value = variantMapValueForKeyPath(m_contextStack.at(i), keyPath);
-		if (!value.isNull()) {
-			return value;
+
+	const Frame& parent = m_contextStack.at(top - 1);
+	for (int i = top - 1; i >= 0 && !value; i--) {
+		// Each frame caches the lookups in itself and the frames below it, so
+		// the search stops at the first frame which has already done it. This
+		// keeps deeply nested sections from searching the whole stack each time.
+		const Frame& frame = m_contextStack.at(i);
+		QHash<QString, const QVariant*>::const_iterator cached = frame.lookupCache.constFind(key);
+		if (cached != frame.lookupCache.constEnd()) {
+			value = cached.value();
+			break;
 		}
+		value = findInFrame(frame.get(), key, converted);
+	}
+	// Converted values are not cached, since they only live in 'converted'.
+	if (value != converted) {
+		parent.lookupCache.insert(key, value);
 	}
-	return QVariant();
+	return value;
 }
 
-bool QtVariantContext::isFalse(const QString& key) const
+QVariant QtVariantContext::value(const QString& key) const
 {
-	QVariant value = this->value(key);
+	QVariant converted;
+	const QVariant* value = find(key, &converted);
+	return value ? *value : QVariant();
+}
+
+bool isVariantFalse(const QVariant& value)
+{
+	if (value.userType() == qMetaTypeId<LazySequence>()) {
+		QVariant item;
+		return !static_cast<const LazySequence*>(value.constData())->next(0, &item);
+	}
 	switch (value.userType()) {
 	case QMetaType::Double:
 	case QMetaType::Float:
@@ -163,39 +648,164 @@ bool QtVariantContext::isFalse(const QString& key) const
 	}
 }
 
+bool isVariantList(const QVariant& value)
+{
+	return value.canConvert<QVariantList>() && value.userType() != QMetaType::QString;
+}
+
+bool isVariantLambda(const QVariant& value)
+{
+	return value.canConvert<QtVariantContext::fn_t>() || value.canConvert<QtVariantContext::section_fn_t>();
+}
+
+bool QtVariantContext::isFalse(const QString& key) const
+{
+	return isVariantFalse(value(key));
+}
+
 QString QtVariantContext::stringValue(const QString& key) const
 {
 	return value(key).toString();
 }
 
+QVariant QtVariantContext::variantValue(const QString& key) const
+{
+	QVariant converted;
+	const QVariant* value = find(key, &converted);
+	if (!value) {
+		// Subclasses may provide values for keys which are not in the data.
+		return stringValue(key);
+	}
+	return *value;
+}
+
 void QtVariantContext::push(const QString& key, int index)
 {
-	QVariant mapItem = value(key);
+	QVariant converted;
+	const QVariant* mapItem = find(key, &converted);
+	Frame frame;
 	if (index == -1) {
-		m_contextStack << mapItem;
-	} else {
-		QVariantList list = mapItem.toList();
-		m_contextStack << list.value(index, QVariant());
+		frame.set(mapItem, converted);
+	} else if (mapItem && mapItem != &converted && mapItem->userType() == QMetaType::QVariantList) {
+		const QVariantList& list = *static_cast<const QVariantList*>(mapItem->constData());
+		if (index < list.count()) {
+			frame.value = &list.at(index);
+		}
+	} else if (mapItem && mapItem->userType() == QMetaType::QStringList) {
+		// Converting the whole list for each item would make iterating over it quadratic.
+		frame.owned = static_cast<const QStringList*>(mapItem->constData())->value(index);
+	} else if (mapItem) {
+		frame.owned = mapItem->toList().value(index, QVariant());
 	}
+	m_contextStack << frame;
 }
 
 void QtVariantContext::pop()
 {
-	m_contextStack.pop();
+	m_contextStack.removeLast();
 }
 
 int QtVariantContext::listCount(const QString& key) const
 {
 	const QVariant& item = value(key);
-	if (item.canConvert<QVariantList>() && item.userType() != QMetaType::QString) {
+	if (isVariantList(item)) {
 		return item.toList().count();
 	}
 	return 0;
 }
 
+ResolvedValue QtVariantContext::resolve(const QString& key) const
+{
+	QVariant converted;
+	const QVariant* value = find(key, &converted);
+	const bool lazy = value && value->userType() == qMetaTypeId<LazySequence>();
+
+	if (!value) {
+		// Subclasses may provide sections for keys which are not in the data.
+		return Context::resolve(key);
+	}
+	ResolvedValue result;
+	result.key = key;
+	result.value = *value;
+	if (value != &converted) {
+		result.data = value;
+	}
+
+	if (lazy) {
+		// Whether the sequence has any items is found by pushNextItem().
+		result.kind = ResolvedValue::List;
+		result.count = -1;
+		return result;
+	}
+	if (isVariantList(result.value)) {
+		if (result.value.userType() == QMetaType::QVariantList) {
+			result.count = static_cast<const QVariantList*>(result.value.constData())->count();
+		} else {
+			QVariantList list = result.value.toList();
+			result.count = list.count();
+			result.value = list;
+			result.data = 0;
+		}
+		if (result.count > 0) {
+			result.kind = ResolvedValue::List;
+			return result;
+		}
+	}
+	if (isVariantLambda(result.value)) {
+		result.kind = ResolvedValue::Lambda;
+	} else if (!isVariantFalse(result.value)) {
+		const int type = result.value.userType();
+		if (type == QMetaType::QVariantMap || type == QMetaType::QVariantHash) {
+			result.kind = ResolvedValue::Map;
+		} else {
+			result.kind = ResolvedValue::Truthy;
+		}
+	}
+	return result;
+}
+
+void QtVariantContext::pushResolved(const ResolvedValue& value, int index)
+{
+	if (!value.value.isValid()) {
+		// Values resolved by Context::resolve() only have a key, see resolve().
+		push(value.key, index);
+		return;
+	}
+	Frame frame;
+	if (index == -1) {
+		if (value.data) {
+			frame.value = value.data;
+		} else {
+			frame.owned = value.value;
+		}
+	} else if (value.data && value.data->userType() == QMetaType::QVariantList) {
+		const QVariantList& list = *static_cast<const QVariantList*>(value.data->constData());
+		if (index < list.count()) {
+			frame.value = &list.at(index);
+		}
+	} else {
+		frame.owned = value.value.toList().value(index, QVariant());
+	}
+	m_contextStack << frame;
+}
+
+bool QtVariantContext::pushNextItem(const ResolvedValue& value, int index)
+{
+	if (value.value.userType() != qMetaTypeId<LazySequence>()) {
+		return false;
+	}
+	Frame frame;
+	if (!static_cast<const LazySequence*>(value.value.constData())->next(index, &frame.owned)) {
+		return false;
+	}
+	evaluateLazyValue(&frame.owned, &frame.owned);
+	m_contextStack << frame;
+	return true;
+}
+
 bool QtVariantContext::canEval(const QString& key) const
 {
-	return value(key).canConvert<fn_t>();
+	return isVariantLambda(value(key));
 }
 
 QString QtVariantContext::eval(const QString& key, const QString& _template, Renderer* renderer)
@@ -204,9 +814,23 @@ QString QtVariantContext::eval(const QString& key, const QString& _template, Ren
 	if (fn.isNull()) {
 		return QString();
 	}
+	if (fn.canConvert<section_fn_t>()) {
+		// Generated code and other callers which only have the text of the section.
+		TemplateSection section(renderer->compile(_template), renderer);
+		return fn.value<section_fn_t>()(section, this);
+	}
 	return fn.value<fn_t>()(_template, renderer, this);
 }
 
+QString QtVariantContext::evalSection(const QString& key, const TemplateSection& section)
+{
+	QVariant fn = value(key);
+	if (fn.canConvert<section_fn_t>()) {
+		return fn.value<section_fn_t>()(section, this);
+	}
+	return eval(key, section.text(), section.renderer());
+}
+
 PartialMap::PartialMap(const QHash<QString, QString>& partials)
 	: m_partials(partials)
 {}
@@ -218,172 +842,2095 @@ QString PartialMap::getPartial(const QString& name)
 
 PartialFileLoader::PartialFileLoader(const QString& basePath)
 	: m_basePath(basePath)
+	, m_cache(std::numeric_limits<int>::max())
 {}
 
 QString PartialFileLoader::getPartial(const QString& name)
 {
+	QMutexLocker locker(&m_mutex);
+	if (const QString* cached = m_cache.object(name)) {
+		return *cached;
+	}
+	// The file is read without holding the lock, so that several
+	// threads can load different partials at the same time.
+	locker.unlock();
+	QString path = m_basePath + '/' + name + ".mustache";
+	QFile file(path);
+	if (!file.open(QIODevice::ReadOnly)) {
+		return QString();
+	}
+	QTextStream stream(&file);
+	QString content = stream.readAll();
+	content.squeeze();
+	locker.relock();
+	// A partial which is larger than the limit is not kept.
+	m_cache.insert(name, new QString(content), int(qMin(stringMemoryUsage(name) + stringMemoryUsage(content),
+	                                                     qint64(std::numeric_limits<int>::max()))));
+	return content;
+}
+
+void PartialFileLoader::setMaxMemory(int bytes)
+{
+	QMutexLocker locker(&m_mutex);
+	m_cache.setMaxCost(bytes);
+}
+
+int PartialFileLoader::maxMemory() const
+{
+	QMutexLocker locker(&m_mutex);
+	return int(m_cache.maxCost());
+}
+
+qint64 PartialFileLoader::memoryUsage() const
+{
+	QMutexLocker locker(&m_mutex);
+	return m_cache.totalCost();
+}
+
+MappedFileLoader::MappedFileLoader(const QString& basePath)
+	: m_basePath(basePath)
+{}
+
+MappedFileLoader::~MappedFileLoader()
+{
+	qDeleteAll(m_mappedFiles);
+}
+
+qint64 MappedFileLoader::memoryUsage() const
+{
+	QMutexLocker locker(&m_mutex);
+	qint64 bytes = 0;
+	for (QHash<QString, QString>::const_iterator it = m_cache.constBegin(); it != m_cache.constEnd(); ++it) {
+		bytes += stringMemoryUsage(it.key()) + stringMemoryUsage(it.value());
+	}
+	return bytes;
+}
+
+QString MappedFileLoader::getPartial(const QString& name)
+{
+	QMutexLocker locker(&m_mutex);
 	if (!m_cache.contains(name)) {
+		locker.unlock();
 		QString path = m_basePath + '/' + name + ".mustache";
-		QFile file(path);
-		if (file.open(QIODevice::ReadOnly)) {
-			QTextStream stream(&file);
-			m_cache.insert(name, stream.readAll());
+		QFile* file = new QFile(path);
+		if (!file->open(QIODevice::ReadOnly)) {
+			delete file;
+			return QString();
+		}
+		const qint64 size = file->size();
+		const uchar* data = size > 0 ? file->map(0, size) : 0;
+
+		// a byte order mark for UTF-16 in the native byte order
+		const ushort bom = 0xFEFF;
+		QString content;
+		bool mapped = false;
+		if (!data) {
+			content = QString::fromUtf8(file->readAll());
+		} else if (size >= 2 && size % 2 == 0 && memcmp(data, &bom, 2) == 0) {
+			// mappings are page aligned, so the text after the mark is
+			// suitably aligned for QChar
+			content = QString::fromRawData(reinterpret_cast<const QChar*>(data + 2), int((size - 2) / 2));
+			mapped = true;
+		} else {
+			const int bomLength = (size >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0) ? 3 : 0;
+			content = QString::fromUtf8(reinterpret_cast<const char*>(data) + bomLength, int(size - bomLength));
+		}
+
+		locker.relock();
+		// Another thread may have loaded the partial while the mutex was
+		// released, in which case its copy is kept and this mapping is dropped.
+		if (m_cache.contains(name)) {
+			content.clear();
+			mapped = false;
+		} else {
+			m_cache.insert(name, content);
+		}
+		if (mapped) {
+			m_mappedFiles << file;
+		} else {
+			delete file;
 		}
 	}
 	return m_cache.value(name);
 }
 
-Renderer::Renderer()
-	: m_errorPos(-1)
-	, m_defaultTagStartMarker("{{")
-	, m_defaultTagEndMarker("}}")
+SegmentedOutput::SegmentedOutput()
+	: m_bufferedLength(0)
+	, m_length(0)
+	, m_lastTemplate(0)
+{}
+
+int SegmentedOutput::count() const
 {
+	return m_segments.count();
 }
 
-QString Renderer::error() const
+QStringView SegmentedOutput::segment(int index) const
 {
-	return m_error;
+	const Segment& segment = m_segments.at(index);
+	const QChar* text = segment.text ? segment.text : m_buffer.constData() + segment.offset;
+	return QStringView(text, segment.length);
+}
+
+int SegmentedOutput::length() const
+{
+	return m_length;
+}
+
+QString SegmentedOutput::join() const
+{
+	QString joined;
+	joined.reserve(m_length);
+	for (int i = 0; i < m_segments.count(); i++) {
+		QStringView text = segment(i);
+		joined.append(text.data(), int(text.size()));
+	}
+	return joined;
+}
+
+bool SegmentedOutput::writeTo(QIODevice* device) const
+{
+	// QIODevice has no vectored write, so the segments are gathered while
+	// they are encoded.
+	QByteArray data;
+	data.reserve(m_length);
+	for (int i = 0; i < m_segments.count(); i++) {
+		QStringView text = segment(i);
+		data += QString::fromRawData(text.data(), int(text.size())).toUtf8();
+	}
+	return device->write(data) == data.size();
+}
+
+void SegmentedOutput::clear()
+{
+	m_segments.clear();
+	m_buffer.clear();
+	m_bufferedLength = 0;
+	m_length = 0;
+	m_templates.clear();
+	m_lastTemplate = 0;
+}
+
+/** Adds a segment for the part of @p buffer which was written since the last
+ * segment was added.
+ */
+void SegmentedOutput::appendBuffered(const QString& buffer)
+{
+	if (buffer.length() > m_bufferedLength) {
+		Segment segment;
+		segment.text = 0;
+		segment.offset = m_bufferedLength;
+		segment.length = buffer.length() - m_bufferedLength;
+		m_segments << segment;
+		m_length += segment.length;
+		m_bufferedLength = buffer.length();
+	}
+}
+
+/** Adds a segment which refers to the text of the template @p data. */
+void SegmentedOutput::appendText(const TemplateData* data, const QChar* text, int length)
+{
+	if (length == 0) {
+		return;
+	}
+	if (data != m_lastTemplate) {
+		bool found = false;
+		for (int i = 0; i < m_templates.count() && !found; i++) {
+			found = m_templates.at(i).d.constData() == data;
+		}
+		if (!found) {
+			m_templates << Template(QSharedDataPointer<TemplateData>(const_cast<TemplateData*>(data)));
+		}
+		m_lastTemplate = data;
+	}
+	Segment segment;
+	segment.text = text;
+	segment.offset = 0;
+	segment.length = length;
+	m_segments << segment;
+	m_length += length;
+}
+
+IODeviceSink::IODeviceSink(QIODevice* device)
+	: m_device(device)
+{}
+
+bool IODeviceSink::write(const QString& text)
+{
+	QByteArray data = text.toUtf8();
+	return m_device->write(data) == data.size();
 }
 
-int Renderer::errorPos() const
+FragmentCache::FragmentCache(int maxSize)
+	: m_cache(maxSize)
+	, m_hits(0)
+	, m_misses(0)
+{}
+
+bool FragmentCache::find(const QString& key, QString* output)
+{
+	QMutexLocker locker(&m_mutex);
+	const QString* cached = m_cache.object(key);
+	if (!cached) {
+		++m_misses;
+		return false;
+	}
+	++m_hits;
+	*output = *cached;
+	return true;
+}
+
+void FragmentCache::insert(const QString& key, const QString& output)
+{
+	QMutexLocker locker(&m_mutex);
+	m_cache.insert(key, new QString(output), qMax(1, int(output.length())));
+}
+
+void FragmentCache::clear()
+{
+	QMutexLocker locker(&m_mutex);
+	m_cache.clear();
+}
+
+void FragmentCache::setMaxSize(int maxSize)
+{
+	QMutexLocker locker(&m_mutex);
+	m_cache.setMaxCost(maxSize);
+}
+
+int FragmentCache::maxSize() const
+{
+	QMutexLocker locker(&m_mutex);
+	return int(m_cache.maxCost());
+}
+
+int FragmentCache::size() const
+{
+	QMutexLocker locker(&m_mutex);
+	return int(m_cache.totalCost());
+}
+
+qint64 FragmentCache::memoryUsage() const
+{
+	QMutexLocker locker(&m_mutex);
+	// The cost of each entry is the length of its output. The entries are not
+	// looked up, since that would change which of them were used most recently.
+	qint64 bytes = m_cache.totalCost() * qint64(sizeof(QChar));
+	foreach (const QString& key, m_cache.keys()) {
+		bytes += stringMemoryUsage(key) + qint64(sizeof(QString));
+	}
+	return bytes;
+}
+
+int FragmentCache::hits() const
+{
+	QMutexLocker locker(&m_mutex);
+	return m_hits;
+}
+
+int FragmentCache::misses() const
+{
+	QMutexLocker locker(&m_mutex);
+	return m_misses;
+}
+
+/** Sets the identifier of @p data which fragment cache keys refer to it by.
+ *
+ * The identifier is a digest of the source and of the cacheable nodes, so that
+ * templates compiled from the same source, eg. by different renderers, share
+ * their cached output. Templates without cacheable nodes are only given an
+ * identifier if @p always is true, eg. for partials whose cacheable tag is in
+ * another template.
+ */
+void updateCacheId(TemplateData* data, bool always)
+{
+	bool cacheable = always;
+	for (int i = 0; i < data->nodes.count() && !cacheable; i++) {
+		cacheable = data->nodes.at(i).cacheable;
+	}
+	if (!cacheable) {
+		data->cacheId.clear();
+		return;
+	}
+
+	QCryptographicHash hash(QCryptographicHash::Sha1);
+	hash.addData(QByteArray::fromRawData(reinterpret_cast<const char*>(data->source.constData()),
+	                                     data->source.length() * int(sizeof(QChar))));
+	for (int i = 0; i < data->nodes.count(); i++) {
+		const Node& node = data->nodes.at(i);
+		if (node.cacheable) {
+			// The source alone does not determine the nodes, since it may have
+			// been compiled with other tag markers.
+			const QString description = QString::number(i) + ':' + QString::number(int(node.type)) + ':' +
+			                            QString::number(node.start) + ':' + QString::number(node.end) + ':' +
+			                            QString::number(node.key.length()) + ':' + node.key + node.cacheKeys.join(",");
+			hash.addData(description.toUtf8());
+		}
+	}
+	data->cacheId = QString::fromLatin1(hash.result().toHex());
+}
+
+/** Adds a field of @p type and @p length to @p hash, so that the fields which
+ * follow cannot be confused with the end of this one.
+ */
+void addFieldToHash(QCryptographicHash& hash, char type, qint64 length)
+{
+	QByteArray field(1, type);
+	field += QByteArray::number(length);
+	field += ':';
+	hash.addData(field);
+}
+
+/** Adds the contents of @p value to @p hash, for describing a list or map in
+ * a fragment cache key. Returns false if the value cannot be described by its
+ * contents, eg. because it holds a lambda or a lazy value.
+ */
+bool addValueToHash(const QVariant& value, QCryptographicHash& hash)
+{
+	const int type = value.userType();
+	QString text;
+	if (type == QMetaType::QVariantList) {
+		const QVariantList& list = *static_cast<const QVariantList*>(value.constData());
+		addFieldToHash(hash, 'l', list.count());
+		foreach (const QVariant& item, list) {
+			if (!addValueToHash(item, hash)) {
+				return false;
+			}
+		}
+		return true;
+	} else if (type == QMetaType::QVariantMap || type == QMetaType::QVariantHash) {
+		// Hashes are described in the order of their keys, like maps.
+		const QVariantMap map = type == QMetaType::QVariantMap ? *static_cast<const QVariantMap*>(value.constData())
+		                                                        : value.toMap();
+		addFieldToHash(hash, 'm', map.count());
+		for (QVariantMap::const_iterator it = map.constBegin(); it != map.constEnd(); ++it) {
+			addFieldToHash(hash, 'k', it.key().length());
+			hash.addData(it.key().toUtf8());
+			if (!addValueToHash(it.value(), hash)) {
+				return false;
+			}
+		}
+		return true;
+	} else if (type == QMetaType::QStringList) {
+		const QStringList& list = *static_cast<const QStringList*>(value.constData());
+		addFieldToHash(hash, 'a', list.count());
+		foreach (const QString& item, list) {
+			addFieldToHash(hash, 's', item.length());
+			hash.addData(item.toUtf8());
+		}
+		return true;
+	} else if (type == qMetaTypeId<SafeString>()) {
+		text = value.value<SafeString>().toString();
+	} else if (type == qMetaTypeId<LazyValue>() || type == qMetaTypeId<LazySequence>() || isVariantLambda(value) ||
+	           (value.isValid() && !value.canConvert<QString>())) {
+		return false;
+	} else {
+		text = value.toString();
+	}
+	// The type distinguishes values with the same text, eg. 1 and "1".
+	addFieldToHash(hash, 't', type);
+	addFieldToHash(hash, 's', text.length());
+	hash.addData(text.toUtf8());
+	return true;
+}
+
+/** Returns the part of a fragment cache key which describes how a section
+ * for @p key with the resolved @p value is rendered, or an empty string if
+ * the value cannot be described.
+ *
+ * Lists and maps are described by a digest of their contents. Those which
+ * cannot be, such as lists whose items are produced one at a time or values
+ * from contexts which only provide them through push(), are described by
+ * their kind and length only if @p explicitKeys is true, since the keys which
+ * their items depend on are then listed like any others.
+ */
+QString resolvedValueKey(const ResolvedValue& value, const QString& key, Context* context, bool explicitKeys)
+{
+	switch (value.kind) {
+	case ResolvedValue::Falsy:
+		return QLatin1String("f");
+	case ResolvedValue::Truthy:
+		return QLatin1String("t") + context->stringValue(key);
+	case ResolvedValue::Map:
+	case ResolvedValue::List:
+	{
+		const QString kind = value.kind == ResolvedValue::Map ? QLatin1String("m")
+		                                                      : QLatin1String("l") + QString::number(value.count);
+		QCryptographicHash hash(QCryptographicHash::Sha1);
+		if (value.count >= 0 && value.value.isValid() && addValueToHash(value.value, hash)) {
+			return kind + ':' + QString::fromLatin1(hash.result().toHex());
+		}
+		return explicitKeys ? kind : QString();
+	}
+	case ResolvedValue::Lambda:
+		return QLatin1String("e");
+	}
+	return QString();
+}
+
+/** Returns the key under which the output of the cacheable section or partial
+ * at @p nodeIndex in @p data is stored in a FragmentCache.
+ *
+ * The key identifies the fragment by its type, template and node and includes
+ * the @p escaper which values are escaped with, @p value, which describes the
+ * value of the section or the loaded partial, and the current values of the
+ * keys which the fragment depends on. Each part of variable length is prefixed
+ * with its length so that different values cannot produce the same key.
+ */
+QString fragmentCacheKey(QChar type, const TemplateData* data, int nodeIndex, const Escaper* escaper,
+                         const QString& value, Context* context)
+{
+	// Escapers are identified by their address, as they are when they are set.
+	QString key = type + data->cacheId + QString::number(nodeIndex) + ':' +
+	              QString::number(quintptr(escaper)) + ':' + QString::number(value.length()) + ':' + value;
+	foreach (const QString& dependency, data->nodes.at(nodeIndex).cacheKeys) {
+		QString dependencyValue = context->stringValue(dependency);
+		key += QString::number(dependencyValue.length()) + ':' + dependencyValue;
+	}
+	return key;
+}
+
+Template::Template()
+	: d(new TemplateData)
+{}
+
+Template::Template(const Template& other)
+	: d(other.d)
+{}
+
+Template::Template(const QSharedDataPointer<TemplateData>& data)
+	: d(data)
+{}
+
+Template& Template::operator=(const Template& other)
+{
+	d = other.d;
+	return *this;
+}
+
+Template::~Template()
+{}
+
+QString Template::source() const
+{
+	return d->source;
+}
+
+const QVector<Node>& Template::nodes() const
+{
+	decodeNodes(d.constData());
+	return d->nodes;
+}
+
+QStringList Template::inlinedPartials() const
+{
+	decodeNodes(d.constData());
+	QStringList names;
+	for (int i = 0; i < d->inlinedPartials.count(); i++) {
+		names << d->inlinedPartials.at(i).first;
+	}
+	return names;
+}
+
+bool Template::partialsChanged(PartialResolver* partials) const
+{
+	decodeNodes(d.constData());
+	for (int i = 0; i < d->inlinedPartials.count(); i++) {
+		const QPair<QString, QString>& partial = d->inlinedPartials.at(i);
+		if (partials->getPartial(partial.first) != partial.second) {
+			return true;
+		}
+	}
+	return false;
+}
+
+QStringList Template::partialNames() const
+{
+	decodeNodes(d.constData());
+	QStringList names;
+	foreach (const Node& node, d->nodes) {
+		if (node.type == Node::Partial && !names.contains(node.key)) {
+			names << node.key;
+		}
+	}
+	return names;
+}
+
+QString Template::error() const
+{
+	decodeNodes(d.constData());
+	return d->error;
+}
+
+int Template::errorPos() const
+{
+	decodeNodes(d.constData());
+	return d->errorPos;
+}
+
+void Template::setEscaper(const Escaper* escaper)
+{
+	d->escaper = escaper;
+}
+
+const Escaper* Template::escaper() const
+{
+	return d->escaper;
+}
+
+qint64 Template::memoryUsage() const
+{
+	decodeNodes(d.constData());
+	// Strings which refer to binary data report no capacity, so they are not counted.
+	qint64 bytes = sizeof(TemplateData) + stringMemoryUsage(d->source) + d->error.capacity() * qint64(sizeof(QChar)) +
+	               d->cacheId.capacity() * qint64(sizeof(QChar)) +
+	               d->binary.capacity() + d->nodes.capacity() * qint64(sizeof(Node));
+	foreach (const Node& node, d->nodes) {
+		bytes += node.key.capacity() * qint64(sizeof(QChar));
+		foreach (const QString& key, node.cacheKeys) {
+			bytes += stringMemoryUsage(key);
+		}
+	}
+	for (int i = 0; i < d->inlinedPartials.count(); i++) {
+		bytes += stringMemoryUsage(d->inlinedPartials.at(i).first) + stringMemoryUsage(d->inlinedPartials.at(i).second);
+	}
+	return bytes;
+}
+
+void Template::setCacheable(const QString& key, const QStringList& dependencies)
+{
+	decodeNodes(d.constData());
+	for (int i = 0; i < d->nodes.count(); i++) {
+		Node& node = d->nodes[i];
+		if (node.type != Node::Text && node.type != Node::Value && node.key == key) {
+			node.cacheable = true;
+			node.cacheKeys = dependencies;
+		}
+	}
+	updateCacheId(d.data(), false);
+}
+
+// Layout of the binary form of a compiled template.  All integers are 32-bit
+// values in the byte order of the machine which produced the data.
+//
+// Header:  magic, format version, byte order mark, payload size, payload checksum
+// Payload: node count, source length, key pool length,
+//          one record of BinaryNodeFields integers per node,
+//          the key pool (UTF-16), the template source (UTF-16)
+//
+// Strings are stored as UTF-16 so that they can be used in place when the
+// data is memory-mapped.
+const char binaryMagic[4] = { 'Q', 'M', 'T', 'C' };
+const quint32 binaryVersion = 4;
+const quint32 binaryByteOrderMark = 0x01020304;
+const int BinaryHeaderSize = 20;
+const int BinaryNodeFields = 14;
+
+void appendUInt32(QByteArray& data, quint32 value)
+{
+	data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+quint32 readUInt32(const char* data)
+{
+	quint32 value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+quint16 binaryChecksum(const char* data, int length)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+	return qChecksum(QByteArrayView(data, length));
+#else
+	return qChecksum(data, uint(length));
+#endif
+}
+
+QByteArray Template::toBinary() const
+{
+	decodeNodes(d.constData());
+	if (d->errorPos != -1) {
+		return QByteArray();
+	}
+
+	QString keys;
+	QByteArray payload;
+	appendUInt32(payload, d->nodes.count());
+	appendUInt32(payload, d->source.length());
+	appendUInt32(payload, 0); // Key pool length, filled in below.
+	appendUInt32(payload, d->inlinedPartials.count());
+
+	foreach (const Node& node, d->nodes) {
+		appendUInt32(payload, node.type);
+		appendUInt32(payload, node.pos);
+		appendUInt32(payload, node.start);
+		appendUInt32(payload, node.end);
+		appendUInt32(payload, node.escapeMode);
+		appendUInt32(payload, node.indentation);
+		appendUInt32(payload, node.next);
+		appendUInt32(payload, keys.length());
+		appendUInt32(payload, node.key.length());
+		appendUInt32(payload, node.precision + 1);
+		appendUInt32(payload, node.grouping);
+		keys += node.key;
+		// The keys which cacheable nodes depend on are stored in the key pool
+		// as a comma-separated list.
+		QString cacheKeys = node.cacheKeys.join(",");
+		appendUInt32(payload, node.cacheable);
+		appendUInt32(payload, keys.length());
+		appendUInt32(payload, cacheKeys.length());
+		keys += cacheKeys;
+	}
+	// The names and contents of inlined partials are also stored in the key pool.
+	for (int i = 0; i < d->inlinedPartials.count(); i++) {
+		const QPair<QString, QString>& partial = d->inlinedPartials.at(i);
+		appendUInt32(payload, keys.length());
+		appendUInt32(payload, partial.first.length());
+		keys += partial.first;
+		appendUInt32(payload, keys.length());
+		appendUInt32(payload, partial.second.length());
+		keys += partial.second;
+	}
+	quint32 keysLength = keys.length();
+	memcpy(payload.data() + 2 * sizeof(quint32), &keysLength, sizeof(keysLength));
+
+	payload.append(reinterpret_cast<const char*>(keys.constData()), keys.length() * sizeof(QChar));
+	payload.append(reinterpret_cast<const char*>(d->source.constData()), d->source.length() * sizeof(QChar));
+
+	QByteArray data;
+	data.reserve(BinaryHeaderSize + payload.size());
+	data.append(binaryMagic, sizeof(binaryMagic));
+	appendUInt32(data, binaryVersion);
+	appendUInt32(data, binaryByteOrderMark);
+	appendUInt32(data, payload.size());
+	appendUInt32(data, binaryChecksum(payload.constData(), payload.size()));
+	data.append(payload);
+	return data;
+}
+
+/** Checks the header of @p data, and its checksum if @p verifyChecksum is true,
+ * and sets up @p templateData to use it.  The nodes are read by decodeNodes()
+ * when they are first used, so loading a template does not depend on its size.
+ */
+bool readBinaryTemplate(const QByteArray& data, TemplateData* templateData, bool verifyChecksum)
+{
+	if (data.size() < BinaryHeaderSize + 4 * int(sizeof(quint32)) ||
+	    memcmp(data.constData(), binaryMagic, sizeof(binaryMagic)) != 0) {
+		return false;
+	}
+	const char* header = data.constData() + sizeof(binaryMagic);
+	const char* payload = data.constData() + BinaryHeaderSize;
+	const qint64 payloadSize = data.size() - BinaryHeaderSize;
+	if (readUInt32(header) != binaryVersion ||
+	    readUInt32(header + 4) != binaryByteOrderMark ||
+	    readUInt32(header + 8) != payloadSize ||
+	    (verifyChecksum && readUInt32(header + 12) != binaryChecksum(payload, int(payloadSize)))) {
+		return false;
+	}
+
+	const qint64 nodeCount = readUInt32(payload);
+	const qint64 sourceLength = readUInt32(payload + 4);
+	const qint64 keysLength = readUInt32(payload + 8);
+	const qint64 inlinedCount = readUInt32(payload + 12);
+	const qint64 recordsSize = nodeCount * BinaryNodeFields * sizeof(quint32);
+	const qint64 inlinedSize = inlinedCount * 4 * sizeof(quint32);
+	if (4 * sizeof(quint32) + recordsSize + inlinedSize + (keysLength + sourceLength) * sizeof(QChar) != quint64(payloadSize)) {
+		return false;
+	}
+
+	const QChar* source = reinterpret_cast<const QChar*>(payload + payloadSize) - sourceLength;
+	templateData->binary = data;
+	templateData->source = QString::fromRawData(source, int(sourceLength));
+	templateData->nodesPending.storeRelease(1);
+	return true;
+}
+
+/** Reads the nodes and inlined partials of a template from its binary data,
+ * whose header has been checked by readBinaryTemplate().
+ */
+bool readBinaryNodes(TemplateData* templateData)
+{
+	const char* payload = templateData->binary.constData() + BinaryHeaderSize;
+	const qint64 nodeCount = readUInt32(payload);
+	const qint64 sourceLength = readUInt32(payload + 4);
+	const qint64 keysLength = readUInt32(payload + 8);
+	const qint64 inlinedCount = readUInt32(payload + 12);
+	const qint64 recordsSize = nodeCount * BinaryNodeFields * sizeof(quint32);
+	const qint64 inlinedSize = inlinedCount * 4 * sizeof(quint32);
+
+	const char* record = payload + 4 * sizeof(quint32);
+	const char* inlinedRecord = record + recordsSize;
+	const QChar* keys = reinterpret_cast<const QChar*>(inlinedRecord + inlinedSize);
+
+	QVector<Node> nodes;
+	nodes.reserve(int(nodeCount));
+	for (int i = 0; i < nodeCount; i++, record += BinaryNodeFields * sizeof(quint32)) {
+		Node node;
+		quint32 type = readUInt32(record);
+		node.pos = readUInt32(record + 4);
+		node.start = readUInt32(record + 8);
+		node.end = readUInt32(record + 12);
+		quint32 escapeMode = readUInt32(record + 16);
+		node.indentation = readUInt32(record + 20);
+		node.next = readUInt32(record + 24);
+		quint32 keyOffset = readUInt32(record + 28);
+		quint32 keyLength = readUInt32(record + 32);
+		node.precision = int(readUInt32(record + 36)) - 1;
+		quint32 grouping = readUInt32(record + 40);
+		node.grouping = grouping != 0;
+		quint32 cacheable = readUInt32(record + 44);
+		node.cacheable = cacheable != 0;
+		quint32 cacheKeysOffset = readUInt32(record + 48);
+		quint32 cacheKeysLength = readUInt32(record + 52);
+
+		if (type > Node::Partial || escapeMode > Tag::Raw ||
+		    node.start < 0 || node.start > node.end || node.end > sourceLength ||
+		    node.pos < 0 || node.pos > sourceLength || node.indentation < 0 ||
+		    node.precision < -1 || node.precision > 99 || grouping > 1 ||
+		    qint64(keyOffset) + keyLength > keysLength || cacheable > 1 ||
+		    qint64(cacheKeysOffset) + cacheKeysLength > keysLength) {
+			return false;
+		}
+		node.type = Node::Type(type);
+		node.escapeMode = Tag::EscapeMode(escapeMode);
+		if ((node.type == Node::Section || node.type == Node::InvertedSection ||
+		     (node.type == Node::Partial && node.next != 0)) &&
+		    (node.next <= i || node.next > nodeCount)) {
+			return false;
+		}
+		node.key = QString::fromRawData(keys + keyOffset, keyLength);
+		if (cacheKeysLength > 0) {
+			node.cacheKeys = QString(keys + cacheKeysOffset, cacheKeysLength).split(',');
+		}
+		nodes << node;
+	}
+
+	QVector<QPair<QString, QString> > inlinedPartials;
+	for (int i = 0; i < inlinedCount; i++, inlinedRecord += 4 * sizeof(quint32)) {
+		quint32 nameOffset = readUInt32(inlinedRecord);
+		quint32 nameLength = readUInt32(inlinedRecord + 4);
+		quint32 contentOffset = readUInt32(inlinedRecord + 8);
+		quint32 contentLength = readUInt32(inlinedRecord + 12);
+		if (qint64(nameOffset) + nameLength > keysLength || qint64(contentOffset) + contentLength > keysLength) {
+			return false;
+		}
+		inlinedPartials << qMakePair(QString::fromRawData(keys + nameOffset, nameLength),
+		                             QString::fromRawData(keys + contentOffset, contentLength));
+	}
+
+	templateData->nodes = nodes;
+	templateData->inlinedPartials = inlinedPartials;
+	return true;
+}
+
+// Serializes the decoding of binary templates, which only happens once for each.
+QMutex binaryDecodeMutex;
+
+/** Reads the nodes of a template loaded from binary data the first time they
+ * are used, which may be in any of the threads which share the template.
+ */
+void decodeNodes(const TemplateData* data)
+{
+	if (data->nodesPending.loadAcquire() == 0) {
+		return;
+	}
+	QMutexLocker locker(&binaryDecodeMutex);
+	if (data->nodesPending.loadAcquire() == 0) {
+		return;
+	}
+	// Nothing reads the nodes until nodesPending is cleared, so they can be
+	// filled in although the template is shared.
+	TemplateData* decoded = const_cast<TemplateData*>(data);
+	if (!readBinaryNodes(decoded)) {
+		decoded->nodes.clear();
+		decoded->inlinedPartials.clear();
+		decoded->error = "The compiled template is not valid";
+		decoded->errorPos = 0;
+	}
+	updateCacheId(decoded, false);
+	decoded->nodesPending.storeRelease(0);
+}
+
+Template Template::fromBinary(const QByteArray& data, BinaryCheck check)
+{
+	Template result;
+	if (!readBinaryTemplate(data, result.d.data(), check == VerifyChecksum)) {
+		return Template();
+	}
+	return result;
+}
+
+Template Template::mapBinary(const QString& fileName, BinaryCheck check)
+{
+	QSharedPointer<QFile> file(new QFile(fileName));
+	if (!file->open(QIODevice::ReadOnly)) {
+		return Template();
+	}
+	const char* data = reinterpret_cast<const char*>(file->map(0, file->size()));
+	if (!data) {
+		return Template();
+	}
+	Template result;
+	if (!readBinaryTemplate(QByteArray::fromRawData(data, int(file->size())), result.d.data(), check == VerifyChecksum)) {
+		return Template();
+	}
+	result.d->mapping = file;
+	return result;
+}
+
+TemplateSection::TemplateSection(const Template& _template, Renderer* renderer)
+	: m_template(_template)
+	, m_begin(0)
+	, m_end(_template.nodes().count())
+	, m_textStart(0)
+	, m_textEnd(_template.source().length())
+	, m_renderer(renderer)
+{}
+
+TemplateSection::TemplateSection(const Template& _template, int begin, int end, int textStart, int textEnd, Renderer* renderer)
+	: m_template(_template)
+	, m_begin(begin)
+	, m_end(end)
+	, m_textStart(textStart)
+	, m_textEnd(textEnd)
+	, m_renderer(renderer)
+{}
+
+QString TemplateSection::text() const
+{
+	return m_template.source().mid(m_textStart, m_textEnd - m_textStart);
+}
+
+QString TemplateSection::render(Context* context) const
+{
+	return m_renderer->render(*this, context);
+}
+
+Renderer* TemplateSection::renderer() const
+{
+	return m_renderer;
+}
+
+Renderer::Renderer()
+	: m_errorPos(-1)
+	, m_maxDepth(1000)
+	, m_maxOutputLength(0)
+	, m_maxPartials(0)
+	, m_maxIterations(0)
+	, m_deadline(QDeadlineTimer::Forever)
+	, m_cancellationToken(0)
+	, m_fragmentCache(0)
+	, m_escaper(Escaper::html())
+	, m_flushThreshold(16384)
+	, m_flushAtListItems(false)
+	, m_verifier(0)
+	, m_renderNesting(0)
+	, m_partialCount(0)
+	, m_iterationCount(0)
+	, m_peakScratchMemory(0)
+	, m_budgetCheckCountdown(0)
+	, m_activeEscaper(0)
+	, m_sink(0)
+	, m_segments(0)
+	, m_sinkNesting(0)
+	, m_flushedLength(0)
+	, m_defaultTagStartMarker(QStringLiteral("{{"))
+	, m_defaultTagEndMarker(QStringLiteral("}}"))
+{
+}
+
+QThreadStorage<Renderer*> threadRenderers;
+
+Renderer* Renderer::threadLocal()
+{
+	if (!threadRenderers.hasLocalData()) {
+		threadRenderers.setLocalData(new Renderer);
+	}
+	return threadRenderers.localData();
+}
+
+QString Renderer::error() const
+{
+	return m_error;
+}
+
+int Renderer::errorPos() const
+{
+	return m_errorPos;
+}
+
+QString Renderer::errorPartial() const
+{
+	return m_errorPartial;
+}
+
+QString Renderer::render(const QString& _template, Context* context)
+{
+	return render(compile(_template), context);
+}
+
+void Renderer::clearError()
+{
+	m_error.clear();
+	m_errorPos = -1;
+	m_errorPartial.clear();
+
+	if (m_renderNesting == 0) {
+		m_partialCount = 0;
+		m_iterationCount = 0;
+		m_budgetCheckCountdown = 0;
+	}
+}
+
+// The deadline and cancellation token are only checked once in this many
+// steps, since reading the clock is much slower than rendering a node.
+const int BudgetCheckInterval = 64;
+
+bool isCancelled(const QAtomicInt* token)
+{
+	if (!token) {
+		return false;
+	}
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+	return token->loadRelaxed() != 0;
+#else
+	return token->load() != 0;
+#endif
+}
+
+bool Renderer::withinBudget(const QString& output, int pos)
+{
+	if (m_maxOutputLength > 0 && outputPosition(output) > m_maxOutputLength) {
+		setError("Maximum output length exceeded", pos);
+		return false;
+	}
+	if (--m_budgetCheckCountdown > 0) {
+		return true;
+	}
+	m_budgetCheckCountdown = BudgetCheckInterval;
+	if (isCancelled(m_cancellationToken)) {
+		setError("Rendering cancelled", pos);
+		return false;
+	}
+	if (m_deadline.hasExpired()) {
+		setError("Deadline exceeded", pos);
+		return false;
+	}
+	return true;
+}
+
+/** Returns the length of the output so far, including any output which has
+ * already been written to the sink.
+ */
+qint64 Renderer::outputPosition(const QString& output) const
+{
+	if ((m_sink || m_segments) && m_renderNesting == m_sinkNesting) {
+		return m_flushedLength + output.length();
+	}
+	return output.length();
+}
+
+/** Returns true if @p output is being rendered by the render() call which
+ * a sink was passed to, rather than by a lambda, and is ready to be written.
+ */
+bool Renderer::readyToFlush(const QString& output, int threshold) const
+{
+	return m_sink && m_renderNesting == m_sinkNesting && !output.isEmpty() && output.length() >= threshold;
+}
+
+/** Writes the pending @p output to the sink. */
+void Renderer::flushOutput(QString& output, int pos)
+{
+	if (output.isEmpty()) {
+		return;
+	}
+	const bool written = m_sink->write(output);
+	m_flushedLength += output.length();
+	// Keep the capacity of the buffer for the output which follows.
+	output.resize(0);
+	if (!written && m_errorPos == -1) {
+		setError("Failed to write output", pos);
+	}
+}
+
+bool Renderer::includePartial(int pos)
+{
+	if (m_maxPartials > 0 && ++m_partialCount > m_maxPartials) {
+		setError("Maximum number of partials exceeded", pos);
+		return false;
+	}
+	return true;
+}
+
+/** Returns the number of nodes which are rendered from @p _template.  For a
+ * template with an error, these are the complete nodes before the error, so
+ * that the output up to the error is still produced, as when templates were
+ * rendered directly from their text.
+ */
+int renderedNodeCount(const Template& _template)
+{
+	const QVector<Node>& nodes = _template.nodes();
+	if (_template.errorPos() == -1) {
+		return nodes.count();
+	}
+	int index = 0;
+	while (index < nodes.count() && nodes.at(index).pos < _template.errorPos()) {
+		const Node& node = nodes.at(index);
+		if (node.type != Node::Section && node.type != Node::InvertedSection) {
+			index++;
+		} else if (node.next > index) {
+			index = node.next;
+		} else {
+			// the section is not closed, so the error is in its body
+			break;
+		}
+	}
+	return index;
+}
+
+/** Reports the error of @p _template after the nodes before it have been
+ * rendered, unless rendering them stopped at an earlier error.
+ */
+void Renderer::reportTemplateError(const Template& _template)
+{
+	if (_template.errorPos() != -1 && m_errorPos == -1) {
+		setError(_template.error(), _template.errorPos());
+	}
+}
+
+QString Renderer::render(const Template& _template, Context* context)
+{
+	clearError();
+
+	QString output;
+	render(_template, 0, renderedNodeCount(_template), context, output);
+	reportTemplateError(_template);
+	if (m_verifier && m_renderNesting == 0 && m_errorPos == -1) {
+		verifyOutput(_template, context, output);
+	}
+	return output;
+}
+
+void Renderer::verifyOutput(const Template& _template, Context* context, const QString& output)
+{
+	// The verifier renders as if it were nested in this render, so that lambdas
+	// which render templates use the same escaper, are not verified themselves
+	// and do not reset the budgets. Nor do they use the cache.
+	FragmentCache* fragmentCache = m_fragmentCache;
+	m_fragmentCache = 0;
+	m_activeEscaper = _template.d->escaper ? _template.d->escaper : m_escaper;
+	++m_renderNesting;
+	clearError();
+
+	int pos = 0;
+	QString partial;
+	const QString problem = m_verifier->verify(_template, context, output, this, &pos, &partial);
+
+	--m_renderNesting;
+	m_activeEscaper = 0;
+	m_fragmentCache = fragmentCache;
+	clearError();
+	if (!problem.isEmpty()) {
+		setError(problem, qMax(pos, 0));
+		m_errorPartial = partial;
+	}
+}
+
+void Renderer::render(const Template& _template, Context* context, OutputSink* sink)
+{
+	clearError();
+
+	// Lambdas may render other templates to a sink while this one is rendered.
+	OutputSink* previousSink = m_sink;
+	SegmentedOutput* previousSegments = m_segments;
+	const int previousSinkNesting = m_sinkNesting;
+	const qint64 previousFlushedLength = m_flushedLength;
+	m_sink = sink;
+	m_segments = 0;
+	m_sinkNesting = m_renderNesting + 1;
+	m_flushedLength = 0;
+
+	QString output;
+	output.reserve(m_flushThreshold);
+	render(_template, 0, renderedNodeCount(_template), context, output);
+	reportTemplateError(_template);
+	flushOutput(output, _template.d->source.length());
+
+	m_sink = previousSink;
+	m_segments = previousSegments;
+	m_sinkNesting = previousSinkNesting;
+	m_flushedLength = previousFlushedLength;
+}
+
+void Renderer::render(const Template& _template, Context* context, SegmentedOutput* output)
+{
+	clearError();
+	output->clear();
+
+	OutputSink* previousSink = m_sink;
+	SegmentedOutput* previousSegments = m_segments;
+	const int previousSinkNesting = m_sinkNesting;
+	const qint64 previousFlushedLength = m_flushedLength;
+	m_sink = 0;
+	m_segments = output;
+	m_sinkNesting = m_renderNesting + 1;
+	m_flushedLength = 0;
+
+	// Substituted values are written to the output's buffer, while text nodes
+	// add segments which refer to the template instead.
+	render(_template, 0, renderedNodeCount(_template), context, output->m_buffer);
+	reportTemplateError(_template);
+	output->appendBuffered(output->m_buffer);
+
+	m_sink = previousSink;
+	m_segments = previousSegments;
+	m_sinkNesting = previousSinkNesting;
+	m_flushedLength = previousFlushedLength;
+}
+
+QString Renderer::render(const TemplateSection& section, Context* context)
+{
+	QString output;
+	if (section.m_template.errorPos() == -1) {
+		render(section.m_template, section.m_begin, section.m_end, context, output);
+	} else if (m_errorPos == -1) {
+		setError(section.m_template.error(), section.m_template.errorPos());
+	}
+	return output;
+}
+
+/** Frame stacks which are kept by each thread for reuse by later renders, so
+ * that rendering does not allocate a new stack each time. There is one stack
+ * for each level of render() calls which are nested by lambdas.
+ */
+struct FrameStackPool
+{
+	QVector<QVector<RenderFrame> > stacks;
+};
+
+QThreadStorage<FrameStackPool*> frameStackPools;
+
+void Renderer::render(const Template& _template, int begin, int end, Context* context, QString& output)
+{
+	if (!frameStackPools.hasLocalData()) {
+		frameStackPools.setLocalData(new FrameStackPool);
+	}
+	FrameStackPool* pool = frameStackPools.localData();
+
+	// Sections and partials are rendered by pushing a frame onto a stack
+	// rather than by recursion, so that the nesting depth of the data or of
+	// recursive partials is limited by setMaxDepth() rather than by the size
+	// of the native stack.
+	// The escaper of the template which is rendered first is used for the
+	// partials and lambdas which it includes as well.
+	if (m_renderNesting == 0) {
+		m_activeEscaper = _template.d->escaper;
+	}
+
+	QVector<RenderFrame> stack;
+	if (pool->stacks.isEmpty()) {
+		stack.reserve(16);
+	} else {
+		stack.swap(pool->stacks.last());
+		pool->stacks.removeLast();
+	}
+	++m_renderNesting;
+
+	RenderFrame root;
+	root.data = _template.d.constData();
+	root.begin = begin;
+	root.index = begin;
+	root.end = end;
+	stack << root;
+
+	while (!stack.isEmpty() && m_errorPos == -1) {
+		RenderFrame& frame = stack.last();
+		if (readyToFlush(output, m_flushThreshold)) {
+			flushOutput(output, frame.index < frame.end ? frame.data->nodes.at(frame.index).pos : frame.data->source.length());
+			continue;
+		}
+		if (frame.index >= frame.end) {
+			if (frame.type == RenderFrame::ListItem) {
+				context->pop();
+				// Lists whose length is not known are rendered until they run out of items.
+				const bool lazy = frame.value.count < 0;
+				if (lazy ? context->pushNextItem(frame.value, ++frame.item) : ++frame.item < frame.value.count) {
+					if (m_maxIterations > 0 && ++m_iterationCount > m_maxIterations) {
+						if (lazy) {
+							context->pop();
+						}
+						setError("Maximum number of iterations exceeded", frame.data->nodes.at(frame.begin - 1).pos);
+						stack.removeLast();
+						continue;
+					}
+					if (!lazy) {
+						context->pushResolved(frame.value, frame.item);
+					}
+					frame.index = frame.begin;
+					if (m_flushAtListItems && readyToFlush(output, 1)) {
+						flushOutput(output, frame.data->nodes.at(frame.begin - 1).pos);
+					}
+					// Items may not produce any output, eg. if they only contain
+					// sections which are false, so the budget is checked for each.
+					withinBudget(output, frame.data->nodes.at(frame.begin - 1).pos);
+					continue;
+				}
+			} else if (frame.type == RenderFrame::Section) {
+				context->pop();
+			} else if (frame.type == RenderFrame::Partial) {
+				m_partialStack.pop();
+			}
+			storeFragment(frame.cacheKey, output, frame.outputStart);
+			stack.removeLast();
+			continue;
+		}
+
+		const TemplateData* data = frame.data;
+		const Node& node = data->nodes.at(frame.index);
+		if (node.type == Node::Text) {
+			if (m_segments && m_renderNesting == m_sinkNesting) {
+				m_segments->appendBuffered(output);
+				m_segments->appendText(data, data->source.constData() + node.start, node.end - node.start);
+				m_flushedLength += node.end - node.start;
+			} else {
+				output += QStringView(data->source).mid(node.start, node.end - node.start);
+			}
+			++frame.index;
+			withinBudget(output, node.pos);
+			continue;
+		} else if (node.type == Node::Value) {
+			renderValue(node.key, node.escapeMode, context, output, node.precision, node.grouping);
+			++frame.index;
+			withinBudget(output, node.pos);
+			continue;
+		}
+
+		// The remaining nodes may push a new frame, which invalidates 'frame'.
+		const int nodeIndex = frame.index;
+		frame.index = node.type == Node::Partial && node.next == 0 ? nodeIndex + 1 : node.next;
+		// Sections and partials are checked before they are entered or skipped,
+		// since templates made only of them would otherwise never be checked.
+		if (!withinBudget(output, node.pos)) {
+			continue;
+		}
+
+		RenderFrame child;
+		child.data = data;
+		child.begin = nodeIndex + 1;
+		child.index = nodeIndex + 1;
+		child.end = node.next;
+
+		// Sections are resolved before the cache is searched, since whether
+		// they are rendered, and how often, is part of the key for their output.
+		ResolvedValue value;
+		bool invertedFalse = false;
+		if (node.type == Node::Section) {
+			value = context->resolve(node.key);
+		} else if (node.type == Node::InvertedSection) {
+			invertedFalse = context->isFalse(node.key);
+		}
+
+		if (node.cacheable && m_fragmentCache && node.type != Node::Partial) {
+			QString cached;
+			const Escaper* escaper = m_activeEscaper ? m_activeEscaper : m_escaper;
+			if (node.type == Node::Section) {
+				const QString valueKey = resolvedValueKey(value, node.key, context, !node.cacheKeys.isEmpty());
+				if (!valueKey.isEmpty()) {
+					child.cacheKey = fragmentCacheKey('#', data, nodeIndex, escaper, valueKey, context);
+				}
+			} else {
+				child.cacheKey = fragmentCacheKey('^', data, nodeIndex, escaper, QString(QLatin1String(invertedFalse ? "f" : "t")),
+				                                  context);
+			}
+			if (!child.cacheKey.isEmpty() && m_fragmentCache->find(child.cacheKey, &cached)) {
+				output += cached;
+				withinBudget(output, node.pos);
+				continue;
+			}
+		}
+		child.outputStart = outputPosition(output);
+
+		switch (node.type) {
+		case Node::Section:
+		{
+			if (value.kind == ResolvedValue::Lambda) {
+				// The section refers to the template rather than copying its text.
+				Template owner(QSharedDataPointer<TemplateData>(const_cast<TemplateData*>(data)));
+				TemplateSection section(owner, nodeIndex + 1, node.next, node.start, node.end, this);
+				output += context->evalSection(node.key, section);
+				if (m_errorPos == -1 && withinBudget(output, node.pos)) {
+					storeFragment(child.cacheKey, output, child.outputStart);
+				}
+				continue;
+			} else if (value.kind == ResolvedValue::Falsy) {
+				storeFragment(child.cacheKey, output, child.outputStart);
+				continue;
+			}
+			if (m_maxDepth > 0 && stack.count() > m_maxDepth) {
+				setError("Maximum nesting depth exceeded", node.pos);
+				continue;
+			}
+			if (value.kind == ResolvedValue::List) {
+				if (m_maxIterations > 0 && ++m_iterationCount > m_maxIterations) {
+					setError("Maximum number of iterations exceeded", node.pos);
+					continue;
+				}
+				if (value.count >= 0) {
+					context->pushResolved(value, 0);
+				} else if (!context->pushNextItem(value, 0)) {
+					storeFragment(child.cacheKey, output, child.outputStart);
+					continue;
+				}
+				child.type = RenderFrame::ListItem;
+				child.value = value;
+			} else {
+				context->pushResolved(value);
+				child.type = RenderFrame::Section;
+			}
+		}
+		break;
+		case Node::InvertedSection:
+			if (!invertedFalse) {
+				storeFragment(child.cacheKey, output, child.outputStart);
+				continue;
+			}
+			if (m_maxDepth > 0 && stack.count() > m_maxDepth) {
+				setError("Maximum nesting depth exceeded", node.pos);
+				continue;
+			}
+			child.type = RenderFrame::InvertedSection;
+			break;
+		case Node::Partial:
+		{
+			if (m_maxDepth > 0 && stack.count() > m_maxDepth) {
+				setError("Maximum nesting depth exceeded", node.pos);
+				continue;
+			}
+			if (!includePartial(node.pos)) {
+				continue;
+			}
+			m_partialStack.push(node.key);
+			child.type = RenderFrame::Partial;
+			// Partials which were inlined by compile() are rendered from the nodes
+			// which follow the partial node, which are already set up in 'child'.
+			if (node.next == 0) {
+				Template partial = loadPartial(node.key, node.indentation, context, output);
+				if (m_errorPos != -1) {
+					m_partialStack.pop();
+					continue;
+				}
+				child.partial = partial.d;
+				child.data = partial.d.constData();
+				child.begin = 0;
+				child.index = 0;
+				child.end = child.data->nodes.count();
+			}
+			if (node.cacheable && m_fragmentCache) {
+				// Partials which are loaded are identified by their own source, which
+				// includes their indentation, while inlined partials are part of 'data'.
+				QString cached;
+				child.cacheKey = fragmentCacheKey('>', data, nodeIndex, m_activeEscaper ? m_activeEscaper : m_escaper,
+				                                  node.next == 0 ? child.data->cacheId : QString(), context);
+				if (m_fragmentCache->find(child.cacheKey, &cached)) {
+					m_partialStack.pop();
+					output += cached;
+					withinBudget(output, node.pos);
+					continue;
+				}
+				child.outputStart = outputPosition(output);
+			}
+		}
+		break;
+		case Node::Text:
+		case Node::Value:
+			break;
+		}
+		stack << child;
+	}
+
+	// If an error stopped rendering, leave the context and partial stacks
+	// as they were before render() was called.
+	while (!stack.isEmpty()) {
+		const RenderFrame& frame = stack.last();
+		if (frame.type == RenderFrame::ListItem || frame.type == RenderFrame::Section) {
+			context->pop();
+		} else if (frame.type == RenderFrame::Partial) {
+			m_partialStack.pop();
+		}
+		stack.removeLast();
+	}
+	--m_renderNesting;
+	if (m_renderNesting == 0) {
+		m_activeEscaper = 0;
+	}
+	m_peakScratchMemory = qMax(m_peakScratchMemory, output.capacity() * qint64(sizeof(QChar)) +
+	                                                 stack.capacity() * qint64(sizeof(RenderFrame)));
+
+	// The stack is empty but keeps its capacity for the next render.
+	pool->stacks << QVector<RenderFrame>();
+	pool->stacks.last().swap(stack);
+}
+
+/** Appends @p number to @p output, with commas between the thousands of the
+ * first run of digits in it if @p grouping is true.
+ */
+void appendGrouped(QStringView number, bool grouping, QString& output)
+{
+	int pos = 0;
+	if (pos < number.size() && number.at(pos) == QLatin1Char('-')) {
+		++pos;
+	}
+	int end = pos;
+	while (end < number.size() && number.at(end).isDigit()) {
+		++end;
+	}
+	const int separators = grouping && end - pos > 3 ? (end - pos - 1) / 3 : 0;
+	const int start = output.size();
+	output.resize(start + int(number.size()) + separators);
+	QChar* out = output.data() + start;
+	for (int i = 0; i < number.size(); i++) {
+		*out++ = number.at(i);
+		if (separators > 0 && i >= pos && i < end - 1 && (end - 1 - i) % 3 == 0) {
+			*out++ = QLatin1Char(',');
+		}
+	}
+}
+
+/** Appends @p count zeros to @p output. */
+void appendZeros(int count, QString& output)
+{
+	const int start = output.size();
+	output.resize(start + count);
+	QChar* out = output.data() + start;
+	for (int i = 0; i < count; i++) {
+		out[i] = QLatin1Char('0');
+	}
+}
+
+/** Appends @p magnitude, preceded by a minus sign if @p negative is true and
+ * followed by @p precision zero decimals, to @p output.
+ */
+void appendInteger(quint64 magnitude, bool negative, int precision, bool grouping, QString& output)
+{
+	// Enough for 20 digits, 6 separators and a sign.
+	QChar buffer[32];
+	QChar* end = buffer + sizeof(buffer) / sizeof(QChar);
+	QChar* pos = end;
+	int digits = 0;
+	do {
+		if (grouping && digits > 0 && digits % 3 == 0) {
+			*--pos = QLatin1Char(',');
+		}
+		*--pos = QLatin1Char(char('0' + magnitude % 10));
+		magnitude /= 10;
+		++digits;
+	} while (magnitude > 0);
+	if (negative) {
+		*--pos = QLatin1Char('-');
+	}
+	output.append(pos, int(end - pos));
+
+	if (precision > 0) {
+		output += QLatin1Char('.');
+		appendZeros(precision, output);
+	}
+}
+
+/** Appends @p number with @p precision decimals to @p output, with commas
+ * between the thousands if @p grouping is true. @p number must be finite.
+ *
+ * The result is the same as QString::number(number, 'f', precision), which
+ * rounds numbers that are exactly halfway between two results away from zero.
+ */
+void appendFixed(double number, int precision, bool grouping, QString& output)
+{
+	// printf() rounds exact halfway cases to even instead, so they are moved
+	// away from zero by the smallest possible step first. They are the numbers
+	// for which number * 10^precision is an odd multiple of 1/2. Since 5^precision
+	// is odd, that is when number * 2^(precision + 1) is an odd integer.
+	if (fmod(ldexp(fabs(number), precision + 1), 2.0) == 1.0) {
+		number = nextafter(number, number < 0 ? -HUGE_VAL : HUGE_VAL);
+	}
+	// Enough for the 309 digits of the largest double, a sign, a decimal
+	// point and 99 decimals.
+	char buffer[432];
+	const int length = qMin(snprintf(buffer, sizeof(buffer), "%.*f", precision, number), int(sizeof(buffer)) - 1);
+
+	// Only the digits are used, since the decimal point depends on the C locale.
+	int digits = 0;
+	bool zero = true;
+	for (int i = 0; i < length; i++) {
+		if (buffer[i] >= '0' && buffer[i] <= '9') {
+			zero = zero && buffer[i] == '0';
+			buffer[digits++] = buffer[i];
+		}
+	}
+	const int integerDigits = digits - precision;
+	// Numbers which round to zero are shown without a sign.
+	const bool negative = number < 0 && !zero;
+	const int separators = grouping ? (integerDigits - 1) / 3 : 0;
+
+	const int start = output.size();
+	output.resize(start + (negative ? 1 : 0) + integerDigits + separators + (precision > 0 ? precision + 1 : 0));
+	QChar* out = output.data() + start;
+	if (negative) {
+		*out++ = QLatin1Char('-');
+	}
+	for (int i = 0; i < digits; i++) {
+		if (i == integerDigits) {
+			*out++ = QLatin1Char('.');
+		}
+		*out++ = QLatin1Char(buffer[i]);
+		if (separators > 0 && i < integerDigits - 1 && (integerDigits - 1 - i) % 3 == 0) {
+			*out++ = QLatin1Char(',');
+		}
+	}
+}
+
+/** Appends @p value to @p output if it is a number, formatted with @p precision
+ * decimals (unless it is -1) and with commas between thousands if @p grouping is true.
+ *
+ * Returns false if @p value is not a number which can be formatted here, in which
+ * case it should be converted with QVariant::toString().
+ */
+bool appendNumber(const QVariant& value, int precision, bool grouping, QString& output)
+{
+	switch (value.userType()) {
+	case QMetaType::Int:
+	case QMetaType::LongLong:
+	{
+		const qint64 number = value.toLongLong();
+		// Negate as unsigned so that the minimum value does not overflow.
+		const quint64 magnitude = number < 0 ? 0 - quint64(number) : quint64(number);
+		appendInteger(magnitude, number < 0, precision, grouping, output);
+		return true;
+	}
+	case QMetaType::UInt:
+	case QMetaType::ULongLong:
+		appendInteger(value.toULongLong(), false, precision, grouping, output);
+		return true;
+	case QMetaType::Double:
+	case QMetaType::Float:
+	{
+		const double number = value.toDouble();
+		if ((precision < 0 && !grouping) || !qIsFinite(number)) {
+			// QVariant already produces the shortest representation which
+			// round-trips, so without a format the output is left to it.
+			return false;
+		}
+		if (precision < 0) {
+			// The shortest representation may also use an exponent, so it is
+			// still produced by QVariant and only the separators are added here.
+			appendGrouped(value.toString(), grouping, output);
+			return true;
+		}
+		appendFixed(number, precision, grouping, output);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+/** Reads a value format, such as ',.2', from @p format into @p tag.
+ * Returns false if @p format is not a valid format.
+ */
+bool readValueFormat(QStringView format, Tag& tag)
+{
+	int pos = 0;
+	bool grouping = false;
+	int precision = -1;
+	if (pos < format.size() && format.at(pos) == QLatin1Char(',')) {
+		grouping = true;
+		++pos;
+	}
+	if (pos < format.size() && format.at(pos) == QLatin1Char('.')) {
+		++pos;
+		precision = 0;
+		const int digitsStart = pos;
+		while (pos < format.size() && format.at(pos).isDigit() && pos - digitsStart < 2) {
+			precision = precision * 10 + format.at(pos).digitValue();
+			++pos;
+		}
+		if (pos == digitsStart) {
+			return false;
+		}
+	}
+	if (pos != format.size() || pos == 0) {
+		return false;
+	}
+	tag.precision = precision;
+	tag.grouping = grouping;
+	return true;
+}
+
+void Renderer::renderValue(const QString& key, Tag::EscapeMode escapeMode, Context* context, QString& output,
+                           int precision, bool grouping)
+{
+	const QVariant variant = context->variantValue(key);
+	// Numbers are written directly to the output. They never need escaping.
+	if (appendNumber(variant, precision, grouping, output)) {
+		return;
+	}
+	// Nor do booleans or strings which are known to be safe.
+	if (variant.userType() == QMetaType::Bool) {
+		output += variant.toBool() ? QLatin1String("true") : QLatin1String("false");
+		return;
+	} else if (variant.userType() == qMetaTypeId<SafeString>()) {
+		output += variant.value<SafeString>().toString();
+		return;
+	}
+	if (escapeMode == Tag::Escape) {
+		const Escaper* escaper = m_activeEscaper ? m_activeEscaper : m_escaper;
+		escaper->append(variant.toString(), output);
+	} else if (escapeMode == Tag::Unescape) {
+		output += unescapeHtml(variant.toString());
+	} else {
+		output += variant.toString();
+	}
+}
+
+bool Renderer::renderPartial(const QString& name, int indentation, Context* context, QString& output)
+{
+	// Generated code has no source positions to report.
+	if (!includePartial(0)) {
+		return false;
+	}
+	m_partialStack.push(name);
+
+	Template partial = loadPartial(name, indentation, context, output);
+	if (m_errorPos == -1) {
+		render(partial, 0, partial.d->nodes.count(), context, output);
+	}
+
+	m_partialStack.pop();
+
+	return m_errorPos == -1;
+}
+
+bool Renderer::withinLimits(const QString& output)
+{
+	return m_errorPos == -1 && withinBudget(output, 0);
+}
+
+bool Renderer::enterSection(int depth, const QString& output)
+{
+	if (m_maxDepth > 0 && depth > m_maxDepth) {
+		if (m_errorPos == -1) {
+			setError("Maximum nesting depth exceeded", 0);
+		}
+		return false;
+	}
+	return withinLimits(output);
+}
+
+bool Renderer::enterListItem(const QString& output)
+{
+	if (m_maxIterations > 0 && ++m_iterationCount > m_maxIterations) {
+		if (m_errorPos == -1) {
+			setError("Maximum number of iterations exceeded", 0);
+		}
+		return false;
+	}
+	return withinLimits(output);
+}
+
+QString Renderer::evalSection(const QString& key, const Template& _template, int nodeIndex, Context* context)
+{
+	const QVector<Node>& nodes = _template.nodes();
+	if (nodeIndex < 0 || nodeIndex >= nodes.count() || nodes.at(nodeIndex).type != Node::Section) {
+		return QString();
+	}
+	const Node& node = nodes.at(nodeIndex);
+	TemplateSection section(_template, nodeIndex + 1, node.next, node.start, node.end, this);
+	return context->evalSection(key, section);
+}
+
+/** Returns the source of a partial whose tag is indented by @p indentation spaces. */
+QString indentPartial(const QString& content, int indentation)
+{
+	int posOfLF = content.indexOf(QLatin1Char('\n'));
+	if (indentation <= 0 || posOfLF <= 0) {
+		return content;
+	}
+
+	// Indenting the output to keep the parent indentation. The lines are copied
+	// into a new string rather than inserting the indentation in place, which
+	// would move the rest of the partial for every line.
+	const QString spaces(indentation, QLatin1Char(' '));
+	QString source;
+	source.reserve(content.length() + content.count(QLatin1Char('\n')) * indentation);
+	int lineStart = 0;
+	while (posOfLF != -1 && posOfLF < content.length() - 1) { // no indentation AFTER the last character if it's a LF
+		source += QStringView(content).mid(lineStart, posOfLF + 1 - lineStart);
+		source += spaces;
+		lineStart = posOfLF + 1;
+		posOfLF = content.indexOf(QLatin1Char('\n'), lineStart);
+	}
+	source += QStringView(content).mid(lineStart);
+	return source;
+}
+
+Template Renderer::loadPartial(const QString& name, int indentation, Context* context, QString& output)
+{
+	QString partialContent = context->partialValue(name);
+
+	// If there is a need to add a special indentation to the partial
+	if (indentation > 0) {
+		output += QString(" ").repeated(indentation);
+	}
+
+	// Compiled partials are cached for as long as the partial resolver keeps
+	// returning the same content for them.
+	QPair<QString, int> cacheKey(name, indentation);
+	QHash<QPair<QString, int>, CompiledPartial>::const_iterator cached = m_compiledPartials.constFind(cacheKey);
+	if (cached != m_compiledPartials.constEnd() && cached->content == partialContent) {
+		Template partial = cached->compiled;
+		if (partial.errorPos() != -1) {
+			setError(partial.error(), partial.errorPos());
+		} else if (m_fragmentCache && partial.d->cacheId.isEmpty()) {
+			// Partials compiled before the cache was set, or by warmUpPartials(),
+			// are identified when they are first rendered with it.
+			updateCacheId(partial.d.data(), true);
+			m_compiledPartials[cacheKey].compiled = partial;
+		}
+		return partial;
+	}
+
+	Template partial;
+	partial.d->source = indentPartial(partialContent, indentation);
+	compile(partial.d.data());
+	updateCacheId(partial.d.data(), m_fragmentCache != 0);
+
+	CompiledPartial entry;
+	entry.content = partialContent;
+	entry.compiled = partial;
+	m_compiledPartials.insert(cacheKey, entry);
+	return partial;
+}
+
+typedef QPair<QString, int> PartialReference;
+
+/** Appends the partials included by @p _template, with the indentation of their
+ * tags, to @p references unless they are in @p seen.
+ */
+void appendPartialReferences(const Template& _template, QSet<PartialReference>& seen, QVector<PartialReference>& references)
+{
+	foreach (const Node& node, _template.nodes()) {
+		PartialReference reference(node.key, node.indentation);
+		if (node.type == Node::Partial && !seen.contains(reference)) {
+			seen.insert(reference);
+			references << reference;
+		}
+	}
+}
+
+/** Loads and compiles a partial for Renderer::warmUpPartials(). */
+class PartialLoadTask : public QRunnable
+{
+public:
+	PartialLoadTask(PartialResolver* resolver, const PartialReference& reference, const QString& startMarker,
+	                const QString& endMarker, QString* content, Template* compiled, QSemaphore* done)
+		: m_resolver(resolver)
+		, m_reference(reference)
+		, m_startMarker(startMarker)
+		, m_endMarker(endMarker)
+		, m_content(content)
+		, m_compiled(compiled)
+		, m_done(done)
+	{}
+
+	virtual void run()
+	{
+		Renderer renderer;
+		renderer.setTagMarkers(m_startMarker, m_endMarker);
+		*m_content = m_resolver->getPartial(m_reference.first);
+		*m_compiled = renderer.compile(indentPartial(*m_content, m_reference.second));
+		m_done->release();
+	}
+
+private:
+	PartialResolver* m_resolver;
+	PartialReference m_reference;
+	QString m_startMarker;
+	QString m_endMarker;
+	QString* m_content;
+	Template* m_compiled;
+	QSemaphore* m_done;
+};
+
+QStringList Renderer::warmUpPartials(const Template& _template, PartialResolver* resolver, QThreadPool* pool)
 {
-	return m_errorPos;
-}
+	if (!pool) {
+		pool = QThreadPool::globalInstance();
+	}
 
-QString Renderer::errorPartial() const
-{
-	return m_errorPartial;
+	QStringList names;
+	QSet<PartialReference> seen;
+	QVector<PartialReference> level;
+	appendPartialReferences(_template, seen, level);
+
+	// Partials are loaded one level of nesting at a time, since the partials
+	// in the next level are only known once those in this level are compiled.
+	// Recursive partials whose tags are indented are included with a different
+	// indentation at each level, so the levels are limited like the depth of
+	// rendering is.
+	for (int depth = 0; !level.isEmpty() && (m_maxDepth <= 0 || depth < m_maxDepth); depth++) {
+		QVector<QString> contents(level.count());
+		QVector<Template> compiled(level.count());
+		QSemaphore done;
+		for (int i = 0; i < level.count(); i++) {
+			PartialLoadTask* task = new PartialLoadTask(resolver, level.at(i), m_defaultTagStartMarker, m_defaultTagEndMarker,
+			                                            &contents[i], &compiled[i], &done);
+			// Load the partial in this thread if the pool is busy, which also
+			// avoids a deadlock if this is called from one of the pool's threads.
+			if (!pool->tryStart(task)) {
+				task->run();
+				delete task;
+			}
+		}
+		done.acquire(level.count());
+
+		QVector<PartialReference> nextLevel;
+		for (int i = 0; i < level.count(); i++) {
+			CompiledPartial entry;
+			entry.content = contents.at(i);
+			entry.compiled = compiled.at(i);
+			m_compiledPartials.insert(level.at(i), entry);
+			if (!names.contains(level.at(i).first)) {
+				names << level.at(i).first;
+			}
+			appendPartialReferences(compiled.at(i), seen, nextLevel);
+		}
+		level = nextLevel;
+	}
+	return names;
 }
 
-QString Renderer::render(const QString& _template, Context* context)
+Template Renderer::compile(const QString& _template)
 {
 	m_error.clear();
 	m_errorPos = -1;
 	m_errorPartial.clear();
 
-	m_tagStartMarker = m_defaultTagStartMarker;
-	m_tagEndMarker = m_defaultTagEndMarker;
+	Template result;
+	result.d->source = _template;
+	compile(result.d.data());
+	updateCacheId(result.d.data(), false);
+	return result;
+}
 
-	return render(_template, 0, _template.length(), context);
+// Inlining stops at this many nodes, so that partials which are included many
+// times by other partials cannot make the inlined template very large.
+const int MaxInlinedNodes = 65536;
+
+Template Renderer::compile(const QString& _template, PartialResolver* partials)
+{
+	Template result = compile(_template);
+	if (result.errorPos() != -1 || !partials) {
+		return result;
+	}
+
+	// The nodes are copied into a new list, since inlining a partial changes
+	// the indexes of the nodes which follow it.
+	QVector<Node> nodes;
+	QStringList inlining;
+	QHash<QString, InlinedPartial> inlined;
+	Template original = result;
+	appendInlinedNodes(result.d.data(), original, 0, partials, inlining, inlined, nodes);
+	result.d->nodes = nodes;
+	updateCacheId(result.d.data(), false);
+	return result;
 }
 
-QString Renderer::render(const QString& _template, int startPos, int endPos, Context* context)
+/** Appends the nodes of @p from to @p nodes, replacing the partials which can
+ * be inlined with their nodes, whose source is appended to the source of @p data.
+ *
+ * @p sourceOffset is the position of the source of @p from in the source of
+ * @p data and @p inlining holds the names of the partials which are being inlined.
+ * @p inlined holds the partials whose source has already been appended, by name
+ * and indentation, so that partials which are included many times share one copy.
+ */
+void Renderer::appendInlinedNodes(TemplateData* data, const Template& from, int sourceOffset, PartialResolver* partials,
+                                  QStringList& inlining, QHash<QString, InlinedPartial>& inlined, QVector<Node>& nodes)
 {
-	QString output;
-	int lastTagEnd = startPos;
+	// The indexes of section nodes whose 'next' index has not been updated yet,
+	// and the original index of the node after each of them.
+	QVector<QPair<int, int> > openSections;
+
+	const QVector<Node>& fromNodes = from.d->nodes;
+	for (int i = 0; i < fromNodes.count(); i++) {
+		while (!openSections.isEmpty() && openSections.last().second == i) {
+			nodes[openSections.last().first].next = nodes.count();
+			openSections.removeLast();
+		}
 
-	while (m_errorPos == -1) {
-		Tag tag = findTag(_template, lastTagEnd, endPos);
-		if (tag.type == Tag::Null) {
-			output += QStringView(_template).mid(lastTagEnd, endPos - lastTagEnd);
-			break;
+		Node node = fromNodes.at(i);
+		node.start += sourceOffset;
+		node.end += sourceOffset;
+		if (node.type == Node::Section || node.type == Node::InvertedSection) {
+			openSections << QPair<int, int>(int(nodes.count()), node.next);
 		}
-		output += QStringView(_template).mid(lastTagEnd, tag.start - lastTagEnd);
-		switch (tag.type) {
-		case Tag::Value:
-		{
-			QString value = context->stringValue(tag.key);
-			if (tag.escapeMode == Tag::Escape) {
-				value = escapeHtml(value);
-			} else if (tag.escapeMode == Tag::Unescape) {
-				value = unescapeHtml(value);
-			}
-			output += value;
-			lastTagEnd = tag.end;
+		if (node.type != Node::Partial || node.cacheable || inlining.contains(node.key) ||
+		    nodes.count() >= MaxInlinedNodes) {
+			nodes << node;
+			continue;
 		}
-		break;
-		case Tag::SectionStart:
-		{
-			Tag endTag = findEndTag(_template, tag, endPos);
-			if (endTag.type == Tag::Null) {
-				if (m_errorPos == -1) {
-					setError("No matching end tag found for section", tag.start);
+
+		const QString inlinedKey = QString::number(node.indentation) + QLatin1Char(':') + node.key;
+		QHash<QString, InlinedPartial>::const_iterator existing = inlined.constFind(inlinedKey);
+		InlinedPartial partial;
+		if (existing != inlined.constEnd()) {
+			partial = existing.value();
+		} else {
+			QString content = partials->getPartial(node.key);
+			Renderer renderer;
+			renderer.setTagMarkers(m_defaultTagStartMarker, m_defaultTagEndMarker);
+			partial.compiled = renderer.compile(indentPartial(content, node.indentation));
+			partial.sourceOffset = -1;
+			if (partial.compiled.errorPos() == -1) {
+				partial.sourceOffset = data->source.length();
+				data->source += QString(node.indentation, QLatin1Char(' '));
+				data->source += partial.compiled.d->source;
+
+				bool recorded = false;
+				for (int j = 0; j < data->inlinedPartials.count() && !recorded; j++) {
+					recorded = data->inlinedPartials.at(j).first == node.key;
 				}
-			} else {
-				int listCount = context->listCount(tag.key);
-				if (listCount > 0) {
-					for (int i=0; i < listCount; i++) {
-						context->push(tag.key, i);
-						output += render(_template, tag.end, endTag.start, context);
-						context->pop();
-					}
-				} else if (context->canEval(tag.key)) {
-					output += context->eval(tag.key, _template.mid(tag.end, endTag.start - tag.end), this);
-				} else if (!context->isFalse(tag.key)) {
-					context->push(tag.key);
-					output += render(_template, tag.end, endTag.start, context);
-					context->pop();
+				if (!recorded) {
+					data->inlinedPartials << qMakePair(node.key, content);
 				}
-				lastTagEnd = endTag.end;
 			}
+			inlined.insert(inlinedKey, partial);
 		}
-		break;
-		case Tag::InvertedSectionStart:
-		{
-			Tag endTag = findEndTag(_template, tag, endPos);
-			if (endTag.type == Tag::Null) {
-				if (m_errorPos == -1) {
-					setError("No matching end tag found for inverted section", tag.start);
-				}
-			} else {
-				if (context->isFalse(tag.key)) {
-					output += render(_template, tag.end, endTag.start, context);
-				}
-				lastTagEnd = endTag.end;
-			}
+		if (partial.sourceOffset == -1) {
+			nodes << node;
+			continue;
 		}
-		break;
-		case Tag::SectionEnd:
-			setError("Unexpected end tag", tag.start);
-			lastTagEnd = tag.end;
-			break;
-		case Tag::Partial:
-		{
-			QString tagStartMarker = m_tagStartMarker;
-			QString tagEndMarker = m_tagEndMarker;
 
-			m_tagStartMarker = m_defaultTagStartMarker;
-			m_tagEndMarker = m_defaultTagEndMarker;
+		const int partialIndex = nodes.count();
+		node.start = partial.sourceOffset;
+		node.end = partial.sourceOffset + node.indentation + partial.compiled.d->source.length();
+		nodes << node;
+		if (node.indentation > 0) {
+			Node indentation;
+			indentation.type = Node::Text;
+			indentation.start = partial.sourceOffset;
+			indentation.end = indentation.start + node.indentation;
+			nodes << indentation;
+		}
 
-			m_partialStack.push(tag.key);
+		inlining << node.key;
+		appendInlinedNodes(data, partial.compiled, partial.sourceOffset + node.indentation, partials, inlining, inlined,
+		                   nodes);
+		inlining.removeLast();
 
-			QString partialContent = context->partialValue(tag.key);
+		nodes[partialIndex].next = nodes.count();
+	}
+	while (!openSections.isEmpty()) {
+		nodes[openSections.last().first].next = nodes.count();
+		openSections.removeLast();
+	}
+}
 
-			// If there is a need to add a special indentation to the partial
-			if (tag.indentation > 0) {
-				output += QString(" ").repeated(tag.indentation);
-				// Indenting the output to keep the parent indentation.
-				int posOfLF = partialContent.indexOf("\n", 0);
-				while (posOfLF > 0 && posOfLF < (partialContent.length() - 1)) { // .length() - 1 because we dont want indentation AFTER the last character if it's a LF
-					partialContent = partialContent.insert(posOfLF + 1, QString(" ").repeated(tag.indentation));
-					posOfLF = partialContent.indexOf("\n", posOfLF + 1);
-				}
-			}
+void appendTextNode(QVector<Node>& nodes, int start, int end)
+{
+	if (start >= end) {
+		return;
+	}
+	Node node;
+	node.type = Node::Text;
+	node.pos = start;
+	node.start = start;
+	node.end = end;
+	nodes << node;
+}
 
-			QString partialRendered = render(partialContent, 0, partialContent.length(), context);
+void Renderer::compile(TemplateData* data)
+{
+	m_tagStartMarker = m_defaultTagStartMarker;
+	m_tagEndMarker = m_defaultTagEndMarker;
 
-			output += partialRendered;
+	const QString& content = data->source;
+	QVector<Node>& nodes = data->nodes;
+	QVector<int> openSections;
+	int lastTagEnd = 0;
 
-			lastTagEnd = tag.end;
+	while (m_errorPos == -1) {
+		Tag tag = findTag(content, lastTagEnd, content.length());
+		if (m_errorPos != -1) {
+			break;
+		}
+		if (tag.type == Tag::Null) {
+			appendTextNode(nodes, lastTagEnd, content.length());
+			break;
+		}
+		appendTextNode(nodes, lastTagEnd, tag.start);
 
-			m_partialStack.pop();
+		Node node;
+		node.key = tag.key;
+		node.pos = tag.start;
+		node.start = tag.start;
+		node.end = tag.end;
 
-			m_tagStartMarker = tagStartMarker;
-			m_tagEndMarker = tagEndMarker;
-		}
-		break;
-		case Tag::SetDelimiter:
-			lastTagEnd = tag.end;
+		switch (tag.type) {
+		case Tag::Value:
+			node.type = Node::Value;
+			node.escapeMode = tag.escapeMode;
+			node.precision = tag.precision;
+			node.grouping = tag.grouping;
+			nodes << node;
 			break;
-		case Tag::Comment:
-			lastTagEnd = tag.end;
+		case Tag::SectionStart:
+		case Tag::InvertedSectionStart:
+			node.type = tag.type == Tag::SectionStart ? Node::Section : Node::InvertedSection;
+			node.cacheable = tag.cacheable;
+			node.cacheKeys = tag.cacheKeys;
+			node.start = tag.end;
+			openSections << nodes.count();
+			nodes << node;
+			break;
+		case Tag::SectionEnd:
+			if (openSections.isEmpty()) {
+				setError("Unexpected end tag", tag.start);
+			} else if (nodes.at(openSections.last()).key != tag.key) {
+				setError("Tag start/end key mismatch", tag.start);
+			} else {
+				Node& section = nodes[openSections.last()];
+				section.end = tag.start;
+				section.next = nodes.count();
+				openSections.removeLast();
+			}
+			break;
+		case Tag::Partial:
+			node.type = Node::Partial;
+			node.indentation = tag.indentation;
+			node.cacheable = tag.cacheable;
+			node.cacheKeys = tag.cacheKeys;
+			nodes << node;
 			break;
+		case Tag::Comment:
+		case Tag::SetDelimiter:
 		case Tag::Null:
 			break;
 		}
+		lastTagEnd = tag.end;
 	}
 
-	return output;
+	if (m_errorPos == -1 && !openSections.isEmpty()) {
+		const Node& section = nodes.at(openSections.first());
+		if (section.type == Node::Section) {
+			setError("No matching end tag found for section", section.pos);
+		} else {
+			setError("No matching end tag found for inverted section", section.pos);
+		}
+	}
+
+	if (m_errorPos != -1) {
+		data->error = m_error;
+		data->errorPos = m_errorPos;
+	}
 }
 
 void Renderer::setError(const QString& error, int pos)
@@ -400,14 +2947,66 @@ void Renderer::setError(const QString& error, int pos)
 	}
 }
 
+int Renderer::indexOfMarker(const QString& content, const QString& marker, int from)
+{
+	const int markerLength = marker.length();
+	if (markerLength == 0) {
+		return from <= content.length() ? from : -1;
+	}
+
+	// Search for the first character of the marker, which QString does with
+	// vectorized code, and only compare the rest of the marker where it occurs.
+	// Most templates are mostly literal text, so this rarely finds false matches.
+	const QChar first = marker.at(0);
+	const QChar* markerRest = marker.constData() + 1;
+	const size_t restSize = (markerLength - 1) * sizeof(QChar);
+	const int lastStart = content.length() - markerLength;
+	while (from <= lastStart) {
+		int pos = content.indexOf(first, from);
+		if (pos == -1 || pos > lastStart) {
+			return -1;
+		}
+		if (memcmp(content.constData() + pos + 1, markerRest, restSize) == 0) {
+			return pos;
+		}
+		from = pos + 1;
+	}
+	return -1;
+}
+
+/** Reads a cache annotation, '|cache' or '|cache:key1,key2', from the end of
+ * the key of @p tag and removes it from the key.
+ */
+void readCacheAnnotation(Tag& tag)
+{
+	const int annotationPos = tag.key.lastIndexOf(QLatin1String("|cache"));
+	if (annotationPos <= 0) {
+		return;
+	}
+	QStringView annotation = QStringView(tag.key).mid(annotationPos + 6);
+	if (annotation.isEmpty()) {
+		tag.cacheable = true;
+	} else if (annotation.at(0) == QLatin1Char(':')) {
+		tag.cacheable = true;
+		foreach (const QString& key, annotation.mid(1).toString().split(',')) {
+			if (!key.isEmpty()) {
+				tag.cacheKeys << key;
+			}
+		}
+	}
+	if (tag.cacheable) {
+		tag.key.truncate(annotationPos);
+	}
+}
+
 Tag Renderer::findTag(const QString& content, int pos, int endPos)
 {
-	int tagStartPos = content.indexOf(m_tagStartMarker, pos);
+	int tagStartPos = indexOfMarker(content, m_tagStartMarker, pos);
 	if (tagStartPos == -1 || tagStartPos >= endPos) {
 		return Tag();
 	}
 
-	int tagEndPos = content.indexOf(m_tagEndMarker, tagStartPos + m_tagStartMarker.length());
+	int tagEndPos = indexOfMarker(content, m_tagEndMarker, tagStartPos + m_tagStartMarker.length());
 	if (tagEndPos == -1) {
 		return Tag();
 	}
@@ -456,6 +3055,17 @@ Tag Renderer::findTag(const QString& content, int pos, int endPos)
 		}
 		tag.type = Tag::Value;
 		tag.key = readTagName(content, pos, endPos);
+
+		// A value tag may end with a number format, eg. {{price|,.2}}. Keys which
+		// contain '|' but no valid format are left as they are.
+		int formatPos = tag.key.lastIndexOf(QLatin1Char('|'));
+		if (formatPos > 0 && readValueFormat(QStringView(tag.key).mid(formatPos + 1), tag)) {
+			tag.key.truncate(formatPos);
+		}
+	}
+
+	if (tag.type == Tag::SectionStart || tag.type == Tag::InvertedSectionStart || tag.type == Tag::Partial) {
+		readCacheAnnotation(tag);
 	}
 
 	if (tag.type != Tag::Value) {
@@ -467,16 +3077,14 @@ Tag Renderer::findTag(const QString& content, int pos, int endPos)
 
 QString Renderer::readTagName(const QString& content, int pos, int endPos)
 {
-	QString name;
-	name.reserve(endPos - pos);
 	while (content.at(pos).isSpace()) {
 		++pos;
 	}
+	const int nameStart = pos;
 	while (!content.at(pos).isSpace() && pos < endPos) {
-		name += content.at(pos);
 		++pos;
 	}
-	return name;
+	return content.mid(nameStart, pos - nameStart);
 }
 
 void Renderer::readSetDelimiter(const QString& content, int pos, int endPos)
@@ -514,31 +3122,124 @@ void Renderer::readSetDelimiter(const QString& content, int pos, int endPos)
 	m_tagEndMarker = endMarker;
 }
 
-Tag Renderer::findEndTag(const QString& content, const Tag& startTag, int endPos)
+void Renderer::setFragmentCache(FragmentCache* cache)
 {
-	int tagDepth = 1;
-	int pos = startTag.end;
+	m_fragmentCache = cache;
+}
 
-	while (true) {
-		Tag nextTag = findTag(content, pos, endPos);
-		if (nextTag.type == Tag::Null) {
-			return nextTag;
-		} else if (nextTag.type == Tag::SectionStart || nextTag.type == Tag::InvertedSectionStart) {
-			++tagDepth;
-		} else if (nextTag.type == Tag::SectionEnd) {
-			--tagDepth;
-			if (tagDepth == 0) {
-				if (nextTag.key != startTag.key) {
-					setError("Tag start/end key mismatch", nextTag.start);
-					return Tag();
-				}
-				return nextTag;
-			}
-		}
-		pos = nextTag.end;
+FragmentCache* Renderer::fragmentCache() const
+{
+	return m_fragmentCache;
+}
+
+qint64 Renderer::memoryUsage() const
+{
+	qint64 bytes = 0;
+	foreach (const CompiledPartial& partial, m_compiledPartials) {
+		bytes += stringMemoryUsage(partial.content) + partial.compiled.memoryUsage();
+	}
+	return bytes;
+}
+
+qint64 Renderer::peakScratchMemory() const
+{
+	return m_peakScratchMemory;
+}
+
+void Renderer::storeFragment(const QString& cacheKey, const QString& output, qint64 outputStart)
+{
+	// Output which has already been written to a sink cannot be cached, and
+	// nor can segmented output, since the output string only holds its values.
+	const qint64 start = outputStart - (outputPosition(output) - output.length());
+	if (!cacheKey.isEmpty() && m_fragmentCache && start >= 0 &&
+	    (!m_segments || m_renderNesting != m_sinkNesting)) {
+		m_fragmentCache->insert(cacheKey, output.mid(int(start)));
 	}
+}
+
+void Renderer::setFlushThreshold(int length)
+{
+	m_flushThreshold = length;
+}
 
-	return Tag();
+int Renderer::flushThreshold() const
+{
+	return m_flushThreshold;
+}
+
+void Renderer::setFlushAtListItems(bool flush)
+{
+	m_flushAtListItems = flush;
+}
+
+bool Renderer::flushAtListItems() const
+{
+	return m_flushAtListItems;
+}
+
+void Renderer::setMaxDepth(int depth)
+{
+	m_maxDepth = depth;
+}
+
+int Renderer::maxDepth() const
+{
+	return m_maxDepth;
+}
+
+void Renderer::setMaxOutputLength(int length)
+{
+	m_maxOutputLength = length;
+}
+
+int Renderer::maxOutputLength() const
+{
+	return m_maxOutputLength;
+}
+
+void Renderer::setMaxPartials(int count)
+{
+	m_maxPartials = count;
+}
+
+int Renderer::maxPartials() const
+{
+	return m_maxPartials;
+}
+
+void Renderer::setMaxIterations(int count)
+{
+	m_maxIterations = count;
+}
+
+int Renderer::maxIterations() const
+{
+	return m_maxIterations;
+}
+
+void Renderer::setDeadline(const QDeadlineTimer& deadline)
+{
+	m_deadline = deadline;
+}
+
+QDeadlineTimer Renderer::deadline() const
+{
+	return m_deadline;
+}
+
+void Renderer::setCancellationToken(const QAtomicInt* token)
+{
+	m_cancellationToken = token;
+}
+
+void Renderer::setVerifier(Verifier* verifier)
+{
+	m_verifier = verifier;
+}
+
+Verifier* Renderer::verifier() const
+{
+	return m_verifier;
 }
 
 void Renderer::setTagMarkers(const QString& startMarker, const QString& endMarker)
@@ -547,6 +3248,16 @@ void Renderer::setTagMarkers(const QString& startMarker, const QString& endMarke
 	m_defaultTagEndMarker = endMarker;
 }
 
+void Renderer::setEscaper(const Escaper* escaper)
+{
+	m_escaper = escaper;
+}
+
+const Escaper* Renderer::escaper() const
+{
+	return m_escaper;
+}
+
 void Renderer::expandTag(Tag& tag, const QString& content)
 {
 	int start = tag.start;
@@ -576,3 +3287,233 @@ void Renderer::expandTag(Tag& tag, const QString& content)
 	tag.end = end;
 	tag.indentation = indentation;
 }
+
+TemplateSnapshot::TemplateSnapshot()
+	: d(new TemplateSnapshotData)
+{}
+
+TemplateSnapshot::TemplateSnapshot(const TemplateSnapshot& other)
+	: PartialResolver()
+	, d(other.d)
+{}
+
+TemplateSnapshot& TemplateSnapshot::operator=(const TemplateSnapshot& other)
+{
+	d = other.d;
+	return *this;
+}
+
+TemplateSnapshot::~TemplateSnapshot()
+{}
+
+int TemplateSnapshot::version() const
+{
+	return d->version;
+}
+
+QStringList TemplateSnapshot::names() const
+{
+	return d->templates.keys();
+}
+
+bool TemplateSnapshot::contains(const QString& name) const
+{
+	return d->templates.contains(name);
+}
+
+Template TemplateSnapshot::value(const QString& name) const
+{
+	return d->templates.value(name);
+}
+
+QString TemplateSnapshot::getPartial(const QString& name)
+{
+	// The data is shared by every copy of the snapshot, so it is only read.
+	const TemplateSnapshotData* data = d.constData();
+	return data->sources.value(name);
+}
+
+TemplateRegistry::TemplateRegistry()
+{}
+
+TemplateSnapshot TemplateRegistry::snapshot() const
+{
+	QMutexLocker locker(&m_mutex);
+	return m_current;
+}
+
+bool TemplateRegistry::publish(const QHash<QString, QString>& templates, QString* error)
+{
+	// The new templates are compiled before the lock is taken, so renders can
+	// take snapshots of the current version in the meantime.
+	TemplateSnapshot next;
+	TemplateSnapshotData* data = next.d.data();
+	data->sources = templates;
+
+	PartialMap partials(templates);
+	Renderer renderer;
+	for (QHash<QString, QString>::const_iterator it = templates.constBegin(); it != templates.constEnd(); ++it) {
+		Template compiled = renderer.compile(it.value(), &partials);
+		if (compiled.errorPos() != -1) {
+			if (error) {
+				*error = QString("%1: %2").arg(it.key(), compiled.error());
+			}
+			return false;
+		}
+		data->templates.insert(it.key(), compiled);
+	}
+
+	QMutexLocker locker(&m_mutex);
+	data->version = m_current.version() + 1;
+	TemplateSnapshot previous = m_current;
+	m_current = next;
+	locker.unlock();
+	// The old snapshot is freed here, without holding the lock, or by the last
+	// render which still uses it.
+	return true;
+}
+
+// The layout of a SharedTemplateStore segment is a header of the magic number,
+// the store version, the number of templates and the size of the segment, one
+// directory entry for each template with the offset and length of its name and
+// of its binary data, then the names as UTF-16 and the data of each template.
+// Offsets are in bytes from the start of the segment and each name and template
+// starts at a multiple of four bytes, so nothing refers to a pointer.
+const char sharedStoreMagic[] = {'M', 'S', 'T', 'S'};
+const quint32 sharedStoreVersion = 1;
+const int SharedStoreHeaderSize = 16;
+const int SharedStoreEntrySize = 16;
+
+void alignTo4(QByteArray& data)
+{
+	while (data.size() % 4 != 0) {
+		data.append('\0');
+	}
+}
+
+SharedTemplateStore::SharedTemplateStore(const QString& key)
+	: m_memory(new QSharedMemory(key))
+{}
+
+SharedTemplateStore::~SharedTemplateStore()
+{}
+
+bool SharedTemplateStore::create(const QHash<QString, Template>& templates)
+{
+	m_templates.clear();
+	m_error.clear();
+
+	QByteArray directory;
+	QByteArray contents;
+	const int contentsOffset = SharedStoreHeaderSize + templates.count() * SharedStoreEntrySize;
+	for (QHash<QString, Template>::const_iterator it = templates.constBegin(); it != templates.constEnd(); ++it) {
+		QByteArray binary = it.value().toBinary();
+		if (binary.isEmpty()) {
+			m_error = QString("Template %1 cannot be stored: %2").arg(it.key(), it.value().error());
+			return false;
+		}
+		appendUInt32(directory, contentsOffset + contents.size());
+		appendUInt32(directory, it.key().length());
+		contents.append(reinterpret_cast<const char*>(it.key().constData()), it.key().length() * int(sizeof(QChar)));
+		alignTo4(contents);
+		appendUInt32(directory, contentsOffset + contents.size());
+		appendUInt32(directory, binary.size());
+		contents.append(binary);
+		alignTo4(contents);
+	}
+
+	// The magic number is written last, so that processes which attach while
+	// the segment is being filled in do not use it.
+	QByteArray segment(4, '\0');
+	appendUInt32(segment, sharedStoreVersion);
+	appendUInt32(segment, templates.count());
+	appendUInt32(segment, contentsOffset + contents.size());
+	segment.append(directory);
+	segment.append(contents);
+
+	if (!m_memory->create(segment.size())) {
+		m_error = m_memory->errorString();
+		return false;
+	}
+	m_memory->lock();
+	char* data = static_cast<char*>(m_memory->data());
+	memcpy(data + 4, segment.constData() + 4, segment.size() - 4);
+	memcpy(data, sharedStoreMagic, sizeof(sharedStoreMagic));
+	m_memory->unlock();
+	return readTemplates();
+}
+
+bool SharedTemplateStore::attach()
+{
+	m_templates.clear();
+	m_error.clear();
+	if (!m_memory->isAttached() && !m_memory->attach(QSharedMemory::ReadOnly)) {
+		m_error = m_memory->errorString();
+		return false;
+	}
+	return readTemplates();
+}
+
+bool SharedTemplateStore::readTemplates()
+{
+	// create() writes the segment while holding the lock and sets the magic
+	// number last, so the header and entries are read while holding it too.
+	// Taking the lock orders these reads after the writes of create(), and
+	// since the segment is never written again, the templates which refer to
+	// it can be read later without the lock.
+	m_memory->lock();
+	const char* data = static_cast<const char*>(m_memory->constData());
+	const qint64 size = m_memory->size();
+	if (size < SharedStoreHeaderSize || memcmp(data, sharedStoreMagic, sizeof(sharedStoreMagic)) != 0) {
+		m_memory->unlock();
+		m_error = "The shared templates have not been created yet";
+		return false;
+	}
+
+	const qint64 count = readUInt32(data + 8);
+	bool valid = readUInt32(data + 4) == sharedStoreVersion && readUInt32(data + 12) <= size &&
+	             SharedStoreHeaderSize + count * SharedStoreEntrySize <= size;
+	const char* entry = data + SharedStoreHeaderSize;
+	for (int i = 0; i < count && valid; i++, entry += SharedStoreEntrySize) {
+		const qint64 nameOffset = readUInt32(entry);
+		const qint64 nameLength = readUInt32(entry + 4);
+		const qint64 binaryOffset = readUInt32(entry + 8);
+		const qint64 binarySize = readUInt32(entry + 12);
+		// The checksums are not verified, since that would read every template
+		// in every process which attaches. The segment was written by create()
+		// from templates which had just been encoded, and the nodes of each
+		// template are still validated when they are first read.
+		Template result;
+		valid = nameOffset % 4 == 0 && nameOffset + nameLength * qint64(sizeof(QChar)) <= size &&
+		        binaryOffset % 4 == 0 && binaryOffset + binarySize <= size &&
+		        readBinaryTemplate(QByteArray::fromRawData(data + binaryOffset, int(binarySize)), result.d.data(), false);
+		if (valid) {
+			// The template refers to the segment, which stays attached for as long
+			// as any template from it is in use. The name is copied, since names()
+			// may be used after the store and its segment are gone.
+			result.d->mapping = m_memory;
+			m_templates.insert(QString(reinterpret_cast<const QChar*>(data + nameOffset), int(nameLength)), result);
+		}
+	}
+	m_memory->unlock();
+	if (!valid) {
+		m_templates.clear();
+		m_error = "The shared templates are not valid";
+	}
+	return valid;
+}
+
+QStringList SharedTemplateStore::names() const
+{
+	return m_templates.keys();
+}
+
+Template SharedTemplateStore::value(const QString& name) const
+{
+	return m_templates.value(name);
+}
+
+QString SharedTemplateStore::error() const
+{
+	return m_error;
+}
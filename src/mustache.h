@@ -14,19 +14,192 @@
 
 #pragma once
 
+#include <QtCore/QAtomicInt>
+#include <QtCore/QByteArray>
+#include <QtCore/QCache>
+#include <QtCore/QDeadlineTimer>
+#include <QtCore/QHash>
+#include <QtCore/QIODevice>
+#include <QtCore/QMutex>
+#include <QtCore/QPair>
+#include <QtCore/QSharedDataPointer>
+#include <QtCore/QSharedPointer>
 #include <QtCore/QStack>
 #include <QtCore/QString>
+#include <QtCore/QStringList>
+#include <QtCore/QThreadPool>
+#include <QtCore/QVarLengthArray>
 #include <QtCore/QVariant>
+#include <QtCore/QVector>
 
 #if __cplusplus >= 201103L
 #include <functional> /* for std::function */
 #endif
 
+class QFile;
+class QSharedMemory;
+
 namespace Mustache
 {
 
 class PartialResolver;
 class Renderer;
+class TemplateData;
+class TemplateSection;
+class TemplateSnapshotData;
+
+/** The value for a key, classified by how it affects a section tag.
+  * This is returned by Context::resolve().
+  */
+struct ResolvedValue
+{
+	enum Kind
+	{
+		Falsy, /// A false value, an empty list or a missing key
+		Truthy, /// Any other value which is not a list, map or lambda
+		Map, /// A non-empty map
+		List, /// A non-empty list, with 'count' items
+		Lambda /// A value which is rendered with Context::eval()
+	};
+
+	ResolvedValue()
+		: kind(Falsy)
+		, count(0)
+		, data(0)
+	{}
+
+	Kind kind;
+	/// The number of items, for List values, or -1 for lists whose length is
+	/// not known in advance, whose items are pushed with Context::pushNextItem()
+	int count;
+	/// The key which was resolved
+	QString key;
+	/// The value itself, for contexts which can push it without looking up
+	/// the key again. For List values, this holds the list.
+	QVariant value;
+	/// For contexts which refer to values in place rather than copying them,
+	/// the location of the value in the context's data, or 0.
+	const QVariant* data;
+};
+
+/** Escapes the values written by {{key}} tags for the format of the output.
+ *
+ * Built-in escapers for common formats are returned by html(), xml(), json()
+ * and javaScript(). Other formats can be supported by implementing append().
+ * See Renderer::setEscaper() and Template::setEscaper().
+ */
+class Escaper
+{
+public:
+	virtual ~Escaper() {}
+
+	/** Appends @p text to @p output, escaping the characters which have a special
+	 * meaning in the output format.
+	 */
+	virtual void append(const QString& text, QString& output) const = 0;
+
+	/** Replaces &, <, > and " with HTML entities. This is the default. */
+	static const Escaper* html();
+
+	/** Replaces &, <, >, " and ' with XML entities. */
+	static const Escaper* xml();
+
+	/** Escapes text for use inside a JSON string. */
+	static const Escaper* json();
+
+	/** Escapes text for use inside a JavaScript string literal in either kind of
+	 * quotes, including in a <script> element in HTML.
+	 */
+	static const Escaper* javaScript();
+};
+
+/** A string which is already safe to include in the output, such as HTML
+ * which was produced by trusted code.
+ *
+ * Values of this type, stored in a QVariant, are written to the output as
+ * they are by {{key}} tags, without being escaped. Numbers and booleans are
+ * also never escaped, since they cannot contain characters which need it.
+ */
+class SafeString
+{
+public:
+	SafeString() {}
+	explicit SafeString(const QString& text)
+		: m_text(text)
+	{}
+
+	QString toString() const { return m_text; }
+
+	bool operator==(const SafeString& other) const { return m_text == other.m_text; }
+	bool operator!=(const SafeString& other) const { return m_text != other.m_text; }
+
+private:
+	QString m_text;
+};
+
+/** A value which is only computed if a template reads it.
+ *
+ * When a LazyValue stored in a QVariant is looked up by QtVariantContext, its
+ * function is called and the result is used in place of the LazyValue. The
+ * function is called each time the value is read.
+ */
+class LazyValue
+{
+public:
+#if __cplusplus >= 201103L
+	typedef std::function<QVariant()> Function;
+#else
+	typedef QVariant (*Function)();
+#endif
+
+	LazyValue()
+		: m_function(0)
+	{}
+	explicit LazyValue(const Function& function)
+		: m_function(function)
+	{}
+
+	/** Computes the value, or returns a null QVariant if there is no function. */
+	QVariant value() const;
+
+private:
+	Function m_function;
+};
+
+/** A list whose items are produced one at a time while a section is
+ * rendered, eg. from a database cursor, rather than being stored in a
+ * QVariantList up front.
+ *
+ * Each time a section iterates over the sequence, its function is called with
+ * an index of 0, 1, 2 and so on, and sets @p item to the item at that index,
+ * until it returns false to end the sequence. A sequence with no items is
+ * false, like an empty list, which is found by calling the function with an
+ * index of 0.
+ */
+class LazySequence
+{
+public:
+#if __cplusplus >= 201103L
+	typedef std::function<bool(int index, QVariant* item)> Function;
+#else
+	typedef bool (*Function)(int index, QVariant* item);
+#endif
+
+	LazySequence()
+		: m_function(0)
+	{}
+	explicit LazySequence(const Function& function)
+		: m_function(function)
+	{}
+
+	/** Sets @p item to the item at @p index and returns true, or returns false
+	 * if the sequence has ended.
+	 */
+	bool next(int index, QVariant* item) const;
+
+private:
+	Function m_function;
+};
 
 /** Context is an interface that Mustache::Renderer::render() uses to
   * fetch substitutions for template tags.
@@ -45,6 +218,14 @@ public:
 	  */
 	virtual QString stringValue(const QString& key) const = 0;
 
+	/** Returns the value for @p key in the current context.
+	  *
+	  * The renderer uses this to replace value tags, so that numbers can be formatted
+	  * without converting them to a string first. The default implementation returns
+	  * stringValue().
+	  */
+	virtual QVariant variantValue(const QString& key) const;
+
 	/** Returns true if the value for @p key is 'false' or an empty list.
 	  * 'False' values typically include empty strings, the boolean value false etc.
 	  *
@@ -68,6 +249,31 @@ public:
 	/** Exit the current context. */
 	virtual void pop() = 0;
 
+	/** Looks up the value for @p key once and classifies it for rendering a section.
+	  *
+	  * The renderer uses this rather than calling listCount(), canEval() and isFalse()
+	  * in turn for each section tag. The default implementation calls those functions,
+	  * so contexts which only implement them continue to work.
+	  */
+	virtual ResolvedValue resolve(const QString& key) const;
+
+	/** Set the current context to a @p value returned by resolve().
+	  * If index is >= 0, set the current context to the @p index'th value
+	  * in the list.
+	  *
+	  * The default implementation calls push() with the resolved key.
+	  */
+	virtual void pushResolved(const ResolvedValue& value, int index = -1);
+
+	/** Set the current context to the @p index'th item of a List @p value
+	  * returned by resolve() with a count of -1, whose items are produced
+	  * one at a time. The renderer calls this with an index of 0, 1, 2 and so on.
+	  * Returns false, leaving the context unchanged, once there are no more items.
+	  *
+	  * The default implementation returns false.
+	  */
+	virtual bool pushNextItem(const ResolvedValue& value, int index);
+
 	/** Returns the partial template for a given @p key. */
 	QString partialValue(const QString& key) const;
 
@@ -92,11 +298,33 @@ public:
 	 */
 	virtual QString eval(const QString& key, const QString& _template, Renderer* renderer);
 
+	/** Callback used to render a template section with the given @p key, if canEval()
+	 * returns true for it. Unlike eval(), this receives the already parsed @p section,
+	 * which can be rendered without parsing its text again.
+	 *
+	 * The default implementation calls eval() with the text of the section.
+	 */
+	virtual QString evalSection(const QString& key, const TemplateSection& section);
+
 private:
 	PartialResolver* m_partialResolver;
 };
 
-/** A context implementation which wraps a QVariantHash or QVariantMap. */
+/** A context implementation which wraps a QVariantHash or QVariantMap.
+ *
+ * Values in the data may be a LazyValue, which is computed when it is read,
+ * and lists may be a LazySequence, whose items are produced as they are rendered.
+ *
+ * QtVariantContext classifies the value of a section tag which is in the data
+ * with a single lookup in resolve(), without calling listCount(), canEval() or
+ * isFalse().  For keys which are not in the data, it calls them as Context does.
+ * Subclasses which override those functions to change how sections are rendered
+ * for keys in the data should also override resolve(), eg. to return
+ * Context::resolve() for the keys which they handle and QtVariantContext::resolve()
+ * for the others.  Likewise, value tags for keys in the data use variantValue()
+ * rather than stringValue(), so subclasses which override stringValue() for
+ * such keys should override variantValue() as well.
+ */
 class QtVariantContext : public Context
 {
 public:
@@ -105,23 +333,72 @@ public:
 	 */
 #if __cplusplus >= 201103L
 	typedef std::function<QString(const QString&, Mustache::Renderer*, Mustache::Context*)> fn_t;
+	typedef std::function<QString(const Mustache::TemplateSection&, Mustache::Context*)> section_fn_t;
 #else
 	typedef QString (*fn_t)(const QString&, Mustache::Renderer*, Mustache::Context*);
+	typedef QString (*section_fn_t)(const Mustache::TemplateSection&, Mustache::Context*);
 #endif
 	explicit QtVariantContext(const QVariant& root, PartialResolver* resolver = 0);
 
+	/** Replaces the data with @p root and clears the context stack, as if the
+	 * context had been constructed again with the same partial resolver.
+	 * The memory used by the stack is kept, so a context can be reused for
+	 * many renders, eg. one per request in a worker thread, without allocating
+	 * it again.
+	 */
+	void reset(const QVariant& root);
+
+	/** Returns the approximate number of bytes of memory used by the context
+	 * stack and the lookups and key paths cached in it, not counting the data itself.
+	 */
+	qint64 memoryUsage() const;
+
 	virtual QString stringValue(const QString& key) const;
+	virtual QVariant variantValue(const QString& key) const;
 	virtual bool isFalse(const QString& key) const;
 	virtual int listCount(const QString& key) const;
 	virtual void push(const QString& key, int index = -1);
 	virtual void pop();
+	virtual ResolvedValue resolve(const QString& key) const;
+	virtual void pushResolved(const ResolvedValue& value, int index = -1);
+	virtual bool pushNextItem(const ResolvedValue& value, int index);
 	virtual bool canEval(const QString& key) const;
 	virtual QString eval(const QString& key, const QString& _template, Mustache::Renderer* renderer);
+	virtual QString evalSection(const QString& key, const TemplateSection& section);
 
 private:
+	/** An entry in the context stack.
+	 *
+	 * Frames refer to values in the root data rather than copying them, so
+	 * entering a section does not copy or allocate. Values which are not
+	 * part of the root data, such as items converted from a QStringList,
+	 * are owned by the frame.
+	 */
+	struct Frame
+	{
+		Frame()
+			: value(0)
+		{}
+
+		const QVariant& get() const;
+		void set(const QVariant* item, const QVariant& copy);
+
+		const QVariant* value;
+		QVariant owned;
+		/// Results of looking up keys in this frame and the frames below it.
+		/// These stay valid for as long as the frame is on the stack, since
+		/// frames are only ever pushed on top of it.
+		mutable QHash<QString, const QVariant*> lookupCache;
+	};
+
+	const QVariant* find(const QString& key, QVariant* converted) const;
+	const QVariant* findInFrame(const QVariant& frame, const QString& key, QVariant* converted) const;
 	QVariant value(const QString& key) const;
 
-	QStack<QVariant> m_contextStack;
+	QVarLengthArray<Frame, 16> m_contextStack;
+	/// The parts of the dotted keys which have been looked up, so that each
+	/// key is split only once rather than on every lookup.
+	mutable QHash<QString, QStringList> m_keyPaths;
 };
 
 /** Interface for fetching template partials. */
@@ -150,7 +427,8 @@ private:
 /** A partial fetcher when loads templates from '<name>.mustache' files
  * in a given directory.
  *
- * Once a partial has been loaded, it is cached for future use.
+ * Once a partial has been loaded, it is cached for future use, within the
+ * limit set by setMaxMemory().
  */
 class PartialFileLoader : public PartialResolver
 {
@@ -159,9 +437,134 @@ public:
 
 	virtual QString getPartial(const QString& name);
 
+	/** Sets the maximum number of bytes used by the loaded partials. When the
+	 * limit is reached, the least recently used partials are discarded and are
+	 * loaded again if they are needed. By default there is no limit.
+	 */
+	void setMaxMemory(int bytes);
+	int maxMemory() const;
+
+	/** Returns the approximate number of bytes used by the loaded partials. */
+	qint64 memoryUsage() const;
+
+private:
+	QString m_basePath;
+	mutable QMutex m_mutex;
+	QCache<QString, QString> m_cache;
+};
+
+/** A partial fetcher which loads templates from '<name>.mustache' files
+ * in a given directory by memory-mapping them instead of reading them.
+ *
+ * Files which are stored as UTF-16 in the native byte order, starting
+ * with a byte order mark, are used in place: the returned string refers to
+ * the mapped file, so the pages of the file are shared with any other process
+ * which maps it and are only read when the template is first compiled.
+ * Other files are decoded from the mapping as UTF-8.
+ *
+ * The mapped files stay mapped until the loader is destroyed, so it must
+ * outlive any renderer or template which uses its partials, and the files
+ * must not be modified while they are mapped; replace them instead.
+ */
+class MappedFileLoader : public PartialResolver
+{
+public:
+	explicit MappedFileLoader(const QString& basePath);
+	virtual ~MappedFileLoader();
+
+	virtual QString getPartial(const QString& name);
+
+	/** Returns the approximate number of bytes of memory used by the partials
+	 * which were decoded. Partials which are used in place are not counted.
+	 */
+	qint64 memoryUsage() const;
+
 private:
 	QString m_basePath;
+	mutable QMutex m_mutex;
 	QHash<QString, QString> m_cache;
+	QList<QFile*> m_mappedFiles;
+};
+
+/** Receives the output of a template as it is rendered.
+ *
+ * See Renderer::render(const Template&, Context*, OutputSink*).
+ */
+class OutputSink
+{
+public:
+	virtual ~OutputSink() {}
+
+	/** Writes the next part of the output. Returns false if the output could not
+	 * be written, which stops rendering with an error.
+	 */
+	virtual bool write(const QString& text) = 0;
+};
+
+/** An output sink which writes the output as UTF-8 to a QIODevice, eg. a socket. */
+class IODeviceSink : public OutputSink
+{
+public:
+	explicit IODeviceSink(QIODevice* device);
+
+	virtual bool write(const QString& text);
+
+private:
+	QIODevice* m_device;
+};
+
+/** A cache of the rendered output of sections and partials, which can be shared
+ * between renderers and threads.
+ *
+ * Sections and partials are cached if their tag has a cache annotation, eg.
+ * {{#navigation|cache:user.name,language}}...{{/navigation}} or {{>footer|cache}},
+ * or if they were marked with Template::setCacheable(). The output is reused for
+ * as long as the values of the listed keys are the same, so the keys must
+ * include everything which the output depends on. Output which was escaped
+ * with different escapers is stored separately.
+ *
+ * When the cache is full, the least recently used output is discarded.
+ */
+class FragmentCache
+{
+public:
+	/** Creates a cache which holds up to @p maxSize characters of output. */
+	explicit FragmentCache(int maxSize = 1024 * 1024);
+
+	/** Looks up the output stored for @p key. Returns true and sets @p output
+	 * if it is found.
+	 */
+	bool find(const QString& key, QString* output);
+
+	/** Stores the @p output for @p key. */
+	void insert(const QString& key, const QString& output);
+
+	/** Removes all of the stored output. The hit and miss counts are not reset. */
+	void clear();
+
+	/** Sets the maximum number of characters of output which are stored. */
+	void setMaxSize(int maxSize);
+	int maxSize() const;
+
+	/** Returns the number of characters of output which are stored. */
+	int size() const;
+
+	/** Returns the number of lookups which found output in the cache. */
+	int hits() const;
+
+	/** Returns the number of lookups which did not find output in the cache. */
+	int misses() const;
+
+	/** Returns the approximate number of bytes of memory used by the stored output. */
+	qint64 memoryUsage() const;
+
+private:
+	Q_DISABLE_COPY(FragmentCache)
+
+	mutable QMutex m_mutex;
+	QCache<QString, QString> m_cache;
+	int m_hits;
+	int m_misses;
 };
 
 /** Holds properties of a tag in a mustache template. */
@@ -192,6 +595,9 @@ struct Tag
 		, end(0)
 		, escapeMode(Escape)
 		, indentation(0)
+		, precision(-1)
+		, grouping(false)
+		, cacheable(false)
 	{}
 
 	Type type;
@@ -200,6 +606,305 @@ struct Tag
 	int end;
 	EscapeMode escapeMode;
 	int indentation;
+	/// For value tags with a format, eg. {{key|,.2}}, the number of decimals
+	/// to show or -1, and whether to separate thousands with commas.
+	int precision;
+	bool grouping;
+	/// For section and partial tags with a cache annotation, eg. {{#nav|cache:user}},
+	/// the keys whose values the cached output depends on.
+	bool cacheable;
+	QStringList cacheKeys;
+};
+
+/** Holds one element of a compiled template. */
+struct Node
+{
+	enum Type
+	{
+		Text, /// Literal text from the template source
+		Value, /// A {{key}} or {{{key}}} tag
+		Section, /// A {{#section}}...{{/section}} block
+		InvertedSection, /// An {{^inverted-section}}...{{/inverted-section}} block
+		Partial /// A {{>partial}} tag
+	};
+
+	Node()
+		: type(Text)
+		, pos(0)
+		, start(0)
+		, end(0)
+		, escapeMode(Tag::Escape)
+		, indentation(0)
+		, precision(-1)
+		, grouping(false)
+		, cacheable(false)
+		, next(0)
+	{}
+
+	Type type;
+	QString key;
+	/// Position of the tag in the template source
+	int pos;
+	/// For Text nodes, the range of the text in the template source.
+	/// For sections, the range of the unrendered section body.
+	/// For inlined partials, the range of the partial's source including
+	/// its indentation.
+	int start;
+	int end;
+	Tag::EscapeMode escapeMode;
+	int indentation;
+	/// For Value nodes, the number format. See Tag::precision and Tag::grouping.
+	int precision;
+	bool grouping;
+	/// For sections and partials, whether the output may be reused from a
+	/// FragmentCache and the keys which it depends on. See Tag::cacheable.
+	bool cacheable;
+	QStringList cacheKeys;
+	/// For sections, the index of the first node after the section's body.
+	/// For partials which were inlined by Renderer::compile(), the nodes of the
+	/// partial follow the partial node and this is the index of the node after
+	/// them. For other partials, it is 0.
+	int next;
+};
+
+/** A template which has been parsed by Renderer::compile().
+ *
+ * A compiled template can be rendered any number of times without parsing
+ * the template source again. It can also be saved with toBinary() and
+ * loaded again with fromBinary() or mapBinary(), so that templates can be
+ * compiled at build time and loaded quickly on startup.
+ *
+ * Template is implicitly shared, so copying it is cheap.
+ */
+class Template
+{
+public:
+	Template();
+	Template(const Template& other);
+	Template& operator=(const Template& other);
+	~Template();
+
+	/** Returns the source text which the template was compiled from. */
+	QString source() const;
+
+	/** Returns the nodes of the compiled template.
+	 * The body of a section starts immediately after the section's node and
+	 * ends at the node given by Node::next.
+	 */
+	const QVector<Node>& nodes() const;
+
+	/** Returns the names of the partials which are included by the template,
+	 * without those included by the partials themselves.
+	 * See Renderer::warmUpPartials() for the partials included transitively.
+	 */
+	QStringList partialNames() const;
+
+	/** Returns the names of the partials which were inlined into the template
+	 * by Renderer::compile(const QString&, PartialResolver*).
+	 */
+	QStringList inlinedPartials() const;
+
+	/** Returns true if the content of any of the inlined partials, as returned by
+	 * @p partials, is different from when they were inlined.
+	 */
+	bool partialsChanged(PartialResolver* partials) const;
+
+	/** Returns a message describing the error encountered when compiling
+	 * the template or an empty string if the template compiled successfully.
+	 */
+	QString error() const;
+
+	/** Returns the position in the source of the error encountered when
+	 * compiling the template or -1 if no error occurred.
+	 */
+	int errorPos() const;
+
+	/** Marks the sections and partials named @p key as cacheable, as if their
+	 * tags had a cache annotation. When the template is rendered by a Renderer
+	 * with a FragmentCache, their output is stored in the cache and reused
+	 * for as long as the values of the @p dependencies keys are the same, and
+	 * for sections, the value of @p key itself. See FragmentCache.
+	 */
+	void setCacheable(const QString& key, const QStringList& dependencies = QStringList());
+
+	/** Sets the escaper for values when the template is rendered, including in
+	 * its partials, instead of the renderer's escaper. The escaper is not owned
+	 * by the template and is not saved by toBinary().
+	 */
+	void setEscaper(const Escaper* escaper);
+
+	/** Returns the escaper set with setEscaper(), or 0 if there is none. */
+	const Escaper* escaper() const;
+
+	/** Returns the approximate number of bytes of memory used by the template.
+	 * The source and keys of templates which are loaded from binary data refer to
+	 * that data, so they are not counted.
+	 */
+	qint64 memoryUsage() const;
+
+	/** Serializes the template into a versioned, checksummed binary form.
+	 * Returns an empty array if the template failed to compile.
+	 *
+	 * The data is only intended to be loaded on a machine with the same
+	 * byte order.
+	 */
+	QByteArray toBinary() const;
+
+	/** How much of the data is checked when a template is loaded by fromBinary()
+	 * or mapBinary().
+	 */
+	enum BinaryCheck
+	{
+		VerifyChecksum, /// Verify the checksum, which reads all of the data
+		SkipChecksum /// Only check the header, eg. for data which was verified when it was installed
+	};
+
+	/** Loads a template from data produced by toBinary().
+	 *
+	 * The template source and keys are not copied out of @p data.  If @p data
+	 * was created with QByteArray::fromRawData(), it must remain valid for as long
+	 * as the template (or any copy of it) is in use.
+	 *
+	 * Loading only checks the header and, unless @p check is SkipChecksum, the
+	 * checksum.  The nodes are read from the data the first time the template is
+	 * used.  If they are not valid, which can only happen if the checksum was
+	 * skipped, the template then reports an error.
+	 *
+	 * Returns an empty template if @p data is not a valid compiled template.
+	 */
+	static Template fromBinary(const QByteArray& data, BinaryCheck check = VerifyChecksum);
+
+	/** Loads a template from a file containing data produced by toBinary().
+	 * The file is memory-mapped and the template source and keys are used in
+	 * place, so those pages are shared between processes which load the same
+	 * file rather than copied into each of them. With SkipChecksum, loading only
+	 * reads the header, so the time taken does not depend on the size of the
+	 * template, and the rest of the file is not read until the template is used.
+	 */
+	static Template mapBinary(const QString& fileName, BinaryCheck check = VerifyChecksum);
+
+private:
+	friend class Renderer;
+	friend class SegmentedOutput;
+	friend class SharedTemplateStore;
+
+	explicit Template(const QSharedDataPointer<TemplateData>& data);
+
+	QSharedDataPointer<TemplateData> d;
+};
+
+/** The body of a section which is rendered by a lambda.
+ *
+ * Lambdas which are stored in a QtVariantContext as a QtVariantContext::section_fn_t
+ * receive a TemplateSection rather than the text of the section, so that they can
+ * render the body without parsing it again.
+ */
+class TemplateSection
+{
+public:
+	/** Constructs a section which covers all of @p _template. */
+	TemplateSection(const Template& _template, Renderer* renderer);
+
+	/** Returns the unrendered text of the section. */
+	QString text() const;
+
+	/** Renders the section using @p context. The section is rendered with the tag
+	 * markers which were in effect where it appears in the template.
+	 */
+	QString render(Context* context) const;
+
+	/** Returns the renderer which is rendering the template containing the section. */
+	Renderer* renderer() const;
+
+private:
+	friend class Renderer;
+
+	TemplateSection(const Template& _template, int begin, int end, int textStart, int textEnd, Renderer* renderer);
+
+	Template m_template;
+	int m_begin;
+	int m_end;
+	int m_textStart;
+	int m_textEnd;
+	Renderer* m_renderer;
+};
+
+/** The output of a template as a list of segments, which refer to the text of
+ * the compiled template and its partials rather than copying it.
+ *
+ * Only the values which are substituted into the template are copied, into a
+ * buffer owned by the output. Segments can be written out individually, eg.
+ * with vectored I/O, or joined into a single string.
+ *
+ * See Renderer::render(const Template&, Context*, SegmentedOutput*).
+ */
+class SegmentedOutput
+{
+public:
+	SegmentedOutput();
+
+	/** Returns the number of segments. */
+	int count() const;
+
+	/** Returns the segment at @p index. It remains valid for as long as the
+	 * output is not modified or destroyed.
+	 */
+	QStringView segment(int index) const;
+
+	/** Returns the total length of the segments. */
+	int length() const;
+
+	/** Returns the segments joined into a single string. */
+	QString join() const;
+
+	/** Writes the segments to @p device as UTF-8 with a single write.
+	 * Returns false if not all of the output could be written.
+	 */
+	bool writeTo(QIODevice* device) const;
+
+	/** Removes all of the segments. */
+	void clear();
+
+private:
+	friend class Renderer;
+
+	/// A range of the text of a template, or of the buffer if 'text' is 0.
+	struct Segment
+	{
+		const QChar* text;
+		int offset;
+		int length;
+	};
+
+	void appendBuffered(const QString& buffer);
+	void appendText(const TemplateData* data, const QChar* text, int length);
+
+	QVector<Segment> m_segments;
+	QString m_buffer;
+	int m_bufferedLength;
+	int m_length;
+	// The templates whose text the segments refer to, which are kept alive
+	// for as long as the segments.
+	QVector<Template> m_templates;
+	const TemplateData* m_lastTemplate;
+};
+
+/** Checks the output of a template against an independent rendering of it.
+ *
+ * See Renderer::setVerifier().
+ */
+class Verifier
+{
+public:
+	virtual ~Verifier() {}
+
+	/** Checks @p output, which @p renderer produced by rendering @p _template with
+	 * @p context. Returns an empty string if the output is correct. Otherwise
+	 * returns a description of the problem, sets @p pos to the position of the tag
+	 * which is at fault and sets @p partial to the partial which contains it, if any.
+	 */
+	virtual QString verify(const Template& _template, Context* context, const QString& output, Renderer* renderer,
+	                       int* pos, QString* partial) = 0;
 };
 
 /** Renders Mustache templates, replacing mustache tags with
@@ -210,11 +915,73 @@ class Renderer
 public:
 	Renderer();
 
+	/** Returns a renderer which belongs to the calling thread, creating it on
+	  * the first call. The renderer is reused by later calls in the same thread
+	  * and is deleted when the thread exits, so worker threads can render
+	  * without constructing a renderer for each template. Settings made on the
+	  * renderer, such as limits and delimiters, remain for later callers.
+	  */
+	static Renderer* threadLocal();
+
 	/** Render a Mustache template, using @p context to fetch
 	  * the values used to replace Mustache tags.
+	  *
+	  * If the template has a syntax error, the output before the tag which has
+	  * the error is returned and errorPos() reports the error.
 	  */
 	QString render(const QString& _template, Context* context);
 
+	/** Render a template compiled with compile(), using @p context to fetch
+	  * the values used to replace Mustache tags.
+	  */
+	QString render(const Template& _template, Context* context);
+
+	/** Render a section of a template using @p context. This is intended to be
+	  * called by lambdas and, unlike the other render() functions, it does not
+	  * reset the error state of the renderer.
+	  */
+	QString render(const TemplateSection& section, Context* context);
+
+	/** Render a template compiled with compile(), writing the output to @p sink
+	  * while it is rendered rather than returning it once it is complete.
+	  *
+	  * The output is written whenever at least flushThreshold() characters are
+	  * pending, so the memory used for output does not grow with the size of the
+	  * document. Anything which remains is written when rendering finishes or stops
+	  * because of an error.
+	  */
+	void render(const Template& _template, Context* context, OutputSink* sink);
+
+	/** Render a template compiled with compile() into a list of segments, so that
+	  * the text of the template is not copied into the output. @p output is
+	  * cleared first.
+	  */
+	void render(const Template& _template, Context* context, SegmentedOutput* output);
+
+	/** Parse a Mustache template so that it can be rendered repeatedly
+	  * without parsing the source each time.
+	  *
+	  * If the template cannot be parsed, Template::error() and Template::errorPos()
+	  * describe the problem and they are also reported by error() and errorPos().
+	  */
+	Template compile(const QString& _template);
+
+	/** Parse a Mustache template like compile(const QString&) and inline the
+	  * partials which it includes, loaded from @p partials, so that rendering
+	  * them does not have to load them or switch to another template.
+	  *
+	  * Partials which include themselves, directly or through other partials,
+	  * partials which fail to compile and cacheable partials are left to be
+	  * loaded when the template is rendered, as are any partials beyond a limit
+	  * on the size of the inlined template. Inlined partials still count
+	  * towards setMaxPartials() and setMaxDepth().
+	  *
+	  * The inlined partials are not loaded again when they change, so use
+	  * Template::partialsChanged() to find out whether the template needs to
+	  * be compiled again.
+	  */
+	Template compile(const QString& _template, PartialResolver* partials);
+
 	/** Returns a message describing the last error encountered by the previous
 	  * render() call.
 	  */
@@ -238,11 +1005,210 @@ public:
 	  */
 	void setTagMarkers(const QString& startMarker, const QString& endMarker);
 
+	/** Sets the escaper for values written by {{key}} tags in templates which do
+	  * not have their own, see Template::setEscaper(). The escaper is not owned
+	  * by the renderer. The default is Escaper::html().
+	  */
+	void setEscaper(const Escaper* escaper);
+	const Escaper* escaper() const;
+
+	/** Loads and compiles the partials which are included by @p _template, and
+	  * those which they include in turn, so that rendering the template later
+	  * does not have to load or compile them.
+	  *
+	  * The partials at each level of nesting are loaded and compiled in parallel
+	  * using @p pool, or QThreadPool::globalInstance() if it is null, so
+	  * @p resolver must be safe to call from several threads at once, as
+	  * PartialMap and PartialFileLoader are. The compiled partials are kept by
+	  * this renderer, whereas a resolver such as PartialFileLoader keeps the
+	  * partials it loaded for any renderer which uses it.
+	  *
+	  * Returns the names of all of the partials which were found.
+	  */
+	QStringList warmUpPartials(const Template& _template, PartialResolver* resolver, QThreadPool* pool = 0);
+
+	/** Sets the cache used for sections and partials which are marked as cacheable.
+	  * The cache is not owned by the renderer. If no cache is set, the default,
+	  * cacheable sections and partials are rendered like any others.
+	  */
+	void setFragmentCache(FragmentCache* cache);
+
+	/** Returns the cache set with setFragmentCache(). */
+	FragmentCache* fragmentCache() const;
+
+	/** Returns the approximate number of bytes of memory used by the partials
+	  * which this renderer has compiled and kept for later renders.
+	  */
+	qint64 memoryUsage() const;
+
+	/** Returns the largest number of bytes which the output buffer and the stack
+	  * of sections and partials have used during a single render() call.
+	  */
+	qint64 peakScratchMemory() const;
+
+	/** Sets the maximum depth of nested sections and partials.
+	  * Rendering stops with an error if a template nests deeper than this,
+	  * for example because of a recursive partial. The default is 1000.
+	  * A depth of 0 or less disables the limit.
+	  */
+	void setMaxDepth(int depth);
+
+	/** Sets the number of characters of output which are collected before they are
+	  * written to the sink passed to render(). The default is 16384.
+	  */
+	void setFlushThreshold(int length);
+	int flushThreshold() const;
+
+	/** Sets whether output is also written to the sink after each item of a list
+	  * section, so that each item reaches the sink as soon as it is rendered.
+	  * The default is false.
+	  */
+	void setFlushAtListItems(bool flush);
+	bool flushAtListItems() const;
+
+	/** Returns the maximum depth of nested sections and partials. */
+	int maxDepth() const;
+
+	/** Sets the maximum length of the output of a render() call, in characters.
+	  * Rendering stops with an error once the output grows beyond this length.
+	  * A length of 0 or less, the default, disables the limit.
+	  */
+	void setMaxOutputLength(int length);
+
+	/** Returns the maximum length of the output of a render() call. */
+	int maxOutputLength() const;
+
+	/** Sets the maximum number of partials which may be included by a render() call.
+	  * A count of 0 or less, the default, disables the limit.
+	  */
+	void setMaxPartials(int count);
+
+	/** Returns the maximum number of partials included by a render() call. */
+	int maxPartials() const;
+
+	/** Sets the maximum number of list items which may be rendered by a render() call,
+	  * counting the items of all list sections.
+	  * A count of 0 or less, the default, disables the limit.
+	  */
+	void setMaxIterations(int count);
+
+	/** Returns the maximum number of list items rendered by a render() call. */
+	int maxIterations() const;
+
+	/** Sets a deadline after which rendering stops with an error.
+	  * The deadline is checked periodically whilst rendering, so a render() call
+	  * may run for a short time after it expires. The default is QDeadlineTimer::Forever.
+	  */
+	void setDeadline(const QDeadlineTimer& deadline);
+
+	/** Returns the deadline set with setDeadline(). */
+	QDeadlineTimer deadline() const;
+
+	/** Sets a flag which another thread can set to a non-zero value to stop
+	  * rendering with an error. The flag is checked at the same times as the deadline.
+	  * @p token must remain valid whilst templates are rendered, or be reset to 0.
+	  */
+	void setCancellationToken(const QAtomicInt* token);
+
+	/** Sets a verifier which checks the output of each render(const Template&, Context*)
+	  * call, eg. against a separate reference renderer in tests, or 0 for none.
+	  *
+	  * The verifier is called after the template has rendered without errors. It
+	  * renders as if nested in that render, so templates which it or the lambdas
+	  * it calls render with @p renderer use the same escaper and are not verified
+	  * themselves, and the fragment cache is not used. If it reports a problem,
+	  * render() returns the output as it is and error(), errorPos() and
+	  * errorPartial() describe the problem.
+	  *
+	  * Every template is rendered twice, so this is intended for tests. A verifier
+	  * which renders from the same data reads it twice: lambdas, LazyValue
+	  * functions and LazySequence functions are called again and must give the
+	  * same results each time.
+	  */
+	void setVerifier(Verifier* verifier);
+
+	/** Returns the verifier set with setVerifier(), or 0 if there is none. */
+	Verifier* verifier() const;
+
+	/** Appends the value for @p key to @p output, escaped according to @p escapeMode.
+	  * Numbers are shown with @p precision decimals if it is not -1 and with commas
+	  * between thousands if @p grouping is true.
+	  *
+	  * This and the functions which follow are used by the render functions
+	  * which qt-mustache-codegen generates from templates at build time.
+	  */
+	void renderValue(const QString& key, Tag::EscapeMode escapeMode, Context* context, QString& output,
+	                 int precision = -1, bool grouping = false);
+
+	/** Renders the partial @p name, indented by @p indentation spaces, and appends
+	  * the result to @p output.
+	  *
+	  * Returns false if an error occurred whilst rendering the partial.
+	  */
+	bool renderPartial(const QString& name, int indentation, Context* context, QString& output);
+
+	/** Returns false if rendering must stop, because an error occurred or a limit
+	  * set with setMaxOutputLength(), setDeadline() or setCancellationToken() has
+	  * been reached with @p output, in which case the error is set.
+	  */
+	bool withinLimits(const QString& output);
+
+	/** Checks withinLimits() and the limit set with setMaxDepth() before a section
+	  * or partial which is nested @p depth levels deep is rendered. The sections
+	  * at the top level of a template are at depth 1.
+	  */
+	bool enterSection(int depth, const QString& output);
+
+	/** Checks withinLimits() and the limit set with setMaxIterations() before an
+	  * item of a list section is rendered.
+	  */
+	bool enterListItem(const QString& output);
+
+	/** Passes the body of the section at @p nodeIndex of @p _template, which must
+	  * be a lambda, to Context::evalSection() and returns its output.
+	  */
+	QString evalSection(const QString& key, const Template& _template, int nodeIndex, Context* context);
+
+	/** Clears the error reported by error(), errorPos() and errorPartial().
+	  *
+	  * Unless it is called by a lambda whilst a template is being rendered, this
+	  * also resets the partial and iteration counts used for setMaxPartials() and
+	  * setMaxIterations().
+	  */
+	void clearError();
+
 private:
-	QString render(const QString& _template, int startPos, int endPos, Context* context);
+	struct CompiledPartial
+	{
+		QString content;
+		Template compiled;
+	};
+
+	/// A partial which was inlined by compile(), whose source, including its
+	/// indentation, is appended to the template's source once.
+	struct InlinedPartial
+	{
+		int sourceOffset;
+		Template compiled;
+	};
+
+	void compile(TemplateData* data);
+	void appendInlinedNodes(TemplateData* data, const Template& from, int sourceOffset, PartialResolver* partials,
+	                        QStringList& inlining, QHash<QString, InlinedPartial>& inlined, QVector<Node>& nodes);
+	void render(const Template& _template, int begin, int end, Context* context, QString& output);
+	Template loadPartial(const QString& name, int indentation, Context* context, QString& output);
+	void verifyOutput(const Template& _template, Context* context, const QString& output);
+	void reportTemplateError(const Template& _template);
+
+	bool includePartial(int pos);
+	void storeFragment(const QString& cacheKey, const QString& output, qint64 outputStart);
+	bool withinBudget(const QString& output, int pos);
+	qint64 outputPosition(const QString& output) const;
+	bool readyToFlush(const QString& output, int threshold) const;
+	void flushOutput(QString& output, int pos);
 
 	Tag findTag(const QString& content, int pos, int endPos);
-	Tag findEndTag(const QString& content, const Tag& startTag, int endPos);
+	static int indexOfMarker(const QString& content, const QString& marker, int from);
 	void setError(const QString& error, int pos);
 
 	void readSetDelimiter(const QString& content, int pos, int endPos);
@@ -259,9 +1225,37 @@ private:
 	static void expandTag(Tag& tag, const QString& content);
 
 	QStack<QString> m_partialStack;
+	QHash<QPair<QString, int>, CompiledPartial> m_compiledPartials;
 	QString m_error;
 	int m_errorPos;
 	QString m_errorPartial;
+	int m_maxDepth;
+	int m_maxOutputLength;
+	int m_maxPartials;
+	int m_maxIterations;
+	QDeadlineTimer m_deadline;
+	const QAtomicInt* m_cancellationToken;
+	FragmentCache* m_fragmentCache;
+	const Escaper* m_escaper;
+	int m_flushThreshold;
+	bool m_flushAtListItems;
+	Verifier* m_verifier;
+
+	// Budget usage of the render() call in progress
+	int m_renderNesting;
+	int m_partialCount;
+	int m_iterationCount;
+	qint64 m_peakScratchMemory;
+	int m_budgetCheckCountdown;
+	const Escaper* m_activeEscaper;
+
+	// The sink or segmented output which output is written to by the render()
+	// call in progress, the nesting level of that call and the length of the
+	// output which was written there rather than to the output string.
+	OutputSink* m_sink;
+	SegmentedOutput* m_segments;
+	int m_sinkNesting;
+	qint64 m_flushedLength;
 
 	QString m_tagStartMarker;
 	QString m_tagEndMarker;
@@ -270,9 +1264,139 @@ private:
 	QString m_defaultTagEndMarker;
 };
 
+/** An immutable set of compiled templates, published by TemplateRegistry.
+ *
+ * A snapshot is also a partial resolver for the templates which it holds, so a
+ * render which uses it for its main template and its partials never mixes
+ * templates from different versions. Copies of a snapshot share the same data,
+ * which is released when the last copy is destroyed.
+ */
+class TemplateSnapshot : public PartialResolver
+{
+public:
+	/** Creates an empty snapshot with a version of 0. */
+	TemplateSnapshot();
+	TemplateSnapshot(const TemplateSnapshot& other);
+	TemplateSnapshot& operator=(const TemplateSnapshot& other);
+	virtual ~TemplateSnapshot();
+
+	/** Returns the version of the snapshot, which TemplateRegistry::publish()
+	 * increases each time it publishes a new one.
+	 */
+	int version() const;
+
+	/** Returns the names of the templates in the snapshot. */
+	QStringList names() const;
+
+	/** Returns true if the snapshot has a template called @p name. */
+	bool contains(const QString& name) const;
+
+	/** Returns the compiled template called @p name, or an empty template if
+	 * there is none. Partials which the template includes are inlined from the
+	 * same snapshot.
+	 */
+	Template value(const QString& name) const;
+
+	/** Returns the source of the template called @p name. */
+	virtual QString getPartial(const QString& name);
+
+private:
+	friend class TemplateRegistry;
+
+	QSharedDataPointer<TemplateSnapshotData> d;
+};
+
+/** Holds the current version of a set of templates and replaces it with a
+ * new version while other threads render with it.
+ *
+ * Each render should take a snapshot() once and use it for the main template
+ * and its partials. Renders which are in progress when publish() replaces the
+ * snapshot finish with the version they started with, and the old templates are
+ * freed when the last of them finishes.
+ */
+class TemplateRegistry
+{
+public:
+	TemplateRegistry();
+
+	/** Returns the current snapshot. This is safe to call from any thread. */
+	TemplateSnapshot snapshot() const;
+
+	/** Compiles @p templates, a map of names to template sources, which may
+	 * include each other as partials, and makes them the current snapshot.
+	 *
+	 * If any of the templates fails to compile, the current snapshot is kept,
+	 * @p error is set to the name of the template and the error, and false is
+	 * returned.
+	 */
+	bool publish(const QHash<QString, QString>& templates, QString* error = 0);
+
+private:
+	Q_DISABLE_COPY(TemplateRegistry)
+
+	mutable QMutex m_mutex;
+	TemplateSnapshot m_current;
+};
+
+/** Compiled templates which are kept in a shared memory segment, so that
+ * several processes can render them without each one compiling and storing
+ * its own copy.
+ *
+ * One process compiles the templates and calls create(), and the others call
+ * attach() with the same key. The segment holds the templates in the format
+ * of Template::toBinary(), which refers to its contents by offsets, and the
+ * templates returned by value() are rendered directly from it. The segment
+ * stays attached until the store and every template from it are destroyed.
+ *
+ * Attaching only reads the directory of the segment. The template sources and
+ * keys are used in place, but the table of nodes is not: each process decodes
+ * the nodes of a template into its own memory the first time it uses the
+ * template, as Template::fromBinary() does with SkipChecksum.
+ */
+class SharedTemplateStore
+{
+public:
+	/** Creates a store for the shared memory segment identified by @p key. */
+	explicit SharedTemplateStore(const QString& key);
+	~SharedTemplateStore();
+
+	/** Creates the segment and stores @p templates in it. Returns false and
+	 * sets error() if a template has an error or the segment cannot be created,
+	 * eg. because it already exists.
+	 */
+	bool create(const QHash<QString, Template>& templates);
+
+	/** Attaches to a segment which another process created. Returns false and
+	 * sets error() if there is no such segment or it has not been filled in yet.
+	 */
+	bool attach();
+
+	/** Returns the names of the templates in the store. */
+	QStringList names() const;
+
+	/** Returns the template called @p name, or an empty template if there is none. */
+	Template value(const QString& name) const;
+
+	/** Returns a description of the error if create() or attach() failed. */
+	QString error() const;
+
+private:
+	Q_DISABLE_COPY(SharedTemplateStore)
+
+	bool readTemplates();
+
+	QSharedPointer<QSharedMemory> m_memory;
+	QHash<QString, Template> m_templates;
+	QString m_error;
+};
+
 /** A convenience function which renders a template using the given data. */
 QString renderTemplate(const QString& templateString, const QVariantHash& args);
 
 }
 
+Q_DECLARE_METATYPE(Mustache::SafeString)
+Q_DECLARE_METATYPE(Mustache::LazyValue)
+Q_DECLARE_METATYPE(Mustache::LazySequence)
 Q_DECLARE_METATYPE(Mustache::QtVariantContext::fn_t)
+Q_DECLARE_METATYPE(Mustache::QtVariantContext::section_fn_t)
@@ -0,0 +1,74 @@
+/*
+  Copyright 2012, Robert Knight
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+*/
+
+#pragma once
+
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QString>
+#include <QtTest/QtTest>
+
+#if QT_VERSION >= 0x050000
+    #include <QJsonArray>
+    #include <QJsonDocument>
+    #include <QJsonObject>
+#endif // QT_VERSION >= 0x050000
+
+// To be able to use QHash<QString, QString> in QFETCH(..).
+typedef QHash<QString, QString> PartialsHash;
+Q_DECLARE_METATYPE(PartialsHash)
+
+#if QT_VERSION >= 0x050000 // JSON classes only in Qt 5+.
+
+/** Adds the columns "name", "data", "template_", "partials" and "expected" to
+ * the current test data, and a row for each test case in the spec files in the
+ * current directory.
+ */
+inline void addSpecTestRows()
+{
+	QTest::addColumn<QString>("name");
+	QTest::addColumn<QVariantMap>("data");
+	QTest::addColumn<QString>("template_");
+	QTest::addColumn<PartialsHash>("partials");
+	QTest::addColumn<QString>("expected");
+
+	QDir specsDir = QDir(".");
+
+	foreach (const QString &fileName, specsDir.entryList(QStringList() << "*.json")) {
+		QFile file(specsDir.filePath(fileName));
+		QVERIFY2(file.open(QIODevice::ReadOnly), qPrintable(fileName + ": " + file.errorString()));
+
+		QJsonDocument document = QJsonDocument::fromJson(file.readAll());
+		QJsonArray testCaseValues = document.object()["tests"].toArray();
+
+		for (const QJsonValue &testCaseValue: testCaseValues) {
+			QJsonObject testCaseObject = testCaseValue.toObject();
+
+			QString name = fileName + " - " + testCaseObject["name"].toString();
+			QVariantMap data = testCaseObject["data"].toObject().toVariantMap();
+			QString template_ = testCaseObject["template"].toString();
+			QJsonObject partialsObject = testCaseObject["partials"].toObject();
+			PartialsHash partials;
+			foreach (const QString &partialName, partialsObject.keys()) {
+				partials.insert(partialName, partialsObject[partialName].toString());
+			}
+			QString expected = testCaseObject["expected"].toString();
+
+			QTest::newRow(qPrintable(name)) << name << data << template_ << partials << expected;
+		}
+	}
+}
+
+#endif // QT_VERSION >= 0x050000
@@ -0,0 +1,115 @@
+/*
+  Copyright 2012, Robert Knight
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+*/
+
+#include "test_codegen.h"
+#include "spec_tests.h"
+
+// Generated by qt_mustache_add_templates() from the spec files.
+#include "spec_templates.h"
+
+#include <QString>
+
+void TestCodegen::testSpecs_data()
+{
+	addSpecTestRows();
+}
+
+/*
+ * Checks that the render function which qt-mustache-codegen generated for each
+ * spec test case produces the same output as Renderer::render().
+ */
+void TestCodegen::testSpecs()
+{
+	QFETCH(QString, name);
+	QFETCH(QVariantMap, data);
+	QFETCH(QString, template_);
+	QFETCH(PartialsHash, partials);
+	QFETCH(QString, expected);
+
+	SpecTemplates::RenderFunction render = SpecTemplates::templates().value(name);
+	QVERIFY2(render, qPrintable("No generated function for " + name));
+
+	Mustache::Renderer renderer;
+	Mustache::PartialMap partialsMap(partials);
+	Mustache::QtVariantContext context(data, &partialsMap);
+
+	QString output = renderer.render(template_, &context);
+	QString generatedOutput = render(&renderer, &context);
+
+	QCOMPARE(generatedOutput, output);
+	QCOMPARE(generatedOutput, expected);
+}
+
+/** Renders the spec test case @p name with both the generated function and
+ * Renderer::render() and checks that they produce the same output and error.
+ */
+void compareWithRenderer(const QString& name, Mustache::Renderer* renderer, Mustache::Context* context,
+                         const QString& expected, const QString& expectedError)
+{
+	SpecTemplates::RenderFunction render = SpecTemplates::templates().value(name);
+	QVERIFY2(render, qPrintable("No generated function for " + name));
+
+	QString generatedOutput = render(renderer, context);
+	QString generatedError = renderer->error();
+	QCOMPARE(generatedOutput, expected);
+	QCOMPARE(generatedError, expectedError);
+}
+
+void TestCodegen::testLimits()
+{
+	QVariantList list;
+	for (int i = 1; i <= 3; i++) {
+		QVariantMap item;
+		item["item"] = i;
+		list << item;
+	}
+	QVariantMap data;
+	data["list"] = list;
+	data["bool"] = true;
+	Mustache::QtVariantContext context(data);
+
+	// generated code stops where Renderer::render() does
+	Mustache::Renderer renderer;
+	renderer.setMaxIterations(2);
+	QCOMPARE(renderer.render("\"{{#list}}{{item}}{{/list}}\"", &context), QString("\"12"));
+	compareWithRenderer("sections.json - List", &renderer, &context, "\"12", "Maximum number of iterations exceeded");
+
+	renderer.setMaxIterations(0);
+	renderer.setMaxDepth(1);
+	QCOMPARE(renderer.render("| A {{#bool}}B {{#bool}}C{{/bool}} D{{/bool}} E |", &context), QString("| A B "));
+	compareWithRenderer("sections.json - Nested (Truthy)", &renderer, &context, "| A B ", "Maximum nesting depth exceeded");
+
+	renderer.setMaxDepth(0);
+	renderer.setMaxOutputLength(3);
+	QCOMPARE(renderer.render("\"{{#list}}{{item}}{{/list}}\"", &context), QString("\"123"));
+	compareWithRenderer("sections.json - List", &renderer, &context, "\"123", "Maximum output length exceeded");
+}
+
+void TestCodegen::testSectionLambda()
+{
+	QVariantMap data;
+	data["name"] = "Joe";
+	data["context"] = QVariant::fromValue(Mustache::QtVariantContext::section_fn_t(
+	    [](const Mustache::TemplateSection& section, Mustache::Context* context) {
+		    return "<" + section.render(context) + ">";
+	    }));
+	Mustache::QtVariantContext context(data);
+
+	// lambdas receive the parsed section, as they do from Renderer::render()
+	Mustache::Renderer renderer;
+	QCOMPARE(renderer.render("\"{{#context}}Hi {{name}}.{{/context}}\"", &context), QString("\"<Hi Joe.>\""));
+	compareWithRenderer("sections.json - Context", &renderer, &context, "\"<Hi Joe.>\"", QString());
+}
+
+QTEST_GUILESS_MAIN(TestCodegen)
@@ -13,22 +13,18 @@
 */
 
 #include "test_mustache.h"
+#include "spec_tests.h"
 
+#include <QBuffer>
 #include <QDir>
 #include <QList>
 #include <QFile>
 #include <QHash>
 #include <QString>
+#include <QTemporaryDir>
+#include <QTemporaryFile>
 
-#if QT_VERSION >= 0x050000
-    #include <QJsonDocument>
-    #include <QJsonObject>
-    #include <QJsonArray>
-#endif // QT_VERSION >= 0x050000
-
-// To be able to use QHash<QString, QString> in QFETCH(..).
-typedef QHash<QString, QString> PartialsHash;
-Q_DECLARE_METATYPE(PartialsHash)
+#include <limits>
 
 void TestMustache::testValues()
 {
@@ -81,6 +77,53 @@ QVariantHash contactInfo(const QString& name, const QString& email)
 	return map;
 }
 
+void TestMustache::testNumberFormat()
+{
+	QVariantHash map;
+	map["int"] = 1234567;
+	map["negative"] = -1234;
+	map["zero"] = 0;
+	map["min"] = std::numeric_limits<qlonglong>::min();
+	map["max"] = std::numeric_limits<qulonglong>::max();
+	map["double"] = 1234.5;
+	map["negativeDouble"] = -1234567.5;
+	map["text"] = "abc";
+	map["a|b"] = "pipe";
+
+	Mustache::Renderer renderer;
+	Mustache::QtVariantContext context(map);
+	QCOMPARE(renderer.render("{{int}} {{int|,}} {{int|.2}} {{int|,.1}}", &context),
+	         QString("1234567 1,234,567 1234567.00 1,234,567.0"));
+	QCOMPARE(renderer.render("{{negative}} {{negative|,}} {{zero|,}} {{min|,}} {{max}}", &context),
+	         QString("-1234 -1,234 0 -9,223,372,036,854,775,808 18446744073709551615"));
+	QCOMPARE(renderer.render("{{double}} {{double|.2}} {{double|,.2}} {{negativeDouble|,.1}}", &context),
+	         QString("1234.5 1234.50 1,234.50 -1,234,567.5"));
+	QCOMPARE(renderer.render("{{double|,}} {{negativeDouble|,.0}}", &context), QString("1,234.5 -1,234,568"));
+
+	// decimals are rounded as QString::number() rounds them, including exact halfway cases
+	const double doubles[] = {2.5, -2.5, 0.125, 0.1, 1.005, 0, 1e20, 123456.789, 0.5e-10};
+	for (unsigned i = 0; i < sizeof(doubles) / sizeof(doubles[0]); i++) {
+		QVariantHash doubleMap;
+		doubleMap["x"] = doubles[i];
+		Mustache::QtVariantContext doubleContext(doubleMap);
+		for (int precision = 0; precision <= 12; precision += 2) {
+			QCOMPARE(renderer.render(QString("{{x|.%1}}").arg(precision), &doubleContext),
+			         QString::number(doubles[i], 'f', precision));
+		}
+	}
+	QVariantHash smallMap;
+	smallMap["x"] = -0.001;
+	Mustache::QtVariantContext smallContext(smallMap);
+	QCOMPARE(renderer.render("{{x|.2}} {{x|.3}}", &smallContext), QString("0.00 -0.001"));
+
+	// formats are ignored for other values and keys without a valid format are left as they are
+	QCOMPARE(renderer.render("{{text|,.2}} {{a|b}} {{missing|.2}}", &context), QString("abc pipe "));
+
+	// formats are kept in compiled templates
+	Mustache::Template compiled = Mustache::Template::fromBinary(renderer.compile("{{double|,.2}}").toBinary());
+	QCOMPARE(renderer.render(compiled, &context), QString("1,234.50"));
+}
+
 void TestMustache::testSections()
 {
 	QVariantHash map = contactInfo("John Smith", "john.smith@gmail.com");
@@ -275,6 +318,11 @@ void TestMustache::testSetDelimiters()
 	output = renderer.render("%name%'s phone number is %phone%", &context);
 	QCOMPARE(output, QString("John Smith's phone number is 01234 567890"));
 
+	// test markers whose first character also appears in the text
+	renderer.setTagMarkers("[[[", "]]]");
+	output = renderer.render("a [[ b [[[name]]] ]] c [[[", &context);
+	QCOMPARE(output, QString("a [[ b John Smith ]] c [[["));
+
 	renderer.setTagMarkers("{{", "}}");
 	output = renderer.render("{{== ==}}", &context);
 	QCOMPARE(renderer.error(), QString("Custom delimiters may not contain '='."));
@@ -305,6 +353,16 @@ void TestMustache::testErrors()
 	QCOMPARE(renderer.errorPos(), 9);
 	QCOMPARE(renderer.errorPartial(), QString());
 
+	// the output before the error is still rendered
+	output = renderer.render("{{name}} {{#one}}x{{/one}}- {{#two}}{{name}}", &context);
+	QCOMPARE(output, QString("Jim Jones - "));
+	QCOMPARE(renderer.error(), QString("No matching end tag found for section"));
+	QCOMPARE(renderer.errorPos(), 28);
+	output = renderer.render(renderer.compile("{{name}}, {{/one}}{{name}}"), &context);
+	QCOMPARE(output, QString("Jim Jones, "));
+	QCOMPARE(renderer.error(), QString("Unexpected end tag"));
+	QCOMPARE(renderer.errorPos(), 10);
+
 	_template = "Hello {{>buggy-partial}}";
 	output = renderer.render(_template, &context);
 	QCOMPARE(renderer.error(), QString("Unexpected end tag"));
@@ -328,6 +386,124 @@ void TestMustache::testPartialFile()
 	QCOMPARE(output, QString("Jim Smith -- jim.smith@gmail.com\n"));
 }
 
+/** Loads a partial from a loader which is shared with other threads. */
+class LoadPartialTask : public QRunnable
+{
+public:
+	LoadPartialTask(Mustache::PartialResolver* loader, const QString& name, const QChar** data)
+		: m_loader(loader)
+		, m_name(name)
+		, m_data(data)
+	{}
+
+	virtual void run()
+	{
+		*m_data = m_loader->getPartial(m_name).constData();
+	}
+
+private:
+	Mustache::PartialResolver* m_loader;
+	QString m_name;
+	const QChar** m_data;
+};
+
+void TestMustache::testMappedPartialFile()
+{
+	QTemporaryDir dir;
+	QVERIFY(dir.isValid());
+
+	// a UTF-16 file in the native byte order, which is used in place
+	const QString wide = QString::fromUtf8("{{name}} \xE2\x80\x94 {{email}}\n");
+	QFile wideFile(dir.filePath("wide.mustache"));
+	QVERIFY(wideFile.open(QIODevice::WriteOnly));
+	const ushort bom = 0xFEFF;
+	wideFile.write(reinterpret_cast<const char*>(&bom), sizeof(bom));
+	wideFile.write(reinterpret_cast<const char*>(wide.constData()), wide.length() * 2);
+	wideFile.close();
+
+	// a UTF-8 file, which is decoded from the mapping
+	QFile narrowFile(dir.filePath("narrow.mustache"));
+	QVERIFY(narrowFile.open(QIODevice::WriteOnly));
+	narrowFile.write("\xEF\xBB\xBF{{>wide}}");
+	narrowFile.close();
+
+	QFile emptyFile(dir.filePath("empty.mustache"));
+	QVERIFY(emptyFile.open(QIODevice::WriteOnly));
+	emptyFile.close();
+
+	Mustache::MappedFileLoader loader(dir.path());
+	QCOMPARE(loader.getPartial("wide"), wide);
+	QCOMPARE(loader.getPartial("narrow"), QString("{{>wide}}"));
+	QCOMPARE(loader.getPartial("empty"), QString());
+	QCOMPARE(loader.getPartial("missing"), QString());
+
+	// the cached partial refers to the same mapping
+	QCOMPARE(loader.getPartial("wide").constData(), loader.getPartial("wide").constData());
+
+	// threads which load the same partial at once all use the one mapping which is kept
+	Mustache::MappedFileLoader sharedLoader(dir.path());
+	QVector<const QChar*> loaded(8);
+	QThreadPool pool;
+	for (int i = 0; i < loaded.count(); i++) {
+		pool.start(new LoadPartialTask(&sharedLoader, "wide", &loaded[i]));
+	}
+	pool.waitForDone();
+	for (int i = 0; i < loaded.count(); i++) {
+		QCOMPARE(loaded.at(i), sharedLoader.getPartial("wide").constData());
+	}
+
+	QVariantHash map = contactInfo("Jim Smith", "jim.smith@gmail.com");
+	Mustache::Renderer renderer;
+	Mustache::QtVariantContext context(map, &loader);
+	QCOMPARE(renderer.render("{{>narrow}}", &context), QString::fromUtf8("Jim Smith \xE2\x80\x94 jim.smith@gmail.com\n"));
+	QVERIFY(renderer.error().isEmpty());
+}
+
+void TestMustache::testMemoryUsage()
+{
+	Mustache::Renderer renderer;
+	Mustache::Template small = renderer.compile("{{name}}");
+	Mustache::Template large = renderer.compile(QString("{{#list}}{{name}} ").repeated(100) + QString("{{/list}}").repeated(100));
+	QVERIFY(small.memoryUsage() > 0);
+	QVERIFY(large.memoryUsage() > small.memoryUsage() + 1000);
+
+	// partials are kept within the limit, discarding the least recently used
+	QTemporaryDir dir;
+	QVERIFY(dir.isValid());
+	const QString content = QString("x").repeated(1000);
+	const QStringList names = QStringList() << "a" << "b" << "c";
+	foreach (const QString& name, names) {
+		QFile file(dir.filePath(name + ".mustache"));
+		QVERIFY(file.open(QIODevice::WriteOnly));
+		file.write(content.toUtf8());
+	}
+	Mustache::PartialFileLoader loader(dir.path());
+	QCOMPARE(loader.memoryUsage(), qint64(0));
+	loader.setMaxMemory(5000);
+	QCOMPARE(loader.maxMemory(), 5000);
+	foreach (const QString& name, names) {
+		QCOMPARE(loader.getPartial(name), content);
+		QVERIFY(loader.memoryUsage() <= 5000);
+	}
+	QVERIFY(loader.memoryUsage() >= 4000);
+	QCOMPARE(loader.getPartial("a"), content);
+
+	Mustache::FragmentCache cache;
+	cache.insert("key", content);
+	QVERIFY(cache.memoryUsage() >= 2000);
+
+	QVariantHash args;
+	args["list"] = QVariantList() << contactInfo("Jim", "jim@example.com");
+	Mustache::QtVariantContext context(args, &loader);
+	QVERIFY(context.memoryUsage() > 0);
+
+	QCOMPARE(renderer.memoryUsage(), qint64(0));
+	QString output = renderer.render("{{#list}}{{>a}}{{/list}}", &context);
+	QCOMPARE(output, content);
+	QVERIFY(renderer.memoryUsage() >= 2000);
+	QVERIFY(renderer.peakScratchMemory() >= 2000);
+}
+
 void TestMustache::testEscaping()
 {
 	QVariantHash map;
@@ -344,6 +520,82 @@ void TestMustache::testEscaping()
 	QCOMPARE(output, QString("&lt;b&gt;foo&lt;/b&gt; One & Two \"quoted\" <b>foo</b>"));
 }
 
+void TestMustache::testSafeValues()
+{
+	QVariantHash map;
+	map["html"] = QVariant::fromValue(Mustache::SafeString("<b>\"bold\" &amp; safe</b>"));
+	map["empty"] = QVariant::fromValue(Mustache::SafeString());
+	map["flag"] = true;
+	map["count"] = 42;
+	map["mixed"] = "a & b < c > \"d\"";
+
+	Mustache::Renderer renderer;
+	Mustache::QtVariantContext context(map);
+
+	// safe strings are written as they are by every kind of tag
+	QCOMPARE(renderer.render("{{html}}|{{&html}}|{{{html}}}", &context),
+	         QString("<b>\"bold\" &amp; safe</b>|<b>\"bold\" &amp; safe</b>|<b>\"bold\" &amp; safe</b>"));
+	QCOMPARE(renderer.render("{{flag}} {{count}}", &context), QString("true 42"));
+	QCOMPARE(renderer.render("{{mixed}}", &context), QString("a &amp; b &lt; c &gt; &quot;d&quot;"));
+
+	// safe strings can be used as sections like other strings
+	QCOMPARE(renderer.render("{{#html}}yes{{/html}}{{^empty}}no{{/empty}}", &context), QString("yesno"));
+	QCOMPARE(context.stringValue("html"), QString("<b>\"bold\" &amp; safe</b>"));
+}
+
+/** An escaper for CSV fields, which doubles quotes. */
+class CsvEscaper : public Mustache::Escaper
+{
+public:
+	virtual void append(const QString& text, QString& output) const
+	{
+		output += QString(text).replace("\"", "\"\"");
+	}
+};
+
+void TestMustache::testEscapers()
+{
+	QVariantHash map;
+	map["text"] = QString::fromUtf8("Tom & \"Jerry's\" <script>\\ \n\t\x01 \xe2\x80\xa8 caf\xc3\xa9");
+	QHash<QString, QString> partials;
+	partials["field"] = "{{text}}";
+	Mustache::PartialMap partialMap(partials);
+	Mustache::QtVariantContext context(map, &partialMap);
+	Mustache::Renderer renderer;
+
+	QCOMPARE(renderer.escaper(), Mustache::Escaper::html());
+	QCOMPARE(renderer.render("{{text}}", &context),
+	         QString::fromUtf8("Tom &amp; &quot;Jerry's&quot; &lt;script&gt;\\ \n\t\x01 \xe2\x80\xa8 caf\xc3\xa9"));
+
+	renderer.setEscaper(Mustache::Escaper::xml());
+	QCOMPARE(renderer.render("{{text}}", &context),
+	         QString::fromUtf8("Tom &amp; &quot;Jerry&apos;s&quot; &lt;script&gt;\\ \n\t\x01 \xe2\x80\xa8 caf\xc3\xa9"));
+
+	renderer.setEscaper(Mustache::Escaper::json());
+	QCOMPARE(renderer.render("\"{{text}}\"", &context),
+	         QString::fromUtf8("\"Tom & \\\"Jerry's\\\" <script>\\\\ \\n\\t\\u0001 \xe2\x80\xa8 caf\xc3\xa9\""));
+
+	renderer.setEscaper(Mustache::Escaper::javaScript());
+	const QString javaScriptOutput = renderer.render("'{{text}}'", &context);
+	QCOMPARE(javaScriptOutput,
+	         QString::fromUtf8("'Tom \\u0026 \\\"Jerry\\'s\\\" \\u003cscript\\u003e\\\\ \\n\\t\\u0001 \\u2028 caf\xc3\xa9'"));
+
+	// unescaped tags, numbers and safe strings are not affected
+	map["number"] = 1.5;
+	map["safe"] = QVariant::fromValue(Mustache::SafeString("<b>"));
+	context = Mustache::QtVariantContext(map, &partialMap);
+	QCOMPARE(renderer.render("{{{text}}}", &context), map["text"].toString());
+	QCOMPARE(renderer.render("{{number}} {{safe}}", &context), QString("1.5 <b>"));
+
+	// a template's escaper applies to its partials and takes precedence over the renderer's
+	CsvEscaper csv;
+	Mustache::Template compiled = renderer.compile("\"{{>field}}\",\"{{text}}\"");
+	compiled.setEscaper(&csv);
+	QString field = "\"" + map["text"].toString().replace("\"", "\"\"") + "\"";
+	QCOMPARE(renderer.render(compiled, &context), field + "," + field);
+	QCOMPARE(renderer.render("'{{text}}'", &context), javaScriptOutput);
+}
+
 class CounterContext : public Mustache::QtVariantContext
 {
 public:
@@ -454,6 +706,32 @@ void TestMustache::testLambda()
 	QCOMPARE(output, QString("~test~"));
 }
 
+void TestMustache::testSectionLambda()
+{
+	QVariantHash args;
+	args["name"] = "Jim";
+	args["list"] = QVariantList() << 1 << 2;
+	QStringList texts;
+	args["bold"] = QVariant::fromValue(Mustache::QtVariantContext::section_fn_t(
+	    [&texts](const Mustache::TemplateSection& section, Mustache::Context* context) {
+		texts << section.text();
+		return "<b>" + section.render(context) + "</b>";
+	}));
+
+	// the parsed section keeps the tag markers in effect where it appears
+	Mustache::Renderer renderer;
+	Mustache::QtVariantContext context(args);
+	QString output = renderer.render("{{=<% %>=}}<%#list%><%#bold%><%name%> <%.%><%/bold%><%/list%>", &context);
+	QCOMPARE(output, QString("<b>Jim 1</b><b>Jim 2</b>"));
+	QCOMPARE(texts, QStringList() << "<%name%> <%.%>" << "<%name%> <%.%>");
+
+	// lambdas which are given only the text of the section compile it first
+	texts.clear();
+	output = context.eval("bold", "{{name}}", &renderer);
+	QCOMPARE(output, QString("<b>Jim</b>"));
+	QCOMPARE(texts, QStringList() << "{{name}}");
+}
+
 void TestMustache::testQStringListIteration()
 {
 	QStringList list;
@@ -464,6 +742,50 @@ void TestMustache::testQStringListIteration()
 	QCOMPARE(output, QString("str1str2str3"));
 }
 
+void TestMustache::testLazyValues()
+{
+	int computed = 0;
+	QVariantHash args;
+	args["cheap"] = "cheap";
+	args["expensive"] = QVariant::fromValue(Mustache::LazyValue([&computed]() {
+		++computed;
+		return QVariant("expensive");
+	}));
+
+	// rows are only produced as the section is rendered
+	int pulled = 0;
+	args["rows"] = QVariant::fromValue(Mustache::LazySequence([&pulled](int index, QVariant* item) {
+		if (index >= 3) {
+			return false;
+		}
+		++pulled;
+		QVariantHash row;
+		row["n"] = index + 1;
+		*item = row;
+		return true;
+	}));
+	args["none"] = QVariant::fromValue(Mustache::LazySequence([](int, QVariant*) {
+		return false;
+	}));
+
+	Mustache::Renderer renderer;
+	Mustache::QtVariantContext context(args);
+	QCOMPARE(renderer.render("{{cheap}}", &context), QString("cheap"));
+	QCOMPARE(computed, 0);
+	QCOMPARE(renderer.render("{{expensive}} {{#expensive}}{{.}}{{/expensive}}", &context), QString("expensive expensive"));
+	QVERIFY(computed > 0);
+
+	QCOMPARE(renderer.render("{{#rows}}{{n}},{{/rows}}", &context), QString("1,2,3,"));
+	QCOMPARE(pulled, 3);
+	QCOMPARE(renderer.render("{{#none}}x{{/none}}{{^none}}empty{{/none}}", &context), QString("empty"));
+	QCOMPARE(renderer.render("{{^rows}}empty{{/rows}}", &context), QString());
+
+	// the items of a sequence count towards the iteration budget
+	renderer.setMaxIterations(2);
+	renderer.render("{{#rows}}{{n}}{{/rows}}", &context);
+	QCOMPARE(renderer.error(), QString("Maximum number of iterations exceeded"));
+}
+
 void TestMustache::testUnescapeHtml()
 {
 	QVariantHash args;
@@ -472,40 +794,995 @@ void TestMustache::testUnescapeHtml()
 	QCOMPARE(output, QString("<>&\"&quot;"));
 }
 
-#if QT_VERSION >= 0x050000 // JSON classes only in Qt 5+.
+void TestMustache::testCompiledTemplate()
+{
+	Mustache::Renderer renderer;
+	Mustache::Template compiled = renderer.compile("{{#contacts}}{{name}} <{{email}}>\n{{/contacts}}");
+	QCOMPARE(compiled.error(), QString());
+	QCOMPARE(compiled.errorPos(), -1);
 
-void TestMustache::testConformance_data()
+	QVariantHash map;
+	QVariantList contacts;
+	contacts << contactInfo("James Dee", "james@dee.org");
+	map["contacts"] = contacts;
+	Mustache::QtVariantContext context(map);
+	QCOMPARE(renderer.render(compiled, &context), QString("James Dee &lt;james@dee.org&gt;\n"));
+
+	contacts << contactInfo("Jim Jones", "jim-jones@yahoo.com");
+	map["contacts"] = contacts;
+	context = Mustache::QtVariantContext(map);
+	QCOMPARE(renderer.render(compiled, &context), QString("James Dee &lt;james@dee.org&gt;\n"
+	                                                      "Jim Jones &lt;jim-jones@yahoo.com&gt;\n"));
+
+	// compile errors are reported by the template and when rendering it
+	compiled = renderer.compile("{{#one}} {{/two}}");
+	QCOMPARE(compiled.error(), QString("Tag start/end key mismatch"));
+	QCOMPARE(compiled.errorPos(), 9);
+	QCOMPARE(renderer.render(compiled, &context), QString());
+	QCOMPARE(renderer.error(), QString("Tag start/end key mismatch"));
+	QCOMPARE(renderer.errorPos(), 9);
+}
+
+void TestMustache::testBinaryTemplate()
 {
-	QTest::addColumn<QVariantMap>("data");
-	QTest::addColumn<QString>("template_");
-	QTest::addColumn<QHash<QString, QString> >("partials");
-	QTest::addColumn<QString>("expected");
+	QHash<QString, QString> partials;
+	partials["item"] = "* {{.}}\n";
 
-	QDir specsDir = QDir(".");
+	QVariantHash map;
+	map["title"] = "Fruit & Veg";
+	map["items"] = QStringList() << "Apple" << "Leek";
 
-	foreach (const QString &fileName, specsDir.entryList(QStringList() << "*.json")) {
-		QFile file(specsDir.filePath(fileName));
-		QVERIFY2(file.open(QIODevice::ReadOnly), qPrintable(fileName + ": " + file.errorString()));
+	Mustache::Renderer renderer;
+	Mustache::PartialMap partialMap(partials);
+	Mustache::QtVariantContext context(map, &partialMap);
 
-		QJsonDocument document = QJsonDocument::fromJson(file.readAll());
-		QJsonArray testCaseValues = document.object()["tests"].toArray();
+	QString _template = "{{title}}:\n{{#items}}\n  {{>item}}\n{{/items}}\n{{^items}}None{{/items}}";
+	QString expectedOutput = renderer.render(_template, &context);
+	QCOMPARE(expectedOutput, QString("Fruit &amp; Veg:\n  * Apple\n  * Leek\n"));
+
+	QByteArray binary = renderer.compile(_template).toBinary();
+	QVERIFY(!binary.isEmpty());
+
+	Mustache::Template loaded = Mustache::Template::fromBinary(binary);
+	QCOMPARE(loaded.source(), _template);
+	QCOMPARE(renderer.render(loaded, &context), expectedOutput);
+
+	// loading from a memory-mapped file
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	QCOMPARE(file.write(binary), qint64(binary.size()));
+	file.close();
+	Mustache::Template mapped = Mustache::Template::mapBinary(file.fileName());
+	QCOMPARE(mapped.source(), _template);
+	QCOMPARE(renderer.render(mapped, &context), expectedOutput);
+
+	// corrupt, truncated or invalid data is rejected
+	QByteArray corrupt = binary;
+	corrupt[corrupt.size() - 1] = corrupt.at(corrupt.size() - 1) ^ 0x1;
+	QVERIFY(Mustache::Template::fromBinary(corrupt).nodes().isEmpty());
+	QVERIFY(Mustache::Template::fromBinary(binary.left(binary.size() - 2)).nodes().isEmpty());
+	QVERIFY(Mustache::Template::fromBinary(QByteArray("not a template")).nodes().isEmpty());
+	QVERIFY(renderer.compile("{{#unclosed}}").toBinary().isEmpty());
+
+	// without the checksum, only the header is checked when loading and the
+	// nodes are checked when they are first used
+	Mustache::Template unchecked = Mustache::Template::mapBinary(file.fileName(), Mustache::Template::SkipChecksum);
+	QCOMPARE(renderer.render(unchecked, &context), expectedOutput);
+	QVERIFY(!Mustache::Template::fromBinary(corrupt, Mustache::Template::SkipChecksum).nodes().isEmpty());
+	QByteArray badNode = binary;
+	badNode[36] = char(99); // the type of the first node
+	Mustache::Template invalid = Mustache::Template::fromBinary(badNode, Mustache::Template::SkipChecksum);
+	QCOMPARE(invalid.source(), _template);
+	QCOMPARE(renderer.render(invalid, &context), QString());
+	QCOMPARE(renderer.error(), QString("The compiled template is not valid"));
+	QVERIFY(invalid.nodes().isEmpty());
+}
 
-		for (const QJsonValue &testCaseValue: testCaseValues) {
-			QJsonObject testCaseObject = testCaseValue.toObject();
+/** A verifier which expects every template to render @p expected, and reports
+ * differences in @p partial.
+ */
+class ExpectedOutputVerifier : public Mustache::Verifier
+{
+public:
+	ExpectedOutputVerifier(const QString& expected, const QString& partial)
+		: m_expected(expected)
+		, m_partial(partial)
+		, m_calls(0)
+	{}
 
-			QString name = fileName + " - " + testCaseObject["name"].toString();
-			QVariantMap data = testCaseObject["data"].toObject().toVariantMap();
-			QString template_ = testCaseObject["template"].toString();
-			QJsonObject partialsObject = testCaseObject["partials"].toObject();
-			PartialsHash partials;
-			foreach (const QString &partialName, partialsObject.keys()) {
-				partials.insert(partialName, partialsObject[partialName].toString());
+	virtual QString verify(const Mustache::Template&, Mustache::Context* context, const QString& output,
+	                       Mustache::Renderer* renderer, int* pos, QString* partial)
+	{
+		++m_calls;
+		// templates which the verifier renders are not verified themselves
+		if (renderer->render("{{name}}", context).isEmpty()) {
+			return "The name is missing";
+		}
+		for (int i = 0; i < qMax(output.length(), m_expected.length()); i++) {
+			if (output.mid(i, 1) != m_expected.mid(i, 1)) {
+				*pos = i;
+				*partial = m_partial;
+				return QString("Output differs at character %1").arg(i);
 			}
-			QString expected = testCaseObject["expected"].toString();
+		}
+		return QString();
+	}
+
+	int calls() const { return m_calls; }
+
+private:
+	QString m_expected;
+	QString m_partial;
+	int m_calls;
+};
+
+void TestMustache::testVerification()
+{
+	QVariantHash args = contactInfo("Jim", "jim@example.com");
+	Mustache::QtVariantContext context(args);
+	Mustache::Renderer renderer;
+	QVERIFY(!renderer.verifier());
+
+	ExpectedOutputVerifier verifier("Jim <jim@example.com>", "item");
+	renderer.setVerifier(&verifier);
+	QVERIFY(renderer.verifier() == &verifier);
+	QCOMPARE(renderer.render("{{name}} <{{email}}>", &context), QString("Jim &lt;jim@example.com&gt;"));
+	QCOMPARE(renderer.error(), QString("Output differs at character 4"));
+	QCOMPARE(renderer.errorPos(), 4);
+	QCOMPARE(renderer.errorPartial(), QString("item"));
+	QCOMPARE(verifier.calls(), 1);
+
+	QCOMPARE(renderer.render("{{{name}}} <{{{email}}}>", &context), QString("Jim <jim@example.com>"));
+	QVERIFY2(renderer.error().isEmpty(), qPrintable(renderer.error()));
+	QCOMPARE(verifier.calls(), 2);
+
+	// templates with errors are not verified
+	renderer.render("{{name}} {{#email}}", &context);
+	QCOMPARE(renderer.error(), QString("No matching end tag found for section"));
+	QCOMPARE(verifier.calls(), 2);
+
+	renderer.setVerifier(0);
+	QCOMPARE(renderer.render("{{name}}", &context), QString("Jim"));
+	QVERIFY(renderer.error().isEmpty());
+	QCOMPARE(verifier.calls(), 2);
+}
+
+void TestMustache::testSharedTemplateStore()
+{
+	const QString key = QString("qt-mustache-test-%1").arg(QCoreApplication::applicationPid());
+	QHash<QString, QString> partials;
+	partials["item"] = "* {{name}}\n";
+	Mustache::PartialMap partialMap(partials);
+
+	Mustache::Renderer renderer;
+	QHash<QString, Mustache::Template> templates;
+	templates["list"] = renderer.compile("{{#contacts}}{{>item}}{{/contacts}}", &partialMap);
+	templates["title"] = renderer.compile("<h1>{{title}}</h1>");
+
+	Mustache::SharedTemplateStore creator(key);
+	QVERIFY2(creator.create(templates), qPrintable(creator.error()));
+	QCOMPARE(creator.names().count(), 2);
+
+	// another store with the same key, as a worker process would use
+	Mustache::Template list;
+	{
+		Mustache::SharedTemplateStore worker(key);
+		QVERIFY2(worker.attach(), qPrintable(worker.error()));
+		QCOMPARE(worker.value("title").source(), QString("<h1>{{title}}</h1>"));
+		QVERIFY(worker.value("missing").nodes().isEmpty());
+		list = worker.value("list");
+	}
+
+	// templates keep the segment attached after the store is destroyed
+	QVariantHash args;
+	args["contacts"] = QVariantList() << contactInfo("Jim", "jim@example.com") << contactInfo("Sue", "sue@example.com");
+	Mustache::QtVariantContext context(args);
+	QCOMPARE(renderer.render(list, &context), QString("* Jim\n* Sue\n"));
+	QCOMPARE(list.inlinedPartials().count(), 1);
+
+	// names do not refer to the segment, which is detached with the store
+	QStringList names;
+	{
+		Mustache::SharedTemplateStore worker(key);
+		QVERIFY2(worker.attach(), qPrintable(worker.error()));
+		names = worker.names();
+	}
+	names.sort();
+	QCOMPARE(names, QStringList() << "list" << "title");
+
+	// the segment cannot be created twice, and templates with errors are not stored
+	Mustache::SharedTemplateStore duplicate(key);
+	QVERIFY(!duplicate.create(templates));
+	QVERIFY(!duplicate.error().isEmpty());
+	templates["bad"] = renderer.compile("{{#unclosed}}");
+	Mustache::SharedTemplateStore invalid(key + "-invalid");
+	QVERIFY(!invalid.create(templates));
+
+	Mustache::SharedTemplateStore missing(key + "-missing");
+	QVERIFY(!missing.attach());
+	QVERIFY(missing.names().isEmpty());
+}
+
+void TestMustache::testInlinePartials()
+{
+	QHash<QString, QString> partials;
+	partials["item"] = "* {{.}}\n  {{>note}}\n";
+	partials["note"] = "({{#notes}}{{.}}{{/notes}})\n";
+	partials["tree"] = "{{name}}[{{#children}}{{>tree}}{{/children}}]";
+	partials["bad"] = "{{#unclosed}}";
+
+	QVariantHash leaf;
+	leaf["name"] = "leaf";
+	leaf["children"] = false;
+	QVariantHash tree;
+	tree["name"] = "root";
+	tree["children"] = QVariantList() << leaf << leaf;
+	QVariantHash map;
+	map["items"] = QStringList() << "Apple" << "Leek";
+	map["notes"] = QStringList() << "a" << "b";
+	map["tree"] = tree;
 
-			QTest::newRow(qPrintable(name)) << data << template_ << partials << expected;
+	Mustache::Renderer renderer;
+	Mustache::PartialMap partialMap(partials);
+	Mustache::QtVariantContext context(map, &partialMap);
+
+	// inlined partials produce the same output as partials loaded while rendering
+	QString _template = "{{#items}}\n  {{>item}}\n{{/items}}{{#tree}}{{>tree}}{{/tree}}";
+	QString expectedOutput = renderer.render(_template, &context);
+	QCOMPARE(expectedOutput, QString("  * Apple\n    (ab)\n  * Leek\n    (ab)\nroot[leaf[]leaf[]]"));
+	Mustache::Template inlined = renderer.compile(_template, &partialMap);
+	QCOMPARE(inlined.inlinedPartials(), QStringList() << "item" << "note" << "tree");
+	QCOMPARE(renderer.render(inlined, &context), expectedOutput);
+
+	// recursive partials are only inlined once
+	int dynamicPartials = 0;
+	foreach (const Mustache::Node& node, inlined.nodes()) {
+		if (node.type == Mustache::Node::Partial && node.next == 0) {
+			QCOMPARE(node.key, QString("tree"));
+			++dynamicPartials;
 		}
 	}
+	QCOMPARE(dynamicPartials, 1);
+
+	// partials which are included many times share one copy of their source
+	partials["cell"] = "<{{.}}>";
+	partials["row"] = "{{>cell}}{{>cell}}{{>cell}}\n";
+	Mustache::PartialMap tableMap(partials);
+	QString table = "{{#items}}{{>row}}{{>row}}{{/items}}";
+	Mustache::Template tableTemplate = renderer.compile(table, &tableMap);
+	QCOMPARE(tableTemplate.source().length(), table.length() + partials["row"].length() + partials["cell"].length());
+	Mustache::QtVariantContext tableContext(map, &tableMap);
+	QCOMPARE(renderer.render(tableTemplate, &tableContext),
+	         QString("<Apple><Apple><Apple>\n<Apple><Apple><Apple>\n<Leek><Leek><Leek>\n<Leek><Leek><Leek>\n"));
+	QString indented = "{{#items}}\n  {{>row}}\n  {{>row}}\n{{/items}}";
+	QCOMPARE(renderer.render(renderer.compile(indented, &tableMap), &tableContext),
+	         renderer.render(indented, &tableContext));
+
+	// partials which fail to compile report errors when they are rendered
+	Mustache::Template bad = renderer.compile("{{>bad}}", &partialMap);
+	QVERIFY(bad.inlinedPartials().isEmpty());
+	renderer.render(bad, &context);
+	QCOMPARE(renderer.errorPartial(), QString("bad"));
+
+	// errors in inlined partials refer to the partial
+	renderer.setMaxPartials(1);
+	renderer.render(inlined, &context);
+	QCOMPARE(renderer.error(), QString("Maximum number of partials exceeded"));
+	QCOMPARE(renderer.errorPartial(), QString("item"));
+	renderer.setMaxPartials(0);
+
+	Mustache::Template loaded = Mustache::Template::fromBinary(inlined.toBinary());
+	QCOMPARE(loaded.inlinedPartials(), inlined.inlinedPartials());
+	QCOMPARE(renderer.render(loaded, &context), expectedOutput);
+
+	QVERIFY(!loaded.partialsChanged(&partialMap));
+	partials["note"] = "{{#notes}}{{.}}{{/notes}}\n";
+	Mustache::PartialMap changedMap(partials);
+	QVERIFY(loaded.partialsChanged(&changedMap));
+}
+
+/** A context which overrides how some of the keys in its data are rendered. */
+class OverridingContext : public Mustache::QtVariantContext
+{
+public:
+	explicit OverridingContext(const QVariantHash& map)
+		: Mustache::QtVariantContext(map)
+	{}
+
+	virtual bool isFalse(const QString& key) const {
+		return key == "hidden" || Mustache::QtVariantContext::isFalse(key);
+	}
+
+	virtual int listCount(const QString& key) const {
+		return key == "list" ? 1 : Mustache::QtVariantContext::listCount(key);
+	}
+
+	virtual bool canEval(const QString& key) const {
+		return key == "text" || Mustache::QtVariantContext::canEval(key);
+	}
+
+	virtual QString eval(const QString& key, const QString& _template, Mustache::Renderer* renderer) {
+		return "[" + key + ": " + renderer->render(_template, this) + "]";
+	}
+
+	virtual Mustache::ResolvedValue resolve(const QString& key) const {
+		if (key == "hidden" || key == "list" || key == "text") {
+			return Mustache::Context::resolve(key);
+		}
+		return Mustache::QtVariantContext::resolve(key);
+	}
+
+	virtual QString stringValue(const QString& key) const {
+		return key == "zero" ? "none" : Mustache::QtVariantContext::stringValue(key);
+	}
+
+	virtual QVariant variantValue(const QString& key) const {
+		return key == "zero" ? QVariant(stringValue(key)) : Mustache::QtVariantContext::variantValue(key);
+	}
+};
+
+void TestMustache::testResolve()
+{
+	QVariantHash map;
+	map["list"] = QVariantList() << "one" << "two";
+	map["emptyList"] = QVariantList();
+	map["strings"] = QStringList() << "a";
+	map["map"] = contactInfo("Rob Knight", "robertknight@gmail.com");
+	map["emptyMap"] = QVariantHash();
+	map["text"] = "text";
+	map["emptyText"] = "";
+	map["zero"] = 0;
+	map["fn"] = QVariant::fromValue(Mustache::QtVariantContext::fn_t(decorate));
+
+	Mustache::QtVariantContext context(map);
+	QCOMPARE(context.resolve("list").kind, Mustache::ResolvedValue::List);
+	QCOMPARE(context.resolve("list").count, 2);
+	QCOMPARE(context.resolve("strings").kind, Mustache::ResolvedValue::List);
+	QCOMPARE(context.resolve("strings").count, 1);
+	QCOMPARE(context.resolve("emptyList").kind, Mustache::ResolvedValue::Falsy);
+	QCOMPARE(context.resolve("map").kind, Mustache::ResolvedValue::Map);
+	QCOMPARE(context.resolve("map.name").kind, Mustache::ResolvedValue::Truthy);
+	QCOMPARE(context.resolve("emptyMap").kind, Mustache::ResolvedValue::Falsy);
+	QCOMPARE(context.resolve("text").kind, Mustache::ResolvedValue::Truthy);
+	QCOMPARE(context.resolve("emptyText").kind, Mustache::ResolvedValue::Falsy);
+	QCOMPARE(context.resolve("zero").kind, Mustache::ResolvedValue::Falsy);
+	QCOMPARE(context.resolve("missing").kind, Mustache::ResolvedValue::Falsy);
+	QCOMPARE(context.resolve("fn").kind, Mustache::ResolvedValue::Lambda);
+
+	// pushing a resolved list item does not need the key to be looked up again
+	Mustache::ResolvedValue list = context.resolve("list");
+	context.pushResolved(list, 1);
+	QCOMPARE(context.stringValue("."), QString("two"));
+	context.pop();
+
+	// contexts which provide lambdas through canEval() are still supported
+	CounterContext counterContext(map);
+	QCOMPARE(counterContext.resolve("counter").kind, Mustache::ResolvedValue::Lambda);
+
+	// subclasses can override resolve() to change how sections are rendered for keys in the data
+	map["hidden"] = "text";
+	OverridingContext overridingContext(map);
+	Mustache::Renderer renderer;
+	QCOMPARE(renderer.render("{{#hidden}}hidden{{/hidden}}{{^hidden}}not shown{{/hidden}}", &overridingContext),
+	         QString("not shown"));
+	QCOMPARE(renderer.render("{{#list}}{{.}} {{/list}}{{#text}}{{zero}}{{/text}}", &overridingContext),
+	         QString("one [text: none]"));
+	QCOMPARE(renderer.render("{{zero|.2}} {{map.name}}", &overridingContext), QString("none Rob Knight"));
+	QCOMPARE(overridingContext.resolve("list").count, 1);
+	QCOMPARE(overridingContext.resolve("map").kind, Mustache::ResolvedValue::Map);
+	QCOMPARE(renderer.render("{{#map}}{{name}}{{/map}}", &overridingContext), QString("Rob Knight"));
+}
+
+void TestMustache::testMaxDepth()
+{
+	// deeply nested data is rendered without recursion
+	QVariantHash data;
+	data["name"] = "x";
+	data["child"] = false;
+	for (int i = 0; i < 5000; i++) {
+		QVariantHash parent;
+		parent["name"] = "x";
+		parent["child"] = data;
+		data = parent;
+	}
+	QHash<QString, QString> partials;
+	partials["node"] = "{{name}}{{#child}}{{>node}}{{/child}}";
+	Mustache::PartialMap partialMap(partials);
+
+	Mustache::Renderer renderer;
+	Mustache::QtVariantContext context(data, &partialMap);
+	renderer.setMaxDepth(0);
+	QCOMPARE(renderer.render("{{>node}}", &context), QString("x").repeated(5001));
+	QCOMPARE(renderer.errorPos(), -1);
+
+	renderer.setMaxDepth(10);
+	QCOMPARE(renderer.render("{{>node}}", &context), QString("x").repeated(5));
+	QCOMPARE(renderer.error(), QString("Maximum nesting depth exceeded"));
+	QCOMPARE(renderer.errorPartial(), QString("node"));
+
+	// a partial which includes itself unconditionally is stopped by the default limit
+	partials["node"] = "{{>node}}";
+	Mustache::PartialMap recursivePartialMap(partials);
+	Mustache::QtVariantContext recursiveContext(data, &recursivePartialMap);
+	renderer.setMaxDepth(1000);
+	QCOMPARE(renderer.render("{{>node}}", &recursiveContext), QString());
+	QCOMPARE(renderer.error(), QString("Maximum nesting depth exceeded"));
+
+	// the context is left as it was before rendering
+	QCOMPARE(context.stringValue("name"), QString("x"));
+	QVERIFY(!context.isFalse("child"));
+}
+
+void TestMustache::testBudgets()
+{
+	QVariantHash data;
+	QStringList list;
+	for (int i = 0; i < 100; i++) {
+		list << "abc";
+	}
+	data["list"] = list;
+	QHash<QString, QString> partials;
+	partials["p"] = "x";
+	Mustache::PartialMap partialMap(partials);
+	Mustache::QtVariantContext context(data, &partialMap);
+	Mustache::Renderer renderer;
+
+	renderer.setMaxOutputLength(10);
+	QString output = renderer.render("{{#list}}{{.}}{{/list}}", &context);
+	QCOMPARE(renderer.error(), QString("Maximum output length exceeded"));
+	QCOMPARE(output, QString("abcabcabcabc"));
+	renderer.setMaxOutputLength(0);
+
+	renderer.setMaxIterations(5);
+	output = renderer.render("{{#list}}{{.}}{{/list}}", &context);
+	QCOMPARE(renderer.error(), QString("Maximum number of iterations exceeded"));
+	QCOMPARE(renderer.errorPos(), 0);
+	QCOMPARE(output, QString("abc").repeated(5));
+	renderer.setMaxIterations(0);
+
+	// budgets apply to each render() call
+	renderer.setMaxPartials(2);
+	QCOMPARE(renderer.render("{{>p}}{{>p}}", &context), QString("xx"));
+	QCOMPARE(renderer.errorPos(), -1);
+	QCOMPARE(renderer.render("{{>p}}{{>p}}{{>p}}", &context), QString("xx"));
+	QCOMPARE(renderer.error(), QString("Maximum number of partials exceeded"));
+	QCOMPARE(renderer.errorPos(), 12);
+	renderer.setMaxPartials(0);
+
+	renderer.setDeadline(QDeadlineTimer(0));
+	QCOMPARE(renderer.render("{{#list}}{{.}}{{/list}}", &context), QString());
+	QCOMPARE(renderer.error(), QString("Deadline exceeded"));
+	renderer.setDeadline(QDeadlineTimer(QDeadlineTimer::Forever));
+
+	QAtomicInt cancelled(1);
+	renderer.setCancellationToken(&cancelled);
+	QCOMPARE(renderer.render("{{#list}}{{.}}{{/list}}", &context), QString());
+	QCOMPARE(renderer.error(), QString("Rendering cancelled"));
+
+	// the budget is checked for sections and list items which do not produce any output
+	cancelled = 0;
+	renderer.render("{{#list}}{{#missing}}{{/missing}}{{/list}}", &context);
+	QCOMPARE(renderer.errorPos(), -1);
+	cancelled = 1;
+	renderer.render("{{#list}}{{#missing}}{{/missing}}{{/list}}", &context);
+	QCOMPARE(renderer.error(), QString("Rendering cancelled"));
+	cancelled = 0;
+	QVariantHash rows;
+	rows["rows"] = QVariant::fromValue(Mustache::LazySequence([&cancelled](int index, QVariant* item) {
+		if (index == 10) {
+			cancelled = 1;
+		}
+		*item = index;
+		return true;
+	}));
+	Mustache::QtVariantContext rowsContext(rows);
+	renderer.setMaxIterations(1000);
+	renderer.render("{{#rows}}{{/rows}}", &rowsContext);
+	QCOMPARE(renderer.error(), QString("Rendering cancelled"));
+	renderer.setMaxIterations(0);
+	cancelled = 0;
+	QCOMPARE(renderer.render("{{#list}}{{.}}{{/list}}", &context), QString("abc").repeated(100));
+	QCOMPARE(renderer.errorPos(), -1);
+	renderer.setCancellationToken(0);
+}
+
+void TestMustache::testContextStack()
+{
+	QVariantHash address;
+	address["city"] = "Paris";
+	QVariantMap person;
+	person["name"] = "Jim";
+	person["address"] = address;
+	QVariantMap data;
+	data["rows"] = QVariantList() << QVariant(QVariantList() << 1 << 2) << QVariant(QVariantList() << 3);
+	data["names"] = QStringList() << "a" << "b";
+	data["person"] = person;
+
+	// frames refer to maps and lists in the data, or own items converted from other types
+	QString _template = "{{#rows}}[{{#.}}{{.}}{{/.}}]{{/rows}} "
+	                    "{{#names}}{{.}}{{person.name}}{{/names}} "
+	                    "{{#person}}{{#address}}{{city}} {{name}}{{/address}}{{/person}}";
+	QString expected = "[12][3] aJimbJim Paris Jim";
+
+	Mustache::Renderer renderer;
+	Mustache::QtVariantContext context(data);
+	QCOMPARE(renderer.render(_template, &context), expected);
+
+	context.push("person");
+	context.push("address");
+	QCOMPARE(context.stringValue("city"), QString("Paris"));
+	QCOMPARE(context.stringValue("name"), QString("Jim"));
+
+	// a copy of a context remains valid when the original is replaced
+	Mustache::QtVariantContext copy = context;
+	context = Mustache::QtVariantContext(QVariantHash());
+	QCOMPARE(copy.stringValue("city"), QString("Paris"));
+	copy.pop();
+	copy.pop();
+	QCOMPARE(renderer.render(_template, &copy), expected);
+}
+
+void TestMustache::testFragmentCache()
+{
+	QVariantHash data;
+	data["nav"] = true;
+	data["user"] = "alice";
+	data["count"] = 1;
+	QHash<QString, QString> partials;
+	partials["footer"] = "({{count}})";
+	Mustache::PartialMap partialMap(partials);
+	Mustache::FragmentCache cache;
+	Mustache::Renderer renderer;
+	renderer.setFragmentCache(&cache);
+
+	// the output is reused for as long as the dependencies are the same
+	QString _template = "{{#nav|cache:user}}<{{user}}:{{count}}>{{/nav}}{{>footer|cache}}";
+	Mustache::QtVariantContext context(data, &partialMap);
+	QCOMPARE(renderer.render(_template, &context), QString("<alice:1>(1)"));
+	QCOMPARE(cache.misses(), 2);
+	data["count"] = 2;
+	context = Mustache::QtVariantContext(data, &partialMap);
+	QCOMPARE(renderer.render(_template, &context), QString("<alice:1>(1)"));
+	QCOMPARE(cache.hits(), 2);
+	data["user"] = "bob";
+	context = Mustache::QtVariantContext(data, &partialMap);
+	QCOMPARE(renderer.render(_template, &context), QString("<bob:2>(1)"));
+	QCOMPARE(cache.hits(), 3);
+	QCOMPARE(cache.misses(), 3);
+
+	// sections can be marked as cacheable after they are compiled
+	cache.clear();
+	Mustache::Template compiled = renderer.compile("{{#nav}}{{user}}{{/nav}}{{^nav}}{{user}}{{/nav}}");
+	compiled.setCacheable("nav");
+	compiled = Mustache::Template::fromBinary(compiled.toBinary());
+	QCOMPARE(renderer.render(compiled, &context), QString("bob"));
+	data["user"] = "carol";
+	context = Mustache::QtVariantContext(data, &partialMap);
+	QCOMPARE(renderer.render(compiled, &context), QString("bob"));
+	compiled.setCacheable("nav", QStringList() << "user");
+	QCOMPARE(renderer.render(compiled, &context), QString("carol"));
+
+	// the value of the section itself is part of the key
+	cache.clear();
+	QString sectionTemplate = "{{#nav|cache}}{{.}}{{/nav}}{{^nav|cache}}none{{/nav}}{{#list|cache}}{{.}}{{/list}}";
+	data["nav"] = false;
+	data["list"] = QVariantList() << 1;
+	context = Mustache::QtVariantContext(data, &partialMap);
+	QCOMPARE(renderer.render(sectionTemplate, &context), QString("none1"));
+	data["nav"] = "yes";
+	data["list"] = QVariantList() << 1 << 2;
+	context = Mustache::QtVariantContext(data, &partialMap);
+	QCOMPARE(renderer.render(sectionTemplate, &context), QString("yes12"));
+	data["nav"] = "no";
+	context = Mustache::QtVariantContext(data, &partialMap);
+	QCOMPARE(renderer.render(sectionTemplate, &context), QString("no12"));
+
+	// including the items of lists and the contents of maps
+	data["list"] = QVariantList() << 3 << 4;
+	context = Mustache::QtVariantContext(data, &partialMap);
+	QCOMPARE(renderer.render(sectionTemplate, &context), QString("no34"));
+	QVariantHash user;
+	user["name"] = "dan";
+	data["user"] = user;
+	context = Mustache::QtVariantContext(data, &partialMap);
+	QCOMPARE(renderer.render("{{#user|cache}}{{name}}{{/user}}", &context), QString("dan"));
+	user["name"] = "eve";
+	data["user"] = user;
+	context = Mustache::QtVariantContext(data, &partialMap);
+	QCOMPARE(renderer.render("{{#user|cache}}{{name}}{{/user}}", &context), QString("eve"));
+
+	// lists whose items are produced one at a time are only cached with explicit dependencies
+	int first = 0;
+	data["rows"] = QVariant::fromValue(Mustache::LazySequence([&first](int index, QVariant* item) {
+		*item = first + index;
+		return index < 2;
+	}));
+	context = Mustache::QtVariantContext(data, &partialMap);
+	QCOMPARE(renderer.render("{{#rows|cache}}{{.}}{{/rows}}", &context), QString("01"));
+	first = 3;
+	context = Mustache::QtVariantContext(data, &partialMap);
+	QCOMPARE(renderer.render("{{#rows|cache}}{{.}}{{/rows}}", &context), QString("34"));
+	data["user"] = "carol";
+
+	// so is the escaper which values are escaped with
+	data["nav"] = "\"q\"";
+	context = Mustache::QtVariantContext(data, &partialMap);
+	QCOMPARE(renderer.render("{{#nav|cache}}{{.}}{{/nav}}", &context), QString("&quot;q&quot;"));
+	renderer.setEscaper(Mustache::Escaper::json());
+	QCOMPARE(renderer.render("{{#nav|cache}}{{.}}{{/nav}}", &context), QString("\\\"q\\\""));
+	renderer.setEscaper(Mustache::Escaper::html());
+
+	// without a cache the annotation has no effect
+	renderer.setFragmentCache(0);
+	data["nav"] = true;
+	context = Mustache::QtVariantContext(data, &partialMap);
+	QCOMPARE(renderer.render(_template, &context), QString("<carol:2>(2)"));
+
+	// the least recently used output is discarded when the cache is full
+	cache.clear();
+	cache.setMaxSize(5);
+	cache.insert("a", "abc");
+	cache.insert("b", "def");
+	QString output;
+	QVERIFY(!cache.find("a", &output));
+	QVERIFY(cache.find("b", &output));
+	QCOMPARE(output, QString("def"));
+	QCOMPARE(cache.size(), 3);
+}
+
+void TestMustache::testTemplateRegistry()
+{
+	Mustache::TemplateRegistry registry;
+	QCOMPARE(registry.snapshot().version(), 0);
+	QVERIFY(registry.snapshot().names().isEmpty());
+
+	QHash<QString, QString> templates;
+	templates["page"] = "v1 {{>item}}";
+	templates["item"] = "{{name}}[{{#children}}{{>item}}{{/children}}]";
+	QVERIFY(registry.publish(templates));
+
+	// a render which is in progress keeps the version it started with
+	Mustache::TemplateSnapshot pinned = registry.snapshot();
+	QCOMPARE(pinned.version(), 1);
+
+	templates["page"] = "v2 {{>item}}";
+	templates["item"] = "{{name}}";
+	QVERIFY(registry.publish(templates));
+	QCOMPARE(registry.snapshot().version(), 2);
+
+	QVariantHash leaf;
+	leaf["name"] = "leaf";
+	leaf["children"] = false;
+	QVariantHash root;
+	root["name"] = "root";
+	root["children"] = QVariantList() << leaf;
+
+	Mustache::Renderer renderer;
+	Mustache::QtVariantContext oldContext(root, &pinned);
+	QCOMPARE(renderer.render(pinned.value("page"), &oldContext), QString("v1 root[leaf[]]"));
+
+	Mustache::TemplateSnapshot current = registry.snapshot();
+	Mustache::QtVariantContext newContext(root, &current);
+	QCOMPARE(renderer.render(current.value("page"), &newContext), QString("v2 root"));
+
+	// a set with an error is not published
+	templates["page"] = "{{#unclosed}}";
+	QString error;
+	QVERIFY(!registry.publish(templates, &error));
+	QVERIFY(error.startsWith("page: "));
+	QCOMPARE(registry.snapshot().version(), 2);
+	QCOMPARE(registry.snapshot().getPartial("page"), QString("v2 {{>item}}"));
+	QVERIFY(!registry.snapshot().contains("missing"));
+}
+
+void TestMustache::testWarmUpPartials()
+{
+	QHash<QString, QString> partials;
+	partials["page"] = "<{{>header}}|{{#items}}{{>item}}{{/items}}>";
+	partials["header"] = "{{title}}{{>logo}}";
+	partials["item"] = "{{name}}{{#children}}{{>item}}{{/children}}";
+	partials["logo"] = "!";
+	Mustache::PartialMap partialMap(partials);
+	Mustache::Renderer renderer;
+
+	Mustache::Template compiled = renderer.compile("{{>page}}{{>footer}}{{>page}}");
+	QCOMPARE(compiled.partialNames(), QStringList() << "page" << "footer");
+
+	// partials are found transitively, including missing and recursive ones
+	QStringList names = renderer.warmUpPartials(compiled, &partialMap);
+	QCOMPARE(names, QStringList() << "page" << "footer" << "header" << "item" << "logo");
+
+	QVariantHash child;
+	child["name"] = "b";
+	child["children"] = false;
+	QVariantHash item;
+	item["name"] = "a";
+	item["children"] = QVariantList() << child;
+	QVariantHash data;
+	data["title"] = "T";
+	data["items"] = QVariantList() << item;
+	Mustache::QtVariantContext context(data, &partialMap);
+	QCOMPARE(renderer.render(compiled, &context), QString("<T!|ab><T!|ab>"));
+	QCOMPARE(renderer.errorPos(), -1);
+
+	// partials with indented standalone tags are compiled for that indentation
+	partials["list"] = "  {{>logo}}\n";
+	Mustache::PartialMap indentedMap(partials);
+	names = renderer.warmUpPartials(renderer.compile("{{>list}}"), &indentedMap);
+	QCOMPARE(names, QStringList() << "list" << "logo");
+}
+
+/** An output sink which records each write and fails after a number of writes. */
+class RecordingSink : public Mustache::OutputSink
+{
+public:
+	explicit RecordingSink(int maxWrites = -1)
+		: m_maxWrites(maxWrites)
+	{}
+
+	virtual bool write(const QString& text)
+	{
+		if (writes.count() == m_maxWrites) {
+			return false;
+		}
+		writes << text;
+		return true;
+	}
+
+	QStringList writes;
+
+private:
+	int m_maxWrites;
+};
+
+void TestMustache::testOutputSink()
+{
+	QVariantHash data;
+	QStringList list;
+	for (int i = 0; i < 100; i++) {
+		list << "abc";
+	}
+	data["list"] = list;
+	Mustache::QtVariantContext context(data);
+	Mustache::Renderer renderer;
+	Mustache::Template compiled = renderer.compile("{{#list}}{{.}}{{/list}}");
+
+	// output is written once the threshold is reached
+	RecordingSink sink;
+	renderer.setFlushThreshold(10);
+	renderer.render(compiled, &context, &sink);
+	QCOMPARE(renderer.errorPos(), -1);
+	QCOMPARE(sink.writes.count(), 25);
+	QCOMPARE(sink.writes.join(QString()), QString("abc").repeated(100));
+
+	// or after each list item
+	RecordingSink itemSink;
+	renderer.setFlushThreshold(1000);
+	renderer.setFlushAtListItems(true);
+	renderer.render(compiled, &context, &itemSink);
+	QCOMPARE(itemSink.writes, list);
+	renderer.setFlushAtListItems(false);
+
+	// the output length limit includes output which was already written
+	RecordingSink limitedSink;
+	renderer.setFlushThreshold(3);
+	renderer.setMaxOutputLength(10);
+	renderer.render(compiled, &context, &limitedSink);
+	QCOMPARE(renderer.error(), QString("Maximum output length exceeded"));
+	QCOMPARE(limitedSink.writes.join(QString()), QString("abc").repeated(4));
+	renderer.setMaxOutputLength(0);
+
+	// rendering stops if the output cannot be written
+	RecordingSink failingSink(2);
+	renderer.render(compiled, &context, &failingSink);
+	QCOMPARE(renderer.error(), QString("Failed to write output"));
+	QCOMPARE(failingSink.writes.count(), 2);
+
+	QBuffer buffer;
+	buffer.open(QIODevice::WriteOnly);
+	Mustache::IODeviceSink deviceSink(&buffer);
+	QVariantHash nameData;
+	nameData["name"] = "abc";
+	Mustache::QtVariantContext nameContext(nameData);
+	renderer.render(renderer.compile(QString::fromUtf8("caf\xc3\xa9 {{name}}")), &nameContext, &deviceSink);
+	QCOMPARE(buffer.data(), QByteArray("caf\xc3\xa9 abc"));
+}
+
+void TestMustache::testSegmentedOutput()
+{
+	QVariantHash data;
+	data["name"] = "<World>";
+	data["items"] = QStringList() << "a" << "b";
+	QHash<QString, QString> partials;
+	partials["item"] = "({{.}})";
+	Mustache::PartialMap partialMap(partials);
+	Mustache::QtVariantContext context(data, &partialMap);
+	Mustache::Renderer renderer;
+
+	Mustache::SegmentedOutput output;
+	QString expected;
+	{
+		Mustache::Template compiled = renderer.compile("Hello {{name}}!{{#items}} {{>item}}{{/items}}");
+		expected = renderer.render(compiled, &context);
+		renderer.render(compiled, &context, &output);
+		QCOMPARE(renderer.errorPos(), -1);
+
+		// text refers to the template rather than being copied
+		QCOMPARE(output.segment(0).toString(), QString("Hello "));
+		QCOMPARE(output.segment(0).data(), compiled.source().constData());
+		QCOMPARE(output.segment(1).toString(), QString("&lt;World&gt;"));
+	}
+
+	// the segments remain valid when the template is destroyed
+	QCOMPARE(expected, QString("Hello &lt;World&gt;! (a) (b)"));
+	QCOMPARE(output.join(), expected);
+	QCOMPARE(output.length(), expected.length());
+	QCOMPARE(output.count(), 11);
+
+	QBuffer buffer;
+	buffer.open(QIODevice::WriteOnly);
+	QVERIFY(output.writeTo(&buffer));
+	QCOMPARE(buffer.data(), expected.toUtf8());
+
+	output.clear();
+	QCOMPARE(output.count(), 0);
+	QCOMPARE(output.join(), QString());
+}
+
+void TestMustache::testContextReset()
+{
+	QVariantHash first;
+	first["name"] = "first";
+	first["list"] = QStringList() << "a" << "b";
+	QVariantHash second;
+	second["name"] = "second";
+
+	Mustache::QtVariantContext context(first);
+	context.push("list", 1);
+	QCOMPARE(context.stringValue("."), QString("b"));
+	context.reset(second);
+	QCOMPARE(context.stringValue("name"), QString("second"));
+	QCOMPARE(context.stringValue("list"), QString());
+
+	Mustache::Renderer* renderer = Mustache::Renderer::threadLocal();
+	QVERIFY(renderer);
+	QCOMPARE(Mustache::Renderer::threadLocal(), renderer);
+	QCOMPARE(renderer->render("{{name}}", &context), QString("second"));
+}
+
+QVariantHash nestedListData(int groupCount, int itemCount)
+{
+	QVariantList groups;
+	for (int i = 0; i < groupCount; i++) {
+		QVariantList items;
+		for (int j = 0; j < itemCount; j++) {
+			QVariantHash item;
+			item["name"] = QString("item %1.%2").arg(i).arg(j);
+			item["price"] = j;
+			items << item;
+		}
+		QVariantHash group;
+		group["title"] = QString("group %1").arg(i);
+		group["items"] = items;
+		groups << group;
+	}
+	QVariantHash data;
+	data["siteName"] = "Shop";
+	data["currency"] = "EUR";
+	data["groups"] = groups;
+	return data;
+}
+
+const char nestedListTemplate[] =
+	"{{#groups}}{{title}}:{{#items}} {{siteName}}/{{title}}/{{name}} {{price}} {{currency}}{{missing}};{{/items}}\n{{/groups}}";
+
+void TestMustache::testNestedListLookup()
+{
+	QVariantHash data = nestedListData(2, 2);
+	// a key in an inner frame shadows the same key in the outer frames
+	data["title"] = "outer";
+
+	Mustache::Renderer renderer;
+	Mustache::QtVariantContext context(data);
+	Mustache::Template compiled = renderer.compile(nestedListTemplate);
+	QString expected = "group 0: Shop/group 0/item 0.0 0 EUR; Shop/group 0/item 0.1 1 EUR;\n"
+	                   "group 1: Shop/group 1/item 1.0 0 EUR; Shop/group 1/item 1.1 1 EUR;\n";
+	QCOMPARE(renderer.render(compiled, &context), expected);
+
+	// cached lookups are not reused once the frames they came from are popped
+	QCOMPARE(renderer.render(compiled, &context), expected);
+	QCOMPARE(renderer.render("{{#groups}}{{title}} {{/groups}}{{title}}", &context), QString("group 0 group 1 outer"));
+}
+
+void TestMustache::benchmarkNestedLists()
+{
+	QVariantHash data = nestedListData(100, 100);
+	Mustache::Renderer renderer;
+	Mustache::Template compiled = renderer.compile(nestedListTemplate);
+
+	QBENCHMARK {
+		Mustache::QtVariantContext context(data);
+		renderer.render(compiled, &context);
+	}
+}
+
+/** Renders a template a number of times, either with objects which are
+ * reused or with new objects for each render.
+ */
+class RenderTask : public QRunnable
+{
+public:
+	RenderTask(const Mustache::Template& _template, const QVariantHash& data, bool pooled)
+		: m_template(_template)
+		, m_data(data)
+		, m_pooled(pooled)
+	{}
+
+	virtual void run()
+	{
+		Mustache::QtVariantContext pooledContext(m_data);
+		for (int i = 0; i < 100; i++) {
+			if (m_pooled) {
+				pooledContext.reset(m_data);
+				Mustache::Renderer::threadLocal()->render(m_template, &pooledContext);
+			} else {
+				Mustache::QtVariantContext context(m_data);
+				Mustache::Renderer renderer;
+				renderer.render(m_template, &context);
+			}
+		}
+	}
+
+private:
+	Mustache::Template m_template;
+	QVariantHash m_data;
+	bool m_pooled;
+};
+
+void TestMustache::benchmarkPooledRendering_data()
+{
+	QTest::addColumn<bool>("pooled");
+	QTest::newRow("fresh") << false;
+	QTest::newRow("pooled") << true;
+}
+
+void TestMustache::benchmarkPooledRendering()
+{
+	QFETCH(bool, pooled);
+	QVariantHash data = nestedListData(5, 5);
+	Mustache::Renderer renderer;
+	Mustache::Template compiled = renderer.compile(nestedListTemplate);
+
+	QThreadPool pool;
+	QBENCHMARK {
+		for (int i = 0; i < 4 * pool.maxThreadCount(); i++) {
+			pool.start(new RenderTask(compiled, data, pooled));
+		}
+		pool.waitForDone();
+	}
+}
+
+void TestMustache::benchmarkCompileLiteral()
+{
+	// a large template which is mostly literal text
+	QString paragraph = "Lorem ipsum dolor sit amet, consectetur adipiscing elit { sed do } eiusmod tempor.\n";
+	QString _template;
+	for (int i = 0; i < 2000; i++) {
+		_template += paragraph.repeated(10) + "{{value}}\n";
+	}
+
+	Mustache::Renderer renderer;
+	QBENCHMARK {
+		renderer.compile(_template);
+	}
+	QCOMPARE(renderer.compile(_template).nodes().count(), 4001);
+}
+
+#if QT_VERSION >= 0x050000 // JSON classes only in Qt 5+.
+
+void TestMustache::testConformance_data()
+{
+	addSpecTestRows();
 }
 
 /*
@@ -528,6 +1805,12 @@ void TestMustache::testConformance()
 	QString output = renderer.render(template_, &context);
 
 	QCOMPARE(output, expected);
+
+	// check that the binary form of the compiled template renders identically
+	Mustache::Template compiled = Mustache::Template::fromBinary(renderer.compile(template_).toBinary());
+	output = renderer.render(compiled, &context);
+
+	QCOMPARE(output, expected);
 }
 
 #endif // QT_VERSION >= 0x050000
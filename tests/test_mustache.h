@@ -26,21 +26,48 @@ private Q_SLOTS:
 	void testContextLookup();
 	void testErrors();
 	void testPartialFile();
+	void testMappedPartialFile();
+	void testMemoryUsage();
 	void testPartials();
 	void testSections();
 	void testSectionQString();
 	void testFalsiness();
 	void testFloatValues();
+	void testNumberFormat();
 	void testSetDelimiters();
 	void testValues();
 	void testEscaping();
+	void testSafeValues();
+	void testEscapers();
 	void testEval();
 	void testHelpers();
 	void testIncompleteTag();
 	void testIncompleteSection();
 	void testLambda();
+	void testSectionLambda();
 	void testQStringListIteration();
+	void testLazyValues();
 	void testUnescapeHtml();
+	void testCompiledTemplate();
+	void testBinaryTemplate();
+	void testInlinePartials();
+	void testVerification();
+	void testSharedTemplateStore();
+	void testResolve();
+	void testNestedListLookup();
+	void benchmarkNestedLists();
+	void testMaxDepth();
+	void testBudgets();
+	void benchmarkCompileLiteral();
+	void testContextStack();
+	void testFragmentCache();
+	void testWarmUpPartials();
+	void testTemplateRegistry();
+	void testOutputSink();
+	void testSegmentedOutput();
+	void testContextReset();
+	void benchmarkPooledRendering();
+	void benchmarkPooledRendering_data();
 #if QT_VERSION >= 0x050000
 	void testConformance();
 	void testConformance_data();
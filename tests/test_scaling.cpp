@@ -0,0 +1,283 @@
+/*
+  Copyright 2012, Robert Knight
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+*/
+
+#include "test_scaling.h"
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QString>
+#include <QStringList>
+
+#include <atomic>
+#include <functional>
+#include <limits>
+
+#include <stdlib.h>
+
+// The inputs grow 16 times between the smallest and the largest size, so
+// linear growth multiplies the time or memory by about 16 and quadratic growth
+// by 256. The limit allows twice the linear growth, for timing noise and for
+// buffers which grow in steps.
+const int GrowthSteps = 4;
+const double MaxGrowth = 32;
+
+// Each time is measured over repeated runs lasting at least this long, so that
+// the smallest sizes are not dominated by timer resolution and scheduling noise.
+const qint64 MinMeasuredTime = 20 * 1000 * 1000;
+
+std::atomic<qint64> allocationCount(0);
+std::atomic<qint64> allocatedBytes(0);
+
+// Sanitizers intercept the allocation functions themselves, so they cannot be
+// replaced in sanitized builds.
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define MUSTACHE_SANITIZED
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer) || __has_feature(memory_sanitizer)
+#define MUSTACHE_SANITIZED
+#endif
+#endif
+
+#if defined(__GLIBC__) && !defined(MUSTACHE_SANITIZED)
+// Qt's containers allocate with malloc() rather than operator new, so
+// allocations are counted by replacing malloc(), which glibc supports through
+// symbol interposition, and forwarding to glibc's own implementation. operator
+// new is counted too, since it calls malloc(). Elsewhere the allocation checks
+// are skipped, see testAllocationCounting().
+const bool CountsAllocations = true;
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) noexcept
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	allocatedBytes.fetch_add(qint64(size), std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) noexcept
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	allocatedBytes.fetch_add(qint64(count * size), std::memory_order_relaxed);
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) noexcept
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	allocatedBytes.fetch_add(qint64(size), std::memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+}
+#else
+const bool CountsAllocations = false;
+#endif
+
+/** The quantities which verifyScaling() checks for an operation. */
+enum Measure
+{
+	Time,
+	Allocations,
+	AllocatedBytes
+};
+
+/** Returns the shortest time in nanoseconds which one run of @p function took. */
+qint64 shortestTime(const std::function<void()>& function)
+{
+	qint64 best = std::numeric_limits<qint64>::max();
+	for (int i = 0; i < 3; i++) {
+		QElapsedTimer timer;
+		timer.start();
+		int runs = 0;
+		do {
+			function();
+			runs++;
+		} while (timer.nsecsElapsed() < MinMeasuredTime);
+		best = qMin(best, timer.nsecsElapsed() / runs);
+	}
+	return qMax(best, qint64(1));
+}
+
+/** Returns @p measure for one run of @p function.  The number of allocations and
+ * the bytes allocated do not depend on timing, so they are taken from a single run.
+ */
+qint64 measureRun(Measure measure, const std::function<void()>& function)
+{
+	if (measure == Time) {
+		return shortestTime(function);
+	}
+	const qint64 count = allocationCount.load();
+	const qint64 bytes = allocatedBytes.load();
+	function();
+	return measure == Allocations ? allocationCount.load() - count : allocatedBytes.load() - bytes;
+}
+
+/** Measures @p measure for the smallest and the largest of a series of doubling
+ * sizes starting from @p size and fails if the result grows more than MaxGrowth times.
+ */
+void verifyGrowth(const QString& what, int size, const std::function<qint64(int size)>& measure)
+{
+	measure(size); // warm up
+	const qint64 smallest = qMax(measure(size), qint64(1));
+	const qint64 largest = measure(size << GrowthSteps);
+	const double growth = double(largest) / smallest;
+	QVERIFY2(growth < MaxGrowth, qPrintable(QString("%1 grew %2 times for %3 times the input")
+	                                            .arg(what, QString::number(growth), QString::number(1 << GrowthSteps))));
+}
+
+/** Checks the growth of the time, the number of allocations and the bytes
+ * allocated by @p run, which performs an operation on an input of the given size
+ * and returns the requested measure of it.
+ */
+void verifyScaling(const QString& what, int size, const std::function<qint64(int size, Measure measure)>& run)
+{
+	verifyGrowth("Time to " + what, size, [&run](int size) { return run(size, Time); });
+	if (QTest::currentTestFailed() || !CountsAllocations) {
+		return;
+	}
+	verifyGrowth("Allocations to " + what, size, [&run](int size) { return run(size, Allocations); });
+	if (QTest::currentTestFailed()) {
+		return;
+	}
+	verifyGrowth("Bytes allocated to " + what, size, [&run](int size) { return run(size, AllocatedBytes); });
+}
+
+/*
+ * Checks that allocations are counted, so that the allocation checks of the
+ * other tests cannot pass by counting nothing, and reports that they are
+ * skipped where allocations cannot be counted.
+ */
+void TestScaling::testAllocationCounting()
+{
+	if (!CountsAllocations) {
+		QSKIP("Allocations can only be counted with glibc and without sanitizers, so they are not checked");
+	}
+	const qint64 count = measureRun(Allocations, []() { QString("x").repeated(1000).squeeze(); });
+	QVERIFY(count >= 1);
+	const qint64 bytes = measureRun(AllocatedBytes, []() { QString("x").repeated(1000).squeeze(); });
+	QVERIFY(bytes >= 2000);
+}
+
+void TestScaling::testLongValues()
+{
+	QVariantHash args;
+	std::function<qint64(int, Measure)> renderValue = [&args](int size, Measure measure) {
+		args["value"] = QString("<a href=\"x\">&'</a>").repeated(size);
+		Mustache::Renderer renderer;
+		Mustache::QtVariantContext context(args);
+		return measureRun(measure, [&]() { renderer.render("{{value}} {{{value}}}", &context); });
+	};
+	verifyScaling("render escaped values", 16384, renderValue);
+
+	std::function<qint64(int)> scratchMemory = [&args](int size) {
+		args["value"] = QString("<a href=\"x\">&'</a>").repeated(size);
+		Mustache::Renderer renderer;
+		Mustache::QtVariantContext context(args);
+		renderer.render("{{value}}", &context);
+		return renderer.peakScratchMemory();
+	};
+	verifyGrowth("Scratch memory for escaped values", 16384, scratchMemory);
+}
+
+void TestScaling::testLongPartials()
+{
+	std::function<qint64(int, Measure)> renderPartial = [](int size, Measure measure) {
+		QHash<QString, QString> partials;
+		partials["lines"] = QString("{{name}}\n").repeated(size);
+		Mustache::PartialMap partialMap(partials);
+		QVariantHash args;
+		args["name"] = "line";
+		Mustache::QtVariantContext context(args, &partialMap);
+		return measureRun(measure, [&]() {
+			// a new renderer indents and compiles the partial again each time
+			Mustache::Renderer renderer;
+			renderer.render("  {{>lines}}\n", &context);
+		});
+	};
+	verifyScaling("render an indented partial", 4096, renderPartial);
+}
+
+void TestScaling::testDeepNesting()
+{
+	QVariantHash args;
+	args["flag"] = true;
+	std::function<qint64(int, Measure)> renderNested = [&args](int size, Measure measure) {
+		const QString _template = QString("{{#flag}}").repeated(size) + "x" + QString("{{/flag}}").repeated(size);
+		Mustache::Renderer renderer;
+		renderer.setMaxDepth(0);
+		Mustache::Template compiled = renderer.compile(_template);
+		Mustache::QtVariantContext context(args);
+		return measureRun(measure, [&]() { renderer.render(compiled, &context); });
+	};
+	verifyScaling("render nested sections", 512, renderNested);
+}
+
+void TestScaling::testLongLists()
+{
+	QVariantHash args;
+	std::function<qint64(int, Measure)> renderList = [&args](int size, Measure measure) {
+		QStringList list;
+		for (int i = 0; i < size; i++) {
+			list << QString::number(i);
+		}
+		args["list"] = list;
+		Mustache::Renderer renderer;
+		Mustache::Template compiled = renderer.compile("{{#list}}{{.}},{{/list}}");
+		Mustache::QtVariantContext context(args);
+		return measureRun(measure, [&]() { renderer.render(compiled, &context); });
+	};
+	verifyScaling("render a list", 16384, renderList);
+
+	// contexts which are used through push() rather than pushResolved()
+	std::function<qint64(int, Measure)> pushItems = [&args](int size, Measure measure) {
+		QStringList list;
+		for (int i = 0; i < size; i++) {
+			list << QString::number(i);
+		}
+		args["list"] = list;
+		Mustache::QtVariantContext context(args);
+		return measureRun(measure, [&]() {
+			const int count = context.listCount("list");
+			for (int i = 0; i < count; i++) {
+				context.push("list", i);
+				context.stringValue(".");
+				context.pop();
+			}
+		});
+	};
+	verifyScaling("push the items of a list", 4096, pushItems);
+}
+
+void TestScaling::testManyTags()
+{
+	std::function<qint64(int, Measure)> compileTags = [](int size, Measure measure) {
+		const QString _template = QString("{{#a}} {{b}}\n  {{! c }}\n{{/a}}\n").repeated(size);
+		return measureRun(measure, [&]() {
+			Mustache::Renderer renderer;
+			renderer.compile(_template);
+		});
+	};
+	verifyScaling("compile a template", 2048, compileTags);
+
+	std::function<qint64(int)> templateMemory = [](int size) {
+		Mustache::Renderer renderer;
+		return renderer.compile(QString("{{#a}} {{b}}\n{{/a}}\n").repeated(size)).memoryUsage();
+	};
+	verifyGrowth("Memory used by a compiled template", 2048, templateMemory);
+}
+
+QTEST_GUILESS_MAIN(TestScaling)
@@ -0,0 +1,992 @@
+/*
+  Copyright 2012, Robert Knight
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+*/
+
+#include "test_verification.h"
+#include "spec_tests.h"
+
+#include <QHash>
+#include <QRandomGenerator>
+#include <QString>
+
+/** Returns true if @p value is false for a section, as the renderer defines it. */
+bool isReferenceFalse(const QVariant& value)
+{
+	if (value.userType() == qMetaTypeId<Mustache::LazySequence>()) {
+		QVariant item;
+		return !value.value<Mustache::LazySequence>().next(0, &item);
+	}
+	switch (value.userType()) {
+	case QMetaType::Double:
+	case QMetaType::Float:
+		return value.toDouble() == 0.;
+	case QMetaType::QChar:
+	case QMetaType::Int:
+	case QMetaType::UInt:
+	case QMetaType::LongLong:
+	case QMetaType::ULongLong:
+	case QMetaType::Bool:
+		return !value.toBool();
+	case QMetaType::QVariantList:
+	case QMetaType::QStringList:
+		return value.toList().isEmpty();
+	case QMetaType::QVariantHash:
+		return value.toHash().isEmpty();
+	case QMetaType::QVariantMap:
+		return value.toMap().isEmpty();
+	default:
+		return value.toString().isEmpty();
+	}
+}
+
+/** The context which the reference renderer reads the data from.
+ *
+ * It looks up each key by searching a stack of plain QVariants, without the
+ * frames, lookup caches or resolve() of QtVariantContext, so that verification
+ * does not depend on them.
+ */
+class ReferenceContext : public Mustache::Context
+{
+public:
+	ReferenceContext(const QVariant& data, Mustache::PartialResolver* resolver)
+		: Mustache::Context(resolver)
+	{
+		m_stack << data;
+	}
+
+	virtual QString stringValue(const QString& key) const
+	{
+		return value(key).toString();
+	}
+
+	virtual QVariant variantValue(const QString& key) const
+	{
+		return value(key);
+	}
+
+	virtual bool isFalse(const QString& key) const
+	{
+		return isReferenceFalse(value(key));
+	}
+
+	virtual int listCount(const QString& key) const
+	{
+		const QVariant list = value(key);
+		if (list.userType() == qMetaTypeId<Mustache::LazySequence>()) {
+			const Mustache::LazySequence sequence = list.value<Mustache::LazySequence>();
+			QVariant item;
+			int count = 0;
+			while (sequence.next(count, &item)) {
+				++count;
+			}
+			return count;
+		}
+		return list.canConvert<QVariantList>() && list.userType() != QMetaType::QString ? list.toList().count() : 0;
+	}
+
+	virtual void push(const QString& key, int index)
+	{
+		QVariant item = value(key);
+		if (index >= 0 && item.userType() == qMetaTypeId<Mustache::LazySequence>()) {
+			const Mustache::LazySequence sequence = item.value<Mustache::LazySequence>();
+			item = QVariant();
+			sequence.next(index, &item);
+		} else if (index >= 0) {
+			item = item.toList().value(index);
+		}
+		m_stack << item;
+	}
+
+	virtual void pop()
+	{
+		m_stack.removeLast();
+	}
+
+	virtual bool canEval(const QString& key) const
+	{
+		const QVariant fn = value(key);
+		return fn.canConvert<Mustache::QtVariantContext::fn_t>() || fn.canConvert<Mustache::QtVariantContext::section_fn_t>();
+	}
+
+	virtual QString eval(const QString& key, const QString& _template, Mustache::Renderer* renderer)
+	{
+		const QVariant fn = value(key);
+		if (fn.canConvert<Mustache::QtVariantContext::section_fn_t>()) {
+			// Section functions need a compiled section, so they cannot be
+			// called without the compiler.
+			Mustache::TemplateSection section(renderer->compile(_template), renderer);
+			return fn.value<Mustache::QtVariantContext::section_fn_t>()(section, this);
+		} else if (fn.canConvert<Mustache::QtVariantContext::fn_t>()) {
+			return fn.value<Mustache::QtVariantContext::fn_t>()(_template, renderer, this);
+		}
+		return QString();
+	}
+
+private:
+	static QVariant evaluate(const QVariant& value)
+	{
+		if (value.userType() == qMetaTypeId<Mustache::LazyValue>()) {
+			return value.value<Mustache::LazyValue>().value();
+		}
+		return value;
+	}
+
+	QVariant value(const QString& key) const
+	{
+		if (key == QLatin1String(".")) {
+			return evaluate(m_stack.last());
+		}
+		const QStringList keyPath = key.split(QLatin1Char('.'));
+		for (int i = m_stack.count() - 1; i >= 0; i--) {
+			QVariant current = m_stack.at(i);
+			int part = 0;
+			for (; part < keyPath.count(); part++) {
+				if (current.userType() == QMetaType::QVariantMap) {
+					current = evaluate(current.toMap().value(keyPath.at(part)));
+				} else {
+					current = evaluate(current.toHash().value(keyPath.at(part)));
+				}
+				if (current.isNull()) {
+					break;
+				}
+			}
+			if (part == keyPath.count()) {
+				return current;
+			}
+		}
+		return QVariant();
+	}
+
+	QVector<QVariant> m_stack;
+};
+
+/** A tag found by the reference renderer's scanner. */
+struct ReferenceTag
+{
+	ReferenceTag()
+		: sigil(0)
+		, start(-1)
+		, end(-1)
+		, indentation(0)
+		, precision(-1)
+		, grouping(false)
+	{}
+
+	/// '#', '^', '/', '>', '!', '=', '&' or '{' for the kind of tag, or 0 for values
+	char sigil;
+	QString key;
+	/// The range of the tag in the source, including the rest of its line if it
+	/// stands alone on it
+	int start;
+	int end;
+	int indentation;
+	int precision;
+	bool grouping;
+};
+
+/** Returns true if @p text only contains whitespace. */
+bool isBlank(const QString& text)
+{
+	for (int i = 0; i < text.length(); i++) {
+		if (!text.at(i).isSpace()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/** Returns the first word of @p text. */
+QString firstWord(const QString& text)
+{
+	const QString trimmed = text.trimmed();
+	int length = 0;
+	while (length < trimmed.length() && !trimmed.at(length).isSpace()) {
+		++length;
+	}
+	return trimmed.left(length);
+}
+
+/** Indents every line of @p text after the first by @p indentation spaces,
+ * except for an empty line after a final line break. Text which starts with
+ * a line break is not indented at all, as by the original renderer.
+ */
+QString indentReferencePartial(const QString& text, int indentation)
+{
+	if (indentation <= 0 || text.startsWith(QLatin1Char('\n'))) {
+		return text;
+	}
+	const QStringList lines = text.split(QLatin1Char('\n'));
+	QString result = lines.first();
+	for (int i = 1; i < lines.count(); i++) {
+		result += QLatin1Char('\n');
+		if (i < lines.count() - 1 || !lines.at(i).isEmpty()) {
+			result += QString(indentation, QLatin1Char(' '));
+		}
+		result += lines.at(i);
+	}
+	return result;
+}
+
+/** Reads a number format, such as ',.2', from the end of the key of @p tag. */
+void readReferenceFormat(ReferenceTag& tag)
+{
+	const int formatPos = tag.key.lastIndexOf(QLatin1Char('|'));
+	if (formatPos <= 0) {
+		return;
+	}
+	const QString format = tag.key.mid(formatPos + 1);
+	const bool grouping = format.startsWith(QLatin1Char(','));
+	const QString decimals = format.mid(grouping ? 1 : 0);
+	int precision = -1;
+	if (decimals.startsWith(QLatin1Char('.'))) {
+		if (decimals.length() < 2 || decimals.length() > 3) {
+			return;
+		}
+		precision = 0;
+		for (int i = 1; i < decimals.length(); i++) {
+			if (!decimals.at(i).isDigit()) {
+				return;
+			}
+			precision = precision * 10 + decimals.at(i).digitValue();
+		}
+	} else if (!decimals.isEmpty() || !grouping) {
+		return;
+	}
+	tag.key.truncate(formatPos);
+	tag.precision = precision;
+	tag.grouping = grouping;
+}
+
+/** Inserts commas between the thousands of the first run of digits in @p number. */
+void groupReferenceDigits(QString& number)
+{
+	int pos = number.startsWith(QLatin1Char('-')) ? 1 : 0;
+	int end = pos;
+	while (end < number.length() && number.at(end).isDigit()) {
+		++end;
+	}
+	for (int i = end - 3; i > pos; i -= 3) {
+		number.insert(i, QLatin1Char(','));
+	}
+}
+
+/** Renders templates the way the original renderer did, by scanning the source
+ * of each section for its tags and rendering its body by recursion, and loading
+ * each partial and scanning its source again whenever it is included.
+ *
+ * It has its own scanner and number formatting and does not use the compiler or
+ * the render loop of Mustache::Renderer, so that they can be checked against it.
+ * The output is compared with the output being verified as it is produced, so
+ * the tag which wrote the first character that differs is known without
+ * rendering again.
+ */
+class ReferenceRenderer
+{
+public:
+	ReferenceRenderer(Mustache::Renderer* renderer, const QString& actual, const Mustache::Escaper* escaper)
+		: m_renderer(renderer)
+		, m_actual(actual)
+		, m_escaper(escaper)
+		, m_maxDepth(renderer->maxDepth())
+		, m_length(0)
+		, m_errorPos(-1)
+		, m_mismatch(-1)
+		, m_mismatchPos(-1)
+	{}
+
+	/** Renders @p source, compares it with the actual output and sets the error
+	 * or mismatch which is found, if any.
+	 */
+	void render(const QString& source, Mustache::Context* context)
+	{
+		setDefaultMarkers();
+		render(source, 0, source.length(), context, 0);
+		if (m_errorPos == -1 && m_mismatch == -1 && m_length != m_actual.length()) {
+			// The actual output continues after the end of the reference output.
+			m_mismatch = m_length;
+			m_mismatchPos = source.length();
+		}
+	}
+
+	QString error() const { return m_error; }
+	int errorPos() const { return m_errorPos; }
+	QString errorPartial() const { return m_errorPartial; }
+
+	/** Returns the index of the first character which differs from the actual
+	 * output, or -1 if there is none.
+	 */
+	int mismatch() const { return m_mismatch; }
+	/** Returns the position of the tag or text which wrote that character. */
+	int mismatchPos() const { return m_mismatchPos; }
+	QString mismatchPartial() const { return m_mismatchPartial; }
+
+private:
+	void setDefaultMarkers()
+	{
+		m_startMarker = "{{";
+		m_endMarker = "}}";
+	}
+
+	void render(const QString& source, int startPos, int endPos, Mustache::Context* context, int depth);
+	void renderSection(const QString& source, const ReferenceTag& tag, int endPos, Mustache::Context* context, int depth,
+	                   int* next);
+	bool enter(int depth, int pos);
+	void append(const QString& text, int pos);
+	void appendValue(const ReferenceTag& tag, Mustache::Context* context);
+	void setError(const QString& error, int pos);
+
+	ReferenceTag scan(const QString& source, int pos, int endPos);
+	ReferenceTag findEndTag(const QString& source, const ReferenceTag& startTag, int endPos);
+
+	Mustache::Renderer* m_renderer;
+	const QString& m_actual;
+	const Mustache::Escaper* m_escaper;
+	const int m_maxDepth;
+
+	QString m_startMarker;
+	QString m_endMarker;
+	QStringList m_partials;
+	int m_length;
+
+	QString m_error;
+	int m_errorPos;
+	QString m_errorPartial;
+	int m_mismatch;
+	int m_mismatchPos;
+	QString m_mismatchPartial;
+};
+
+/** Returns the next tag in @p source between @p pos and @p endPos, or a tag
+ * with a start of -1 if there is none. Set delimiter tags change the markers.
+ */
+ReferenceTag ReferenceRenderer::scan(const QString& source, int pos, int endPos)
+{
+	ReferenceTag tag;
+	const int start = source.indexOf(m_startMarker, pos);
+	if (start == -1 || start >= endPos) {
+		return tag;
+	}
+	const int contentStart = start + m_startMarker.length();
+	const int close = source.indexOf(m_endMarker, contentStart);
+	if (close == -1) {
+		return tag;
+	}
+	tag.start = start;
+	tag.end = close + m_endMarker.length();
+
+	const QString content = source.mid(contentStart, close - contentStart);
+	const char sigil = content.isEmpty() ? 0 : content.at(0).toLatin1();
+	switch (sigil) {
+	case '#':
+	case '^':
+	case '/':
+	case '>':
+		tag.sigil = sigil;
+		tag.key = firstWord(content.mid(1));
+		break;
+	case '!':
+		tag.sigil = sigil;
+		break;
+	case '=':
+	{
+		tag.sigil = sigil;
+		QString markers = content.mid(1);
+		if (markers.endsWith(QLatin1Char('='))) {
+			markers.chop(1);
+		}
+		const QStringList parts = markers.simplified().split(QLatin1Char(' '));
+		if (markers.contains(QLatin1Char('='))) {
+			setError("Custom delimiters may not contain '='.", start);
+		} else {
+			m_startMarker = parts.value(0);
+			m_endMarker = parts.value(1);
+		}
+	}
+	break;
+	case '&':
+		tag.sigil = sigil;
+		tag.key = firstWord(content.mid(1));
+		break;
+	case '{':
+	{
+		// The closing brace of a triple mustache follows the end marker.
+		tag.sigil = sigil;
+		const int brace = source.indexOf(QLatin1Char('}'), contentStart + 1);
+		if (brace == close) {
+			++tag.end;
+			tag.key = firstWord(content.mid(1));
+		} else if (brace != -1) {
+			tag.key = firstWord(source.mid(contentStart + 1, brace - contentStart - 1));
+		}
+	}
+	break;
+	default:
+		tag.key = firstWord(content);
+		break;
+	}
+
+	if (tag.sigil == 0 || tag.sigil == '&' || tag.sigil == '{') {
+		readReferenceFormat(tag);
+		return tag;
+	}
+
+	if (tag.sigil == '#' || tag.sigil == '^' || tag.sigil == '>') {
+		// Cache annotations only affect the fragment cache, which the reference does not use.
+		const int annotationPos = tag.key.lastIndexOf(QLatin1String("|cache"));
+		if (annotationPos > 0 && (tag.key.length() == annotationPos + 6 || tag.key.at(annotationPos + 6) == ':')) {
+			tag.key.truncate(annotationPos);
+		}
+	}
+
+	// Tags other than values which stand alone on their line take the whole line.
+	const int lineStart = start > 0 ? source.lastIndexOf(QLatin1Char('\n'), start - 1) + 1 : 0;
+	int lineEnd = source.indexOf(QLatin1Char('\n'), tag.end);
+	lineEnd = lineEnd == -1 ? source.length() : lineEnd + 1;
+	const QString before = source.mid(lineStart, start - lineStart);
+	if (isBlank(before) && isBlank(source.mid(tag.end, lineEnd - tag.end))) {
+		tag.start = lineStart;
+		tag.end = qMax(lineEnd, tag.end);
+		for (int i = 0; i < before.length(); i++) {
+			if (before.at(i).category() == QChar::Separator_Space) {
+				++tag.indentation;
+			}
+		}
+	}
+	return tag;
+}
+
+ReferenceTag ReferenceRenderer::findEndTag(const QString& source, const ReferenceTag& startTag, int endPos)
+{
+	int depth = 1;
+	int pos = startTag.end;
+	while (m_errorPos == -1) {
+		ReferenceTag tag = scan(source, pos, endPos);
+		if (tag.start == -1) {
+			return tag;
+		} else if (tag.sigil == '#' || tag.sigil == '^') {
+			++depth;
+		} else if (tag.sigil == '/' && --depth == 0) {
+			if (tag.key != startTag.key) {
+				setError("Tag start/end key mismatch", tag.start);
+				return ReferenceTag();
+			}
+			return tag;
+		}
+		pos = tag.end;
+	}
+	return ReferenceTag();
+}
+
+void ReferenceRenderer::render(const QString& source, int startPos, int endPos, Mustache::Context* context, int depth)
+{
+	int pos = startPos;
+	while (m_errorPos == -1) {
+		ReferenceTag tag = scan(source, pos, endPos);
+		if (m_errorPos != -1) {
+			break;
+		}
+		if (tag.start == -1) {
+			append(source.mid(pos, endPos - pos), pos);
+			break;
+		}
+		append(source.mid(pos, tag.start - pos), pos);
+		pos = tag.end;
+
+		switch (tag.sigil) {
+		case 0:
+		case '&':
+		case '{':
+			appendValue(tag, context);
+			break;
+		case '#':
+		case '^':
+			renderSection(source, tag, endPos, context, depth, &pos);
+			break;
+		case '/':
+			setError("Unexpected end tag", tag.start);
+			break;
+		case '>':
+			if (enter(depth, tag.start)) {
+				if (tag.indentation > 0) {
+					append(QString(tag.indentation, QLatin1Char(' ')), tag.start);
+				}
+				const QString partial = indentReferencePartial(context->partialValue(tag.key), tag.indentation);
+				const QString startMarker = m_startMarker;
+				const QString endMarker = m_endMarker;
+				setDefaultMarkers();
+				m_partials << tag.key;
+				render(partial, 0, partial.length(), context, depth + 1);
+				m_partials.removeLast();
+				m_startMarker = startMarker;
+				m_endMarker = endMarker;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/** Renders the section which starts with @p tag and sets @p next to the
+ * position after its end tag.
+ */
+void ReferenceRenderer::renderSection(const QString& source, const ReferenceTag& tag, int endPos,
+                                      Mustache::Context* context, int depth, int* next)
+{
+	// Finding the end tag reads any set delimiter tags in the body, so the
+	// body is rendered with the markers from before it.
+	const QString bodyStartMarker = m_startMarker;
+	const QString bodyEndMarker = m_endMarker;
+	const ReferenceTag endTag = findEndTag(source, tag, endPos);
+	if (endTag.start == -1) {
+		setError(tag.sigil == '#' ? "No matching end tag found for section"
+		                          : "No matching end tag found for inverted section", tag.start);
+		return;
+	}
+	const QString nextStartMarker = m_startMarker;
+	const QString nextEndMarker = m_endMarker;
+	m_startMarker = bodyStartMarker;
+	m_endMarker = bodyEndMarker;
+
+	if (tag.sigil == '^') {
+		if (context->isFalse(tag.key) && enter(depth, tag.start)) {
+			render(source, tag.end, endTag.start, context, depth + 1);
+		}
+	} else {
+		const int listCount = context->listCount(tag.key);
+		if (listCount > 0) {
+			for (int i = 0; i < listCount && m_errorPos == -1 && enter(depth, tag.start); i++) {
+				context->push(tag.key, i);
+				render(source, tag.end, endTag.start, context, depth + 1);
+				context->pop();
+			}
+		} else if (context->canEval(tag.key)) {
+			const QString text = context->eval(tag.key, source.mid(tag.end, endTag.start - tag.end), m_renderer);
+			if (m_renderer->errorPos() != -1) {
+				setError(m_renderer->error(), tag.start);
+			}
+			append(text, tag.start);
+		} else if (!context->isFalse(tag.key) && enter(depth, tag.start)) {
+			context->push(tag.key);
+			render(source, tag.end, endTag.start, context, depth + 1);
+			context->pop();
+		}
+	}
+
+	m_startMarker = nextStartMarker;
+	m_endMarker = nextEndMarker;
+	*next = endTag.end;
+}
+
+/** Returns true if a section or partial at @p pos can be rendered at @p depth. */
+bool ReferenceRenderer::enter(int depth, int pos)
+{
+	if (m_maxDepth > 0 && depth >= m_maxDepth) {
+		setError("Maximum nesting depth exceeded", pos);
+		return false;
+	}
+	return true;
+}
+
+/** Appends @p text, written by the tag or text at @p pos, to the reference output. */
+void ReferenceRenderer::append(const QString& text, int pos)
+{
+	for (int i = 0; i < text.length() && m_mismatch == -1; i++) {
+		if (m_length + i >= m_actual.length() || m_actual.at(m_length + i) != text.at(i)) {
+			m_mismatch = m_length + i;
+			m_mismatchPos = pos;
+			m_mismatchPartial = m_partials.isEmpty() ? QString() : m_partials.last();
+		}
+	}
+	m_length += text.length();
+}
+
+void ReferenceRenderer::appendValue(const ReferenceTag& tag, Mustache::Context* context)
+{
+	const QVariant value = context->variantValue(tag.key);
+	QString text;
+	bool number = true;
+	switch (value.userType()) {
+	case QMetaType::Int:
+	case QMetaType::LongLong:
+		text = QString::number(value.toLongLong());
+		break;
+	case QMetaType::UInt:
+	case QMetaType::ULongLong:
+		text = QString::number(value.toULongLong());
+		break;
+	case QMetaType::Double:
+	case QMetaType::Float:
+		number = qIsFinite(value.toDouble()) && (tag.precision >= 0 || tag.grouping);
+		if (number && tag.precision >= 0) {
+			// Numbers which round to zero are shown without a sign.
+			text = QString::number(value.toDouble(), 'f', tag.precision);
+			const int signAndPoint = tag.precision > 0 ? 2 : 1;
+			if (text.startsWith(QLatin1Char('-')) && text.count(QLatin1Char('0')) == text.length() - signAndPoint) {
+				text.remove(0, 1);
+			}
+		} else {
+			text = value.toString();
+		}
+		break;
+	default:
+		number = false;
+		text = value.toString();
+		break;
+	}
+
+	if (number) {
+		if (tag.precision > 0 && text.indexOf(QLatin1Char('.')) == -1) {
+			text += QLatin1Char('.') + QString(tag.precision, QLatin1Char('0'));
+		}
+		if (tag.grouping) {
+			groupReferenceDigits(text);
+		}
+	} else if (value.userType() != QMetaType::Bool && value.userType() != qMetaTypeId<Mustache::SafeString>()) {
+		if (tag.sigil == 0 && (m_escaper == Mustache::Escaper::html() || m_escaper == Mustache::Escaper::xml())) {
+			// The built-in escapers for markup are checked against a plain replacement.
+			text.replace(QLatin1Char('&'), QLatin1String("&amp;"));
+			text.replace(QLatin1Char('<'), QLatin1String("&lt;"));
+			text.replace(QLatin1Char('>'), QLatin1String("&gt;"));
+			text.replace(QLatin1Char('"'), QLatin1String("&quot;"));
+			if (m_escaper == Mustache::Escaper::xml()) {
+				text.replace(QLatin1Char('\''), QLatin1String("&apos;"));
+			}
+		} else if (tag.sigil == 0) {
+			QString escaped;
+			m_escaper->append(text, escaped);
+			text = escaped;
+		} else if (tag.sigil == '&') {
+			text.replace(QLatin1String("&lt;"), QLatin1String("<"));
+			text.replace(QLatin1String("&gt;"), QLatin1String(">"));
+			text.replace(QLatin1String("&quot;"), QLatin1String("\""));
+			text.replace(QLatin1String("&amp;"), QLatin1String("&"));
+		}
+	}
+	append(text, tag.start);
+}
+
+void ReferenceRenderer::setError(const QString& error, int pos)
+{
+	if (m_errorPos == -1) {
+		m_error = error;
+		m_errorPos = pos;
+		m_errorPartial = m_partials.isEmpty() ? QString() : m_partials.last();
+	}
+}
+
+/** Returns the source which @p _template was compiled from, without the source
+ * of any partials which were inlined into it, which is appended to it.
+ */
+QString originalSource(const Mustache::Template& _template)
+{
+	foreach (const Mustache::Node& node, _template.nodes()) {
+		if (node.type == Mustache::Node::Partial && node.next != 0) {
+			return _template.source().left(node.start);
+		}
+	}
+	return _template.source();
+}
+
+/** Checks rendered templates against the reference renderer, which reads the
+ * data which the context was created with rather than the context itself.
+ */
+class ReferenceVerifier : public Mustache::Verifier
+{
+public:
+	explicit ReferenceVerifier(const QVariant& data)
+		: m_data(data)
+	{}
+
+	virtual QString verify(const Mustache::Template& _template, Mustache::Context* context, const QString& output,
+	                       Mustache::Renderer* renderer, int* pos, QString* partial)
+	{
+		const Mustache::Escaper* escaper = _template.escaper() ? _template.escaper() : renderer->escaper();
+		ReferenceRenderer reference(renderer, output, escaper);
+		ReferenceContext referenceContext(m_data, context->partialResolver());
+		reference.render(originalSource(_template), &referenceContext);
+		if (reference.errorPos() != -1) {
+			*pos = reference.errorPos();
+			*partial = reference.errorPartial();
+			return "The reference renderer failed: " + reference.error();
+		} else if (reference.mismatch() != -1) {
+			*pos = reference.mismatchPos();
+			*partial = reference.mismatchPartial();
+			return "Output differs from the reference renderer at character " + QString::number(reference.mismatch());
+		}
+		return QString();
+	}
+
+private:
+	QVariant m_data;
+};
+
+/** Renders @p _template with the reference verifier, both as compiled and after
+ * loading it from its binary form, and returns a description of the first
+ * difference from the reference renderer, or an empty string.
+ */
+QString verify(const Mustache::Template& _template, const QVariant& data, Mustache::PartialResolver* partials)
+{
+	ReferenceVerifier verifier(data);
+	Mustache::Renderer renderer;
+	renderer.setVerifier(&verifier);
+
+	Mustache::QtVariantContext context(data, partials);
+	const QString output = renderer.render(_template, &context);
+	if (renderer.error().startsWith("Output differs") || renderer.error().startsWith("The reference")) {
+		return QString("%1 at position %2 %3").arg(renderer.error(), QString::number(renderer.errorPos()), renderer.errorPartial());
+	}
+
+	Mustache::Template loaded = Mustache::Template::fromBinary(_template.toBinary());
+	if (_template.errorPos() == -1) {
+		context.reset(data);
+		if (renderer.render(loaded, &context) != output) {
+			return "Template loaded from binary data renders differently: " + renderer.error();
+		}
+	}
+	return QString();
+}
+
+void TestVerification::testReference()
+{
+	QHash<QString, QString> partials;
+	partials["item"] = "* {{name}}\n";
+	Mustache::PartialMap compiledPartials(partials);
+
+	QVariantHash contacts;
+	QVariantHash jim;
+	jim["name"] = "Jim";
+	jim["email"] = "jim@example.com";
+	QVariantHash sue;
+	sue["name"] = "Sue";
+	sue["email"] = "sue@example.com";
+	contacts["contacts"] = QVariantList() << jim << sue;
+
+	Mustache::Renderer renderer;
+	ReferenceVerifier verifier(contacts);
+	renderer.setVerifier(&verifier);
+	Mustache::Template compiled = renderer.compile("Contacts:\n{{#contacts}}{{>item}}{{/contacts}}", &compiledPartials);
+
+	Mustache::QtVariantContext context(contacts, &compiledPartials);
+	QCOMPARE(renderer.render(compiled, &context), QString("Contacts:\n* Jim\n* Sue\n"));
+	QVERIFY2(renderer.error().isEmpty(), qPrintable(renderer.error()));
+
+	// the inlined copy of the partial no longer matches the partial itself
+	partials["item"] = "* {{name}} <{{email}}>\n";
+	Mustache::PartialMap changedPartials(partials);
+	Mustache::QtVariantContext changedContext(contacts, &changedPartials);
+	QCOMPARE(renderer.render(compiled, &changedContext), QString("Contacts:\n* Jim\n* Sue\n"));
+	QCOMPARE(renderer.error(), QString("Output differs from the reference renderer at character 15"));
+	QCOMPARE(renderer.errorPartial(), QString("item"));
+	QCOMPARE(renderer.errorPos(), 10);
+
+	// the reference has its own scanner, number formatting and escaping
+	QVariantHash args;
+	args["price"] = 1234.5;
+	args["rows"] = QVariant::fromValue(Mustache::LazySequence([](int index, QVariant* item) {
+		*item = index;
+		return index < 3;
+	}));
+	ReferenceVerifier formatVerifier(args);
+	renderer.setVerifier(&formatVerifier);
+	Mustache::QtVariantContext formatContext(args);
+	renderer.setEscaper(Mustache::Escaper::json());
+	QCOMPARE(renderer.render("{{price|,.2}} {{#rows}}{{=<% %>=}}<%.%>\"<%={{ }}=%>{{/rows}} {{price}}", &formatContext),
+	         QString("1,234.50 0\"1\"2\" 1234.5"));
+	QVERIFY2(renderer.error().isEmpty(), qPrintable(renderer.error()));
+	renderer.setEscaper(Mustache::Escaper::html());
+	QCOMPARE(renderer.render("{{#rows}}\n  {{>missing}}\n{{/rows}}{{{price}}}<{{&price}}>", &formatContext),
+	         QString("      1234.5<1234.5>"));
+	QVERIFY2(renderer.error().isEmpty(), qPrintable(renderer.error()));
+}
+
+void TestVerification::testSpecs_data()
+{
+	addSpecTestRows();
+}
+
+/*
+ * Checks that each spec test case renders the same with its partials inlined
+ * as with the reference renderer.
+ */
+void TestVerification::testSpecs()
+{
+	QFETCH(QVariantMap, data);
+	QFETCH(QString, template_);
+	QFETCH(PartialsHash, partials);
+
+	Mustache::Renderer renderer;
+	Mustache::PartialMap partialsMap(partials);
+	Mustache::Template compiled = renderer.compile(template_, &partialsMap);
+
+	QString difference = verify(compiled, data, &partialsMap);
+	QVERIFY2(difference.isEmpty(), qPrintable(difference));
+}
+
+/** Generates random templates, partials and data which use the same keys. */
+class TemplateGenerator
+{
+public:
+	explicit TemplateGenerator(quint32 seed)
+		: m_random(seed)
+	{}
+
+	/** Returns a template with sections nested up to @p depth levels, which may
+	 * include the partials numbered from @p firstPartial, so that partials
+	 * do not include themselves.
+	 */
+	QString generateTemplate(int depth, int firstPartial)
+	{
+		static const char* const texts[] = {"x", " ", "  ", "\n", "\r\n", "<&>", "\"'", "{", "}", "text"};
+		static const char* const keys[] = {"a", "b", "list", "flag", "map.a", "missing", "."};
+		const int keyCount = sizeof(keys) / sizeof(keys[0]);
+
+		QString result;
+		const int parts = bounded(8);
+		for (int i = 0; i < parts; i++) {
+			const QString key = keys[bounded(keyCount)];
+			const QString indentation(bounded(3), QLatin1Char(' '));
+			switch (bounded(depth > 0 ? 9 : 6)) {
+			case 0:
+			case 1:
+				result += texts[bounded(sizeof(texts) / sizeof(texts[0]))];
+				break;
+			case 2:
+				result += "{{" + key + "}}";
+				break;
+			case 3:
+				result += bounded(2) ? "{{{" + key + "}}}" : "{{& " + key + " }}";
+				break;
+			case 4:
+				result += indentation + "{{! comment }}\n";
+				break;
+			case 5:
+				if (firstPartial < PartialCount) {
+					const int partial = firstPartial + bounded(PartialCount - firstPartial);
+					// partials on their own line are indented
+					result += bounded(2) ? QString("\n%1{{>p%2}}\n").arg(indentation).arg(partial)
+					                     : QString("{{>p%1}}").arg(partial);
+				}
+				break;
+			default:
+			{
+				const QString type = bounded(3) ? "#" : "^";
+				const QString body = generateTemplate(depth - 1, firstPartial);
+				// sections on their own line are standalone
+				if (bounded(2)) {
+					result += "\n" + indentation + "{{" + type + key + "}}\n" + body + "\n" + indentation + "{{/" + key + "}}\n";
+				} else {
+					result += "{{" + type + key + "}}" + body + "{{/" + key + "}}";
+				}
+			}
+			break;
+			}
+		}
+		return result;
+	}
+
+	PartialsHash generatePartials()
+	{
+		PartialsHash partials;
+		for (int i = 0; i < PartialCount; i++) {
+			partials.insert(QString("p%1").arg(i), generateTemplate(2, i + 1));
+		}
+		return partials;
+	}
+
+	QVariant generateValue(int depth)
+	{
+		switch (bounded(depth > 0 ? 9 : 6)) {
+		case 0:
+			return QVariant();
+		case 1:
+			return bounded(2) == 1;
+		case 2:
+			return int(bounded(1000)) - 500;
+		case 3:
+			return double(bounded(1000)) / 8;
+		case 4:
+			return QString("<b>\"%1\" & 'more'</b>").arg(bounded(10));
+		case 5:
+			return QString();
+		case 6:
+		case 7:
+		{
+			QVariantList list;
+			const int count = bounded(4);
+			for (int i = 0; i < count; i++) {
+				list << generateValue(depth - 1);
+			}
+			return list;
+		}
+		default:
+			return generateData(depth - 1);
+		}
+	}
+
+	QVariantHash generateData(int depth)
+	{
+		QVariantHash data;
+		data["a"] = generateValue(depth);
+		data["b"] = generateValue(depth);
+		data["flag"] = generateValue(0);
+		data["list"] = generateValue(depth);
+		QVariantHash map;
+		map["a"] = generateValue(0);
+		data["map"] = map;
+		return data;
+	}
+
+private:
+	enum { PartialCount = 3 };
+
+	int bounded(int limit)
+	{
+		return int(m_random.bounded(quint32(limit)));
+	}
+
+	QRandomGenerator m_random;
+};
+
+/*
+ * Renders randomly generated templates with their partials inlined and checks
+ * that the output matches the reference renderer. The number of templates and
+ * the first seed can be set with the MUSTACHE_VERIFY_COUNT and
+ * MUSTACHE_VERIFY_SEED environment variables to run more of them.
+ */
+void TestVerification::testRandomTemplates()
+{
+	bool ok = false;
+	int count = qEnvironmentVariableIntValue("MUSTACHE_VERIFY_COUNT", &ok);
+	if (!ok) {
+		count = 500;
+	}
+	const quint32 firstSeed = quint32(qEnvironmentVariableIntValue("MUSTACHE_VERIFY_SEED"));
+
+	for (quint32 seed = firstSeed; seed < firstSeed + quint32(count); seed++) {
+		TemplateGenerator generator(seed);
+		const QString source = generator.generateTemplate(3, 0);
+		const PartialsHash partials = generator.generatePartials();
+		const QVariant data = generator.generateData(3);
+
+		Mustache::Renderer renderer;
+		Mustache::PartialMap partialsMap(partials);
+		Mustache::Template compiled = renderer.compile(source, &partialsMap);
+		QVERIFY2(compiled.errorPos() == -1, qPrintable(QString("Seed %1: %2").arg(QString::number(seed), compiled.error())));
+
+		QString difference = verify(compiled, data, &partialsMap);
+		QVERIFY2(difference.isEmpty(), qPrintable(QString("Seed %1: %2\nTemplate:\n%3").arg(QString::number(seed), difference, source)));
+	}
+}
+
+QTEST_GUILESS_MAIN(TestVerification)
@@ -0,0 +1,491 @@
+/*
+  Copyright 2012, Robert Knight
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice,
+    this list of conditions and the following disclaimer.
+
+    Redistributions in binary form must reproduce the above copyright notice,
+    this list of conditions and the following disclaimer in the documentation
+    and/or other materials provided with the distribution.
+*/
+
+/* qt-mustache-codegen compiles Mustache templates into C++ render functions.
+ *
+ * Usage: qt-mustache-codegen [--namespace NAME] OUTPUT_HEADER OUTPUT_SOURCE INPUT...
+ *
+ * Each '<name>.mustache' input produces a function
+ *
+ *   QString name(Mustache::Renderer* renderer, Mustache::Context* context);
+ *
+ * which renders the template in the same way as Renderer::render().  Literal text
+ * becomes static data, tags become calls on the context and sections become loops.
+ * The renderer's limits and error reporting apply as they do to Renderer::render(),
+ * except that errors are reported at position 0.  Generated code does not support:
+ *
+ *  - the FragmentCache, so cacheable sections and partials are always rendered
+ *  - OutputSink and SegmentedOutput, since the functions return a QString
+ *  - Renderer::setTagMarkers(), since templates are compiled with the default markers
+ *  - Renderer::setVerifier()
+ *
+ * Lambda sections receive the parsed section, from a copy of the template which is
+ * compiled the first time that a lambda section of the template is rendered.
+ *
+ * Inputs ending in '.json' are read as Mustache spec files, producing one function
+ * for each test case.  The generated templates() function maps template names
+ * (or '<spec file> - <test name>' for spec test cases) to the render functions.
+ */
+
+#include "mustache.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QStringList>
+#include <QtCore/QTextStream>
+
+#include <stdio.h>
+
+class CodeGenerator
+{
+public:
+	explicit CodeGenerator(const QString& nameSpace);
+
+	/** Compiles @p source and adds a render function for it.
+	 * Returns false and sets @p error if the template cannot be compiled.
+	 */
+	bool addTemplate(const QString& name, const QString& functionName, const QString& source, QString* error);
+
+	QString header(const QString& inputs) const;
+	QString source(const QString& headerName, const QString& inputs) const;
+
+private:
+	QString generateBody(const Mustache::Template& _template, int begin, int end, const QString& functionName, int depth);
+	QString keyName(const QString& key);
+
+	QString m_nameSpace;
+	Mustache::Renderer m_renderer;
+
+	QStringList m_templateNames;
+	QStringList m_functionNames;
+	QHash<QString, QString> m_keyNames;
+	QString m_keyDefinitions;
+	QString m_bodyDefinitions;
+	QString m_templateDefinitions;
+	QString m_functionDefinitions;
+	int m_bodyCount;
+};
+
+QString cppStringLiteral(QStringView text)
+{
+	QString literal = "u\"";
+	bool lastWasHexEscape = false;
+	int lineLength = 0;
+	for (int i = 0; i < text.size(); i++) {
+		ushort ch = text.at(i).unicode();
+		bool isHexDigit = (ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'f') || (ch >= 'A' && ch <= 'F');
+
+		// A hex escape consumes any hex digits which follow it, so start a new literal.
+		if (lastWasHexEscape && isHexDigit) {
+			literal += "\" u\"";
+		}
+		lastWasHexEscape = false;
+
+		if (ch == '\\') {
+			literal += "\\\\";
+		} else if (ch == '"') {
+			literal += "\\\"";
+		} else if (ch == '?') {
+			literal += "\\?"; // Avoids trigraphs.
+		} else if (ch == '\n') {
+			literal += "\\n";
+		} else if (ch == '\t') {
+			literal += "\\t";
+		} else if (ch >= 0x20 && ch < 0x7f) {
+			literal += QChar(ch);
+		} else {
+			literal += QString("\\x%1").arg(int(ch), 4, 16, QLatin1Char('0'));
+			lastWasHexEscape = true;
+		}
+
+		++lineLength;
+		if ((ch == '\n' || lineLength >= 100) && i < text.size() - 1) {
+			literal += "\"\n\t\tu\"";
+			lastWasHexEscape = false;
+			lineLength = 0;
+		}
+	}
+	literal += '"';
+	return literal;
+}
+
+QString cppIdentifier(const QString& name)
+{
+	static const QStringList keywords = QStringList() << "and" << "auto" << "bool" << "break" << "case"
+	    << "catch" << "char" << "class" << "const" << "continue" << "default" << "delete" << "do" << "double"
+	    << "else" << "enum" << "explicit" << "export" << "extern" << "false" << "float" << "for" << "friend"
+	    << "goto" << "if" << "inline" << "int" << "long" << "mutable" << "namespace" << "new" << "not"
+	    << "operator" << "or" << "private" << "protected" << "public" << "register" << "return" << "short"
+	    << "signed" << "sizeof" << "static" << "struct" << "switch" << "template" << "this" << "throw"
+	    << "true" << "try" << "typedef" << "typename" << "union" << "unsigned" << "using" << "virtual"
+	    << "void" << "volatile" << "while" << "templates" << "RenderFunction" << "literal";
+
+	QString identifier;
+	foreach (const QChar& ch, name) {
+		bool valid = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9');
+		identifier += valid ? ch : QChar('_');
+	}
+	// Names of the generated helpers are reserved, as well as keywords.
+	if (identifier.isEmpty() || identifier.at(0).isDigit() || keywords.contains(identifier) ||
+	    identifier.startsWith("key_") || identifier.startsWith("body_") || identifier.startsWith("template_")) {
+		identifier = '_' + identifier;
+	}
+	return identifier;
+}
+
+CodeGenerator::CodeGenerator(const QString& nameSpace)
+	: m_nameSpace(nameSpace)
+	, m_bodyCount(0)
+{
+}
+
+QString CodeGenerator::keyName(const QString& key)
+{
+	if (!m_keyNames.contains(key)) {
+		QString name = "key_" + QString::number(m_keyNames.count());
+		m_keyNames.insert(key, name);
+		m_keyDefinitions += QString("const QString %1 = literal(%2, %3);\n")
+		    .arg(name, cppStringLiteral(key), QString::number(key.length()));
+	}
+	return m_keyNames.value(key);
+}
+
+bool CodeGenerator::addTemplate(const QString& name, const QString& functionName, const QString& source, QString* error)
+{
+	// Different names can map to the same identifier, eg. 'a-b' and 'a_b', which
+	// would otherwise only fail when the generated code is compiled.
+	const int existing = m_functionNames.indexOf(functionName);
+	if (existing != -1) {
+		*error = QString("the function name %1 is already used for %2").arg(functionName, m_templateNames.at(existing));
+		return false;
+	}
+	if (m_templateNames.contains(name)) {
+		*error = "there is already a template with this name";
+		return false;
+	}
+
+	Mustache::Template compiled = m_renderer.compile(source);
+	if (compiled.errorPos() != -1) {
+		*error = QString("%1 at position %2").arg(compiled.error(), QString::number(compiled.errorPos()));
+		return false;
+	}
+
+	// Lambda sections are passed a section of the compiled template, which is
+	// compiled from its source when a lambda first needs it.
+	bool hasSections = false;
+	foreach (const Mustache::Node& node, compiled.nodes()) {
+		hasSections = hasSections || node.type == Mustache::Node::Section;
+	}
+	if (hasSections) {
+		m_templateDefinitions += QString(
+		    "const Mustache::Template& template_%1()\n"
+		    "{\n"
+		    "\tstatic const Mustache::Template compiled = Mustache::Renderer().compile(literal(%2, %3));\n"
+		    "\treturn compiled;\n"
+		    "}\n"
+		    "\n").arg(functionName, cppStringLiteral(source), QString::number(source.length()));
+	}
+
+	QString body = generateBody(compiled, 0, compiled.nodes().count(), functionName, 1);
+	m_functionDefinitions += QString(
+	    "QString %1(Mustache::Renderer* renderer, Mustache::Context* context)\n"
+	    "{\n"
+	    "\tQString output;\n"
+	    "\trenderer->clearError();\n"
+	    "\t%2(renderer, context, output);\n"
+	    "\treturn output;\n"
+	    "}\n"
+	    "\n").arg(functionName, body);
+
+	m_templateNames << name;
+	m_functionNames << functionName;
+	return true;
+}
+
+/** Generates a function which renders the nodes from @p begin to @p end, whose
+ * sections and partials are nested @p depth levels deep, and returns its name.
+ */
+QString CodeGenerator::generateBody(const Mustache::Template& _template, int begin, int end, const QString& functionName,
+                                    int depth)
+{
+	const QVector<Mustache::Node>& nodes = _template.nodes();
+	const QString source = _template.source();
+	const QString name = QString("body_%1_%2").arg(functionName, QString::number(m_bodyCount++));
+
+	// Like Renderer::render(), rendering stops at the first error and when a
+	// limit is reached, which is checked after each node.
+	const QString stopOnError = "\tif (!renderer->withinLimits(output)) {\n"
+	                            "\t\treturn;\n"
+	                            "\t}\n";
+
+	QString code;
+	int i = begin;
+	while (i < end) {
+		const Mustache::Node& node = nodes.at(i);
+		switch (node.type) {
+		case Mustache::Node::Text:
+		{
+			QStringView text = QStringView(source).mid(node.start, node.end - node.start);
+			code += QString("\toutput += QStringView(%1, %2);\n").arg(cppStringLiteral(text), QString::number(text.size()));
+			code += stopOnError;
+			++i;
+		}
+		break;
+		case Mustache::Node::Value:
+		{
+			const char* escapeMode = node.escapeMode == Mustache::Tag::Escape ? "Escape" :
+			                         node.escapeMode == Mustache::Tag::Unescape ? "Unescape" : "Raw";
+			if (node.precision == -1 && !node.grouping) {
+				code += QString("\trenderer->renderValue(%1, Mustache::Tag::%2, context, output);\n")
+				    .arg(keyName(node.key), escapeMode);
+			} else {
+				code += QString("\trenderer->renderValue(%1, Mustache::Tag::%2, context, output, %3, %4);\n")
+				    .arg(keyName(node.key), escapeMode, QString::number(node.precision), node.grouping ? "true" : "false");
+			}
+			code += stopOnError;
+			++i;
+		}
+		break;
+		case Mustache::Node::Section:
+		{
+			// Section bodies are generated as separate functions, which are
+			// defined before the function which uses them.
+			QString key = keyName(node.key);
+			QString sectionBody = generateBody(_template, i + 1, node.next, functionName, depth + 1);
+			code += QString(
+			    "\t{\n"
+			    "\t\tconst Mustache::ResolvedValue value = context->resolve(%1);\n"
+			    "\t\tif (value.kind == Mustache::ResolvedValue::List) {\n"
+			    "\t\t\tif (!renderer->enterSection(%3, output)) {\n"
+			    "\t\t\t\treturn;\n"
+			    "\t\t\t}\n"
+			    "\t\t\tfor (int i = 0;; i++) {\n"
+			    "\t\t\t\tif (value.count < 0) {\n"
+			    "\t\t\t\t\tif (!context->pushNextItem(value, i)) {\n"
+			    "\t\t\t\t\t\tbreak;\n"
+			    "\t\t\t\t\t}\n"
+			    "\t\t\t\t} else if (i < value.count) {\n"
+			    "\t\t\t\t\tcontext->pushResolved(value, i);\n"
+			    "\t\t\t\t} else {\n"
+			    "\t\t\t\t\tbreak;\n"
+			    "\t\t\t\t}\n"
+			    "\t\t\t\tif (!renderer->enterListItem(output)) {\n"
+			    "\t\t\t\t\tcontext->pop();\n"
+			    "\t\t\t\t\treturn;\n"
+			    "\t\t\t\t}\n"
+			    "\t\t\t\t%2(renderer, context, output);\n"
+			    "\t\t\t\tcontext->pop();\n"
+			    "\t\t\t\tif (renderer->errorPos() != -1) {\n"
+			    "\t\t\t\t\treturn;\n"
+			    "\t\t\t\t}\n"
+			    "\t\t\t}\n"
+			    "\t\t} else if (value.kind == Mustache::ResolvedValue::Lambda) {\n"
+			    "\t\t\toutput += renderer->evalSection(%1, template_%4(), %5, context);\n"
+			    "\t\t} else if (value.kind != Mustache::ResolvedValue::Falsy) {\n"
+			    "\t\t\tif (!renderer->enterSection(%3, output)) {\n"
+			    "\t\t\t\treturn;\n"
+			    "\t\t\t}\n"
+			    "\t\t\tcontext->pushResolved(value);\n"
+			    "\t\t\t%2(renderer, context, output);\n"
+			    "\t\t\tcontext->pop();\n"
+			    "\t\t}\n"
+			    "\t}\n").arg(key, sectionBody, QString::number(depth), functionName, QString::number(i));
+			code += stopOnError;
+			i = node.next;
+		}
+		break;
+		case Mustache::Node::InvertedSection:
+		{
+			QString key = keyName(node.key);
+			QString sectionBody = generateBody(_template, i + 1, node.next, functionName, depth + 1);
+			code += QString(
+			    "\tif (context->isFalse(%1)) {\n"
+			    "\t\tif (!renderer->enterSection(%3, output)) {\n"
+			    "\t\t\treturn;\n"
+			    "\t\t}\n"
+			    "\t\t%2(renderer, context, output);\n"
+			    "\t}\n").arg(key, sectionBody, QString::number(depth));
+			code += stopOnError;
+			i = node.next;
+		}
+		break;
+		case Mustache::Node::Partial:
+			code += QString(
+			    "\tif (!renderer->enterSection(%3, output) || !renderer->renderPartial(%1, %2, context, output)) {\n"
+			    "\t\treturn;\n"
+			    "\t}\n").arg(keyName(node.key), QString::number(node.indentation), QString::number(depth));
+			// Partials which were inlined when the template was compiled are
+			// still rendered through the renderer.
+			i = node.next > i ? node.next : i + 1;
+			break;
+		}
+	}
+
+	m_bodyDefinitions += QString(
+	    "void %1(Mustache::Renderer* renderer, Mustache::Context* context, QString& output)\n"
+	    "{\n"
+	    "\tQ_UNUSED(renderer);\n"
+	    "\tQ_UNUSED(context);\n"
+	    "%2"
+	    "}\n"
+	    "\n").arg(name, code);
+	return name;
+}
+
+QString CodeGenerator::header(const QString& inputs) const
+{
+	QString code;
+	code += "// Generated by qt-mustache-codegen from " + inputs + ".\n";
+	code += "// Do not edit, changes will be lost when the templates are compiled again.\n";
+	code += "\n";
+	code += "#pragma once\n";
+	code += "\n";
+	code += "#include \"mustache.h\"\n";
+	code += "\n";
+	code += "#include <QtCore/QHash>\n";
+	code += "\n";
+	code += "namespace " + m_nameSpace + "\n{\n\n";
+	code += "typedef QString (*RenderFunction)(Mustache::Renderer* renderer, Mustache::Context* context);\n";
+	code += "\n";
+	foreach (const QString& functionName, m_functionNames) {
+		code += "QString " + functionName + "(Mustache::Renderer* renderer, Mustache::Context* context);\n";
+	}
+	code += "\n";
+	code += "/** Returns the generated render functions, keyed by template name. */\n";
+	code += "QHash<QString, RenderFunction> templates();\n";
+	code += "\n}\n";
+	return code;
+}
+
+QString CodeGenerator::source(const QString& headerName, const QString& inputs) const
+{
+	QString code;
+	code += "// Generated by qt-mustache-codegen from " + inputs + ".\n";
+	code += "// Do not edit, changes will be lost when the templates are compiled again.\n";
+	code += "\n";
+	code += "#include \"" + headerName + "\"\n";
+	code += "\n";
+	code += "namespace " + m_nameSpace + "\n{\n\n";
+	code += "namespace {\n\n";
+	code += "QString literal(const char16_t* text, int length)\n";
+	code += "{\n";
+	code += "\treturn QString::fromRawData(reinterpret_cast<const QChar*>(text), length);\n";
+	code += "}\n\n";
+	code += m_keyDefinitions;
+	code += "\n";
+	code += m_templateDefinitions;
+	code += m_bodyDefinitions;
+	code += "}\n\n";
+	code += m_functionDefinitions;
+	code += "QHash<QString, RenderFunction> templates()\n";
+	code += "{\n";
+	code += "\tQHash<QString, RenderFunction> functions;\n";
+	for (int i = 0; i < m_templateNames.count(); i++) {
+		code += QString("\tfunctions.insert(literal(%1, %2), %3);\n")
+		    .arg(cppStringLiteral(m_templateNames.at(i)), QString::number(m_templateNames.at(i).length()), m_functionNames.at(i));
+	}
+	code += "\treturn functions;\n";
+	code += "}\n";
+	code += "\n}\n";
+	return code;
+}
+
+bool readFile(const QString& path, QString* content)
+{
+	QFile file(path);
+	if (!file.open(QIODevice::ReadOnly)) {
+		return false;
+	}
+	*content = QString::fromUtf8(file.readAll());
+	return true;
+}
+
+bool writeFile(const QString& path, const QString& content)
+{
+	QFile file(path);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		return false;
+	}
+	QByteArray data = content.toUtf8();
+	return file.write(data) == data.size();
+}
+
+int main(int argc, char** argv)
+{
+	QCoreApplication app(argc, argv);
+	QStringList args = app.arguments().mid(1);
+
+	QString nameSpace = "MustacheTemplates";
+	if (args.count() >= 2 && args.first() == "--namespace") {
+		nameSpace = args.at(1);
+		args = args.mid(2);
+	}
+	if (args.count() < 3) {
+		fprintf(stderr, "Usage: qt-mustache-codegen [--namespace NAME] OUTPUT_HEADER OUTPUT_SOURCE INPUT...\n"
+		                "\n"
+		                "Generated code does not use the fragment cache, output sinks, custom tag markers\n"
+		                "or verification, and reports errors at position 0.\n");
+		return 1;
+	}
+
+	QString headerPath = args.at(0);
+	QString sourcePath = args.at(1);
+	QStringList inputs = args.mid(2);
+	QStringList inputNames;
+
+	CodeGenerator generator(nameSpace);
+	foreach (const QString& input, inputs) {
+		QFileInfo info(input);
+		inputNames << info.fileName();
+
+		QString content;
+		if (!readFile(input, &content)) {
+			fprintf(stderr, "%s: cannot read file\n", qPrintable(input));
+			return 1;
+		}
+
+		QString error;
+		if (info.suffix() == "json") {
+			QJsonDocument document = QJsonDocument::fromJson(content.toUtf8());
+			QJsonArray testCases = document.object()["tests"].toArray();
+			for (int i = 0; i < testCases.size(); i++) {
+				QJsonObject testCase = testCases.at(i).toObject();
+				QString name = info.fileName() + " - " + testCase["name"].toString();
+				QString functionName = cppIdentifier(info.completeBaseName()) + '_' + QString::number(i);
+				if (!generator.addTemplate(name, functionName, testCase["template"].toString(), &error)) {
+					fprintf(stderr, "%s: %s: %s\n", qPrintable(input), qPrintable(name), qPrintable(error));
+					return 1;
+				}
+			}
+		} else {
+			QString name = info.completeBaseName();
+			if (!generator.addTemplate(name, cppIdentifier(name), content, &error)) {
+				fprintf(stderr, "%s: %s\n", qPrintable(input), qPrintable(error));
+				return 1;
+			}
+		}
+	}
+
+	QString inputList = inputNames.join(", ");
+	if (!writeFile(headerPath, generator.header(inputList)) ||
+	    !writeFile(sourcePath, generator.source(QFileInfo(headerPath).fileName(), inputList))) {
+		fprintf(stderr, "Unable to write generated code\n");
+		return 1;
+	}
+	return 0;
+}